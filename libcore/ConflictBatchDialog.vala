@@ -0,0 +1,144 @@
+/* Copyright (c) 2018 elementary LLC (https://elementary.io)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, Inc.,; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Lists the files that already exist in the destination of a copy or move, so that one
+ * rule can be picked for all of them while everything else is being transferred,
+ * including into the folders that are merged.
+ */
+public class Marlin.ConflictBatchDialog : Gtk.Dialog {
+    public enum ResponseType {
+        ASK,
+        SKIP,
+        REPLACE,
+        NEWEST,
+        UPDATE
+    }
+
+    private Gtk.Label primary_label;
+    private Gtk.Label secondary_label;
+    private Gtk.ListBox list_box;
+    private Gtk.Button update_button;
+
+    public ConflictBatchDialog (Gtk.Window? parent, GLib.File dest_dir, bool is_move, int n_files, string[] names) {
+        Object (
+            title: _("File conflicts"),
+            transient_for: parent,
+            deletable: false,
+            resizable: false,
+            skip_taskbar_hint: true
+        );
+
+        var dest_dir_display_name = GOF.File.@get (dest_dir).get_display_name ();
+        primary_label.label = ngettext ("%d file already exists in \"%s\"",
+                                        "%d files already exist in \"%s\"",
+                                        n_files).printf (n_files, dest_dir_display_name);
+
+        if (is_move) {
+            secondary_label.label = _("Everything else is already being moved, into the existing folders where they have the same name. Choose what happens to these files.");
+            /* Moves have no update rule */
+            update_button.visible = false;
+            update_button.no_show_all = true;
+            set_default_response (ResponseType.NEWEST);
+        } else {
+            secondary_label.label = _("Everything else is already being copied, into the existing folders where they have the same name. Choose what happens to these files.");
+        }
+
+        foreach (unowned string name in names) {
+            var row_label = new Gtk.Label (name);
+            row_label.ellipsize = Pango.EllipsizeMode.MIDDLE;
+            row_label.margin = 3;
+            row_label.xalign = 0;
+            list_box.add (row_label);
+        }
+
+        var shown = names.length;
+        if (shown < n_files) {
+            var more_label = new Gtk.Label (_("and %d more…").printf (n_files - shown));
+            more_label.margin = 3;
+            more_label.sensitive = false;
+            more_label.xalign = 0;
+            list_box.add (more_label);
+        }
+
+        list_box.show_all ();
+    }
+
+    construct {
+        var image = new Gtk.Image.from_icon_name ("dialog-warning", Gtk.IconSize.DIALOG);
+        image.valign = Gtk.Align.START;
+
+        primary_label = new Gtk.Label (null);
+        primary_label.get_style_context ().add_class (Granite.STYLE_CLASS_PRIMARY_LABEL);
+        primary_label.max_width_chars = 50;
+        primary_label.wrap = true;
+        primary_label.xalign = 0;
+
+        secondary_label = new Gtk.Label (null);
+        secondary_label.max_width_chars = 50;
+        secondary_label.wrap = true;
+        secondary_label.xalign = 0;
+
+        list_box = new Gtk.ListBox ();
+        list_box.selection_mode = Gtk.SelectionMode.NONE;
+
+        var scrolled = new Gtk.ScrolledWindow (null, null);
+        scrolled.hscrollbar_policy = Gtk.PolicyType.NEVER;
+        scrolled.min_content_height = 120;
+        scrolled.max_content_height = 240;
+        scrolled.propagate_natural_height = true;
+        scrolled.add (list_box);
+
+        var frame = new Gtk.Frame (null);
+        frame.margin_top = 12;
+        frame.add (scrolled);
+
+        var ask_button = (Gtk.Button) add_button (_("Ask for Each"), ResponseType.ASK);
+        ask_button.set_tooltip_text (_("Decide about each file when it is reached"));
+
+        add_button (_("Cancel"), Gtk.ResponseType.CANCEL);
+        add_button (_("Skip All"), ResponseType.SKIP);
+
+        var keep_newest_button = (Gtk.Button) add_button (_("Keep Newest"), ResponseType.NEWEST);
+        keep_newest_button.set_tooltip_text (_("Skip if original was modified more recently"));
+
+        update_button = (Gtk.Button) add_button (_("Update"), ResponseType.UPDATE);
+        update_button.set_tooltip_text (_("Skip if original has the same size and modification time"));
+
+        var replace_button = (Gtk.Button) add_button (_("Replace All"), ResponseType.REPLACE);
+        replace_button.get_style_context ().add_class (Gtk.STYLE_CLASS_DESTRUCTIVE_ACTION);
+
+        set_default_response (ResponseType.UPDATE);
+
+        var grid = new Gtk.Grid ();
+        grid.margin = 12;
+        grid.margin_top = 0;
+        grid.column_spacing = 12;
+        grid.row_spacing = 6;
+        grid.attach (image, 0, 0, 1, 2);
+        grid.attach (primary_label, 1, 0, 1, 1);
+        grid.attach (secondary_label, 1, 1, 1, 1);
+        grid.attach (frame, 1, 2, 1, 1);
+        grid.show_all ();
+
+        get_content_area ().add (grid);
+
+        var action_area = get_action_area ();
+        action_area.margin = 6;
+        action_area.margin_top = 14;
+    }
+}
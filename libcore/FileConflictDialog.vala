@@ -33,13 +33,15 @@ public class Marlin.FileConflictDialog : Gtk.Dialog {
         SKIP,
         RENAME,
         REPLACE,
-        NEWEST
+        NEWEST,
+        UPDATE
     }
 
     private string conflict_name;
     private Gtk.Entry rename_entry;
     private Gtk.Button replace_button;
     private Gtk.Button keep_newest_button;
+    private Gtk.Button update_button;
     private Gtk.CheckButton apply_all_checkbutton;
 
     private GOF.File source;
@@ -190,6 +192,9 @@ public class Marlin.FileConflictDialog : Gtk.Dialog {
         keep_newest_button = (Gtk.Button) add_button (_("Keep Newest"), ResponseType.NEWEST);
         keep_newest_button.set_tooltip_text (_("Skip if original was modified more recently"));
 
+        update_button = (Gtk.Button) add_button (_("Update"), ResponseType.UPDATE);
+        update_button.set_tooltip_text (_("Skip if original has the same size and modification time"));
+
         replace_button = (Gtk.Button) add_button (_("Replace"), ResponseType.REPLACE);
         replace_button.get_style_context ().add_class (Gtk.STYLE_CLASS_DESTRUCTIVE_ACTION);
 
@@ -356,6 +361,7 @@ public class Marlin.FileConflictDialog : Gtk.Dialog {
         rename_entry.text = conflict_name;
         if (source.is_directory && destination.is_directory) {
             replace_button.label = _("Merge");
+            update_button.set_tooltip_text (_("Merge, skipping files that have the same size and modification time"));
         }
 
         source.changed.connect (() => {
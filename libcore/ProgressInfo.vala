@@ -36,6 +36,8 @@ public class PF.Progress.Info : GLib.Object {
     private bool is_started;
     private bool is_finished;
     private bool is_paused;
+    private bool is_queued;
+    private bool is_background;
 
     private GLib.Source idle_source;
     private bool source_is_now;
@@ -65,7 +67,9 @@ public class PF.Progress.Info : GLib.Object {
     }
 
     public string get_status () {
-        if (status != null) {
+        if (is_queued) {
+            return _("Waiting for other operations on the same device");
+        } else if (status != null) {
             return status;
         } else {
             return _("Preparing");
@@ -100,6 +104,14 @@ public class PF.Progress.Info : GLib.Object {
         return is_paused;
     }
 
+    public bool get_is_queued () {
+        return is_queued;
+    }
+
+    public bool get_is_background () {
+        return is_background;
+    }
+
     public double get_progress () {
         if (activity_mode) {
             return -1;
@@ -145,12 +157,34 @@ public class PF.Progress.Info : GLib.Object {
     public void pause () {
         if (!is_paused) {
             is_paused = true;
+            changed_at_idle = true;
+            queue_idle (false);
         }
     }
 
     public void resume () {
         if (is_paused) {
             is_paused = false;
+            changed_at_idle = true;
+            queue_idle (false);
+        }
+    }
+
+    /* Lowers the job's I/O priority, see the background-bandwidth-limit preference */
+    public void set_background (bool background) {
+        if (is_background != background) {
+            is_background = background;
+            changed_at_idle = true;
+            queue_idle (false);
+        }
+    }
+
+    /* Set while the job waits for its device */
+    public void set_queued (bool queued) {
+        if (is_queued != queued) {
+            is_queued = queued;
+            changed_at_idle = true;
+            queue_idle (false);
         }
     }
 
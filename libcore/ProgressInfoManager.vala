@@ -51,4 +51,53 @@ public class PF.Progress.InfoManager : GLib.Object {
     public Gee.LinkedList<PF.Progress.Info> get_all_infos () {
         return progress_infos;
     }
+
+    public Gee.LinkedList<PF.Progress.Info> get_queued_infos () {
+        var queued = new Gee.LinkedList<PF.Progress.Info> ();
+        foreach (var info in progress_infos) {
+            if (info.get_is_queued ()) {
+                queued.add (info);
+            }
+        }
+
+        return queued;
+    }
+
+    /* Copies and moves that were still running when Files last quit can be picked up
+     * where they stopped. Closing the dialog leaves the choice for the next start. */
+    public void offer_resume (Gtk.Window? parent) {
+        foreach (unowned string journal in Marlin.FileOperations.get_interrupted_copies ()) {
+            var description = Marlin.FileOperations.describe_interrupted_copy (journal);
+            if (description == null) {
+                Marlin.FileOperations.discard_interrupted_copy (journal);
+                continue;
+            }
+
+            var dialog = new Granite.MessageDialog.with_image_from_icon_name (
+                _("Resume the interrupted operation?"),
+                _("%s was stopped before it finished. Files that were already done will not be copied again.").printf (description),
+                "dialog-information",
+                Gtk.ButtonsType.NONE
+            );
+            dialog.add_button (_("Discard"), Gtk.ResponseType.REJECT);
+            dialog.add_button (_("Resume"), Gtk.ResponseType.ACCEPT);
+            dialog.set_default_response (Gtk.ResponseType.ACCEPT);
+            if (parent != null) {
+                dialog.set_transient_for (parent);
+            }
+
+            var path = journal;
+            dialog.response.connect ((response) => {
+                if (response == Gtk.ResponseType.ACCEPT) {
+                    Marlin.FileOperations.resume_copy (path, parent);
+                } else if (response == Gtk.ResponseType.REJECT) {
+                    Marlin.FileOperations.discard_interrupted_copy (path);
+                }
+
+                dialog.destroy ();
+            });
+
+            dialog.show ();
+        }
+    }
 }
@@ -25,6 +25,9 @@
  */
 
 #include <string.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #include <gtk/gtk.h>
 #include <glib.h>
 #include "fm-list-model.h"
@@ -38,6 +41,7 @@ enum {
     PROP_0,
     PROP_HAS_CHILD,
     PROP_SIZE,
+    PROP_SCALE,
 };
 
 static GQuark attribute_name_q,
@@ -61,6 +65,8 @@ static void     fm_list_model_tree_model_init (GtkTreeModelIface *iface);
 static void     fm_list_model_drag_dest_init (GtkTreeDragDestIface *iface);
 static void     fm_list_model_sortable_init (GtkTreeSortableIface *iface);
 
+typedef struct FileEntryPool FileEntryPool;
+
 struct FMListModelDetails {
     GSequence *files;
     GHashTable *directory_reverse_map; /* map from directory to GSequenceIter's */
@@ -70,9 +76,15 @@ struct FMListModelDetails {
     gboolean        has_child;
     gint            sort_id;
     gint            icon_size;
+    gint            icon_scale;
     GtkSortType     order;
 
     gboolean sort_directories_first;
+
+    FileEntryPool *entry_pool;
+
+    GHashTable *pending_icons;  /* files whose pixbuf is resolved on the next idle */
+    guint pending_icons_id;
 };
 
 typedef struct FileEntry FileEntry;
@@ -81,18 +93,96 @@ struct FileEntry {
     GOFFile *file;
     GHashTable *reverse_map;    /* map from files to GSequenceIter's */
     GOFDirectoryAsync *subdirectory;
-    FileEntry *parent;
+    FileEntry *parent;          /* links free entries while in the pool */
     GSequence *files;
     GSequenceIter *ptr;
+    FileEntryPool *pool;
     guint loaded : 1;
 };
 
+/* FileEntries are carved out of fixed size chunks owned by the model, so that loading
+ * a large folder does not scatter hundreds of thousands of small blocks over the heap.
+ * Once the model holds no entries the chunks are released together. */
+#define FILE_ENTRY_CHUNK_SIZE 512
+
+struct FileEntryPool {
+    GSList *chunks;
+    FileEntry *free_list;
+    guint chunk_used;           /* entries handed out from the head chunk */
+    guint n_live;
+};
+
 G_DEFINE_TYPE_WITH_CODE (FMListModel, fm_list_model, G_TYPE_OBJECT,
                          G_IMPLEMENT_INTERFACE (GTK_TYPE_TREE_MODEL, fm_list_model_tree_model_init)
                          G_IMPLEMENT_INTERFACE (GTK_TYPE_TREE_DRAG_DEST, fm_list_model_drag_dest_init)
                          G_IMPLEMENT_INTERFACE (GTK_TYPE_TREE_SORTABLE, fm_list_model_sortable_init))
 
 
+static FileEntryPool *
+file_entry_pool_new (void)
+{
+    return g_new0 (FileEntryPool, 1);
+}
+
+static FileEntry *
+file_entry_pool_alloc (FileEntryPool *pool)
+{
+    FileEntry *entry;
+
+    if (pool->free_list != NULL) {
+        entry = pool->free_list;
+        pool->free_list = entry->parent;
+    } else {
+        if (pool->chunks == NULL || pool->chunk_used == FILE_ENTRY_CHUNK_SIZE) {
+            pool->chunks = g_slist_prepend (pool->chunks, g_new (FileEntry, FILE_ENTRY_CHUNK_SIZE));
+            pool->chunk_used = 0;
+        }
+        entry = (FileEntry *) pool->chunks->data + pool->chunk_used++;
+    }
+
+    memset (entry, 0, sizeof (FileEntry));
+    entry->pool = pool;
+    pool->n_live++;
+
+    return entry;
+}
+
+static void
+file_entry_pool_release (FileEntryPool *pool, FileEntry *entry)
+{
+    entry->parent = pool->free_list;
+    pool->free_list = entry;
+    pool->n_live--;
+}
+
+/* Returns all chunks to the system in one go. Does nothing while entries are in use. */
+static void
+file_entry_pool_trim (FileEntryPool *pool)
+{
+    if (pool->n_live > 0 || pool->chunks == NULL) {
+        return;
+    }
+
+    g_slist_free_full (pool->chunks, g_free);
+    pool->chunks = NULL;
+    pool->free_list = NULL;
+    pool->chunk_used = 0;
+
+#ifdef __GLIBC__
+    /* Give the freed arenas back to the OS instead of keeping them in the malloc cache */
+    malloc_trim (0);
+#endif
+}
+
+static void
+file_entry_pool_free (FileEntryPool *pool)
+{
+    g_warn_if_fail (pool->n_live == 0);
+
+    g_slist_free_full (pool->chunks, g_free);
+    g_free (pool);
+}
+
 static void
 file_entry_free (FileEntry *file_entry)
 {
@@ -107,7 +197,7 @@ file_entry_free (FileEntry *file_entry)
     if (file_entry->files != NULL) {
         g_sequence_free (file_entry->files);
     }
-    g_free (file_entry);
+    file_entry_pool_release (file_entry->pool, file_entry);
 }
 
 static GtkTreeModelFlags
@@ -213,6 +303,57 @@ fm_list_model_get_path (GtkTreeModel *tree_model, GtkTreeIter *iter)
     return path;
 }
 
+static gboolean
+fm_list_model_resolve_pending_icons (gpointer data)
+{
+    FMListModel *model = FM_LIST_MODEL (data);
+    GHashTable *pending;
+    GHashTableIter hash_iter;
+    GOFFile *file;
+    GList *iters, *l;
+    GtkTreePath *path;
+
+    model->details->pending_icons_id = 0;
+
+    /* Emitting row-changed may queue more files, so work on a detached batch */
+    pending = model->details->pending_icons;
+    model->details->pending_icons = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                           g_object_unref, NULL);
+
+    g_hash_table_iter_init (&hash_iter, pending);
+    while (g_hash_table_iter_next (&hash_iter, (gpointer *) &file, NULL)) {
+        gof_file_update_icon (file, model->details->icon_size, model->details->icon_scale);
+
+        iters = fm_list_model_get_all_iters_for_file (model, file);
+        for (l = iters; l != NULL; l = l->next) {
+            path = gtk_tree_model_get_path (GTK_TREE_MODEL (model), l->data);
+            gtk_tree_model_row_changed (GTK_TREE_MODEL (model), path, l->data);
+            gtk_tree_path_free (path);
+        }
+        g_list_free_full (iters, g_free);
+    }
+
+    g_hash_table_destroy (pending);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void
+fm_list_model_queue_icon_update (FMListModel *model, GOFFile *file)
+{
+    if (model->details->icon_size <= 1 ||
+        g_hash_table_contains (model->details->pending_icons, file))
+        return;
+
+    g_hash_table_add (model->details->pending_icons, g_object_ref (file));
+
+    /* Runs once all rows of the current frame have been asked for, ahead of the next redraw */
+    if (model->details->pending_icons_id == 0)
+        model->details->pending_icons_id = g_idle_add_full (GDK_PRIORITY_REDRAW - 10,
+                                                            fm_list_model_resolve_pending_icons,
+                                                            model, NULL);
+}
+
 static void
 fm_list_model_get_value (GtkTreeModel *tree_model, GtkTreeIter *iter, int column, GValue *value)
 {
@@ -268,7 +409,11 @@ fm_list_model_get_value (GtkTreeModel *tree_model, GtkTreeIter *iter, int column
     case FM_LIST_MODEL_PIXBUF:
         g_value_init (value, GDK_TYPE_PIXBUF);
         if (file != NULL) {
-            gof_file_update_icon (file, model->details->icon_size, file->pix_scale);
+            /* GTK asks for this many times per row while measuring and drawing so never
+             * resolve the icon here. Until it is ready the previous pixbuf, if any, is shown */
+            if (file->pix == NULL || file->pix_size != model->details->icon_size ||
+                file->pix_scale != model->details->icon_scale)
+                fm_list_model_queue_icon_update (model, file);
             if (file->pix != NULL)
                 g_value_set_object(value, file->pix);
         }
@@ -677,7 +822,7 @@ add_dummy_row (FMListModel *model, FileEntry *parent_entry)
     FileEntry *dummy_file_entry;
     GtkTreeIter iter;
     GtkTreePath *path;
-    dummy_file_entry = g_new0 (FileEntry, 1);
+    dummy_file_entry = file_entry_pool_alloc (model->details->entry_pool);
     dummy_file_entry->parent = parent_entry;
     dummy_file_entry->ptr = g_sequence_insert_sorted (parent_entry->files, dummy_file_entry,
                                                       fm_list_model_file_entry_compare_func, model);
@@ -716,11 +861,8 @@ fm_list_model_add_file (FMListModel *model, GOFFile *file,
         return FALSE;
     }
 
-    file_entry = g_new0 (FileEntry, 1);
+    file_entry = file_entry_pool_alloc (model->details->entry_pool);
     file_entry->file = file; /* Does not increase reference count */
-    file_entry->parent = NULL;
-    file_entry->subdirectory = NULL;
-    file_entry->files = NULL;
 
     files = model->details->files;
     parent_hash = model->details->top_reverse_map;
@@ -836,6 +978,110 @@ fm_list_model_file_changed (FMListModel *model, GOFFile *file,
     gtk_tree_path_free (path);
 }
 
+typedef struct {
+    GOFFile *file;
+    guint    distance;  /* rows away from the visible range */
+    gsize    bytes;
+} ResidentPixbuf;
+
+static gint
+resident_pixbuf_compare_farthest_first (gconstpointer a, gconstpointer b)
+{
+    const ResidentPixbuf *ra = a;
+    const ResidentPixbuf *rb = b;
+
+    return (ra->distance < rb->distance) - (ra->distance > rb->distance);
+}
+
+static void
+collect_resident_pixbufs (GSequence *files, GSequenceIter *start, GSequenceIter *end,
+                          guint *pos, guint *start_pos, guint *end_pos,
+                          GArray *resident, gsize *total)
+{
+    GSequenceIter *ptr;
+    FileEntry *file_entry;
+    ResidentPixbuf res;
+
+    for (ptr = g_sequence_get_begin_iter (files); !g_sequence_iter_is_end (ptr); ptr = g_sequence_iter_next (ptr)) {
+        file_entry = g_sequence_get (ptr);
+
+        if (ptr == start)
+            *start_pos = *pos;
+        if (ptr == end)
+            *end_pos = *pos;
+
+        if (file_entry->file != NULL && file_entry->file->pix != NULL) {
+            res.file = file_entry->file;
+            res.distance = *pos;
+            res.bytes = gdk_pixbuf_get_byte_length (file_entry->file->pix);
+            *total += res.bytes;
+            g_array_append_val (resident, res);
+        }
+
+        (*pos)++;
+
+        if (file_entry->files != NULL)
+            collect_resident_pixbufs (file_entry->files, start, end, pos, start_pos, end_pos, resident, total);
+    }
+}
+
+/**
+ * fm_list_model_trim_pixbufs:
+ *
+ * Drops the pixbufs of rows outside the visible range, farthest first, until the
+ * pixbufs held by the model's files fit in @budget bytes. Dropped pixbufs are
+ * reloaded from the icon or thumbnail cache when the rows are displayed again.
+ */
+void
+fm_list_model_trim_pixbufs (FMListModel *model, GtkTreePath *start_path, GtkTreePath *end_path, gsize budget)
+{
+    GtkTreeIter start_iter, end_iter;
+    GArray *resident;
+    ResidentPixbuf *res;
+    gsize total = 0;
+    guint pos = 0, start_pos = 0, end_pos = G_MAXUINT;
+    guint i, evicted = 0;
+
+    g_return_if_fail (FM_IS_LIST_MODEL (model));
+
+    if (!fm_list_model_get_iter (GTK_TREE_MODEL (model), &start_iter, start_path) ||
+        !fm_list_model_get_iter (GTK_TREE_MODEL (model), &end_iter, end_path))
+        return;
+
+    resident = g_array_new (FALSE, FALSE, sizeof (ResidentPixbuf));
+    collect_resident_pixbufs (model->details->files, start_iter.user_data, end_iter.user_data,
+                              &pos, &start_pos, &end_pos, resident, &total);
+
+    if (total > budget && start_pos <= end_pos) {
+        for (i = 0; i < resident->len; i++) {
+            res = &g_array_index (resident, ResidentPixbuf, i);
+            if (res->distance < start_pos)
+                res->distance = start_pos - res->distance;
+            else if (res->distance > end_pos)
+                res->distance = res->distance - end_pos;
+            else
+                res->distance = 0;
+        }
+
+        g_array_sort (resident, resident_pixbuf_compare_farthest_first);
+
+        for (i = 0; i < resident->len && total > budget; i++) {
+            res = &g_array_index (resident, ResidentPixbuf, i);
+            if (res->distance == 0)
+                break;
+
+            /* pix_size is kept so that gof_file_update_icon () rehydrates at the same size */
+            g_clear_object (&res->file->pix);
+            total -= res->bytes;
+            evicted++;
+        }
+
+        g_debug ("%s: dropped %u pixbufs, %" G_GSIZE_FORMAT " bytes still resident", G_STRFUNC, evicted, total);
+    }
+
+    g_array_free (resident, TRUE);
+}
+
 gboolean
 fm_list_model_is_empty (FMListModel *model)
 {
@@ -957,6 +1203,7 @@ fm_list_model_clear (FMListModel *model)
     g_return_if_fail (model != NULL);
 
     fm_list_model_clear_directory (model, model->details->files);
+    file_entry_pool_trim (model->details->entry_pool);
 }
 
 GOFFile *
@@ -1122,6 +1369,15 @@ fm_list_model_dispose (GObject *object)
         model->details->directory_reverse_map = NULL;
     }
 
+    if (model->details->pending_icons_id != 0) {
+        g_source_remove (model->details->pending_icons_id);
+        model->details->pending_icons_id = 0;
+    }
+    if (model->details->pending_icons) {
+        g_hash_table_destroy (model->details->pending_icons);
+        model->details->pending_icons = NULL;
+    }
+
     G_OBJECT_CLASS (fm_list_model_parent_class)->dispose (object);
 }
 
@@ -1131,6 +1387,7 @@ fm_list_model_finalize (GObject *object)
     FMListModel *model = FM_LIST_MODEL (object);
 
     g_debug ("%s\n", G_STRFUNC);
+    file_entry_pool_free (model->details->entry_pool);
     g_free (model->details);
 
     G_OBJECT_CLASS (fm_list_model_parent_class)->finalize (object);
@@ -1140,9 +1397,13 @@ static void
 fm_list_model_init (FMListModel *model)
 {
     model->details = g_new0 (FMListModelDetails, 1);
+    model->details->entry_pool = file_entry_pool_new ();
     model->details->files = g_sequence_new ((GDestroyNotify)file_entry_free);
     model->details->top_reverse_map = g_hash_table_new (g_direct_hash, g_direct_equal);
     model->details->directory_reverse_map = g_hash_table_new (g_direct_hash, g_direct_equal);
+    model->details->pending_icons = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                           g_object_unref, NULL);
+    model->details->icon_scale = 1;
     model->details->stamp = g_random_int ();
     model->details->sort_id = FM_LIST_MODEL_FILENAME;
     model->details->order = GTK_SORT_ASCENDING;
@@ -1179,6 +1440,13 @@ fm_list_model_class_init (FMListModelClass *klass)
                                                         32,
                                                         G_PARAM_READWRITE));
 
+    g_object_class_install_property (object_class,
+                                     PROP_SCALE,
+                                     g_param_spec_int ("scale", "scale", "icon scale factor",
+                                                        1,  8,
+                                                        1,
+                                                        G_PARAM_READWRITE));
+
 
     list_model_signals[SUBDIRECTORY_UNLOADED] =
         g_signal_new ("subdirectory_unloaded",
@@ -1239,6 +1507,14 @@ fm_list_model_set_icon_size (FMListModel *model, gint size)
     model->details->icon_size = size;
 }
 
+static void
+fm_list_model_set_icon_scale (FMListModel *model, gint scale)
+{
+    g_return_if_fail (FM_IS_LIST_MODEL (model));
+
+    model->details->icon_scale = scale;
+}
+
 static void
 fm_list_model_get_property (GObject    *object,
                             guint       prop_id,
@@ -1257,6 +1533,10 @@ fm_list_model_get_property (GObject    *object,
         g_value_set_int (value, model->details->icon_size);
         break;
 
+    case PROP_SCALE:
+        g_value_set_int (value, model->details->icon_scale);
+        break;
+
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
         break;
@@ -1281,6 +1561,10 @@ fm_list_model_set_property (GObject      *object,
         fm_list_model_set_icon_size (model, g_value_get_int (value));
         break;
 
+    case PROP_SCALE:
+        fm_list_model_set_icon_scale (model, g_value_get_int (value));
+        break;
+
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
         break;
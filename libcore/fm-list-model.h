@@ -86,6 +86,8 @@ gboolean fm_list_model_get_tree_iter_from_file           (FMListModel        *mo
 GList *  fm_list_model_get_all_iters_for_file            (FMListModel *model, GOFFile *file);
 gboolean fm_list_model_get_first_iter_for_file           (FMListModel *model, GOFFile *file, GtkTreeIter *iter);
 void     fm_list_model_set_should_sort_directories_first (FMListModel *model, gboolean sort_directories_first);
+void     fm_list_model_trim_pixbufs                      (FMListModel *model, GtkTreePath *start_path,
+                                                          GtkTreePath *end_path, gsize budget);
 
 GOFFile *       fm_list_model_file_for_path (FMListModel *model, GtkTreePath *path);
 GOFFile *       fm_list_model_file_for_iter (FMListModel *model, GtkTreeIter *iter);
@@ -54,7 +54,8 @@ public class Async : Object {
     }
     public State state {get; private set;}
 
-    private HashTable<GLib.File,GOF.File> file_hash;
+    /* All files are children of @location so they are keyed by basename alone */
+    private HashTable<string,GOF.File> file_hash;
     public uint displayed_files_count {get; private set;}
 
     public bool permission_denied = false;
@@ -134,7 +135,7 @@ public class Async : Object {
         can_open_files = !("mtp".contains (scheme));
         can_stream_files = !("ftp sftp mtp".contains (scheme));
 
-        file_hash = new HashTable<GLib.File, GOF.File> (GLib.File.hash, GLib.File.equal);
+        file_hash = new HashTable<string, GOF.File> (str_hash, str_equal);
     }
 
     ~Async () {
@@ -650,7 +651,7 @@ public class Async : Object {
                             gof.info = file_info;
                             gof.update ();
 
-                            file_hash.insert (gof.location, gof);
+                            file_hash.insert (gof.basename, gof);
                             after_load_file (gof, show_hidden, file_loaded_func);
                         }
                     }
@@ -764,9 +765,17 @@ public class Async : Object {
         }
     }
 
+    private unowned GOF.File? file_hash_lookup_child (GLib.File child) {
+        if (!child.has_parent (location)) {
+            return null;
+        }
+
+        return file_hash.lookup (child.get_basename ());
+    }
+
     public GOF.File? file_hash_lookup_location (GLib.File? location) {
         if (location != null && location is GLib.File) {
-            GOF.File? result = file_hash.lookup (location);
+            GOF.File? result = file_hash_lookup_child (location);
             /* Although file_hash.lookup returns an unowned value, Vala will add a reference
              * as the return value is owned.  This matches the behaviour of GOF.File.cache_lookup */
             return result;
@@ -776,12 +785,12 @@ public class Async : Object {
     }
 
     public void file_hash_add_file (GOF.File gof) { /* called directly by GOF.File */
-        file_hash.insert (gof.location, gof);
+        file_hash.insert (gof.basename, gof);
     }
 
     public GOF.File file_cache_find_or_insert (GLib.File file, bool update_hash = false) {
         assert (file != null);
-        GOF.File? result = file_hash.lookup (file);
+        GOF.File? result = file_hash_lookup_child (file);
         /* Although file_hash.lookup returns an unowned value, Vala will add a reference
          * as the return value is owned.  This matches the behaviour of GOF.File.cache_lookup */
         if (result == null) {
@@ -789,9 +798,9 @@ public class Async : Object {
 
             if (result == null) {
                 result = new GOF.File (file, location);
-                file_hash.insert (file, result);
+                file_hash.insert (result.basename, result);
             } else if (update_hash) {
-                file_hash.insert (file, result);
+                file_hash.insert (result.basename, result);
             }
         }
 
@@ -1075,7 +1084,7 @@ public class Async : Object {
         assert (gof != null);
         Async? dir = cache_lookup (gof.directory);
         if (dir != null) {
-            dir.file_hash.remove (gof.location);
+            dir.file_hash.remove (gof.basename);
         }
     }
 
@@ -1143,9 +1152,9 @@ public class Async : Object {
         var removed = Async.remove_dir_from_cache (dir);
         /* We have to remove the dir's subfolders from cache too */
         if (removed) {
-            foreach (var gfile in dir.file_hash.get_keys ()) {
-                assert (gfile != null);
-                var d = cache_lookup (gfile);
+            foreach (var gof in dir.file_hash.get_values ()) {
+                assert (gof != null);
+                var d = cache_lookup (gof.location);
                 if (d != null) {
                     Async.remove_dir_from_cache (d);
                 }
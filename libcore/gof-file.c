@@ -33,6 +33,21 @@ G_LOCK_DEFINE_STATIC (file_cache_mutex);
 
 static GHashTable   *file_cache;
 
+/* Per content type memo of the icon and description, shared by all files of that type */
+typedef struct {
+    GIcon   *icon;
+    gchar   *description;
+} GOFFileTypeInfo;
+
+G_LOCK_DEFINE_STATIC (type_cache_mutex);
+
+static GHashTable   *type_cache;
+static GList        *type_cache_monitors;
+static guint        type_cache_hits;
+static guint        type_cache_misses;
+
+#define TYPE_CACHE_STATS_INTERVAL 4096
+
 G_DEFINE_TYPE (GOFFile, gof_file, G_TYPE_OBJECT)
 
 #define SORT_LAST_CHAR1 '.'
@@ -87,6 +102,129 @@ get_icon_user_special_dirs(char *path)
     return (icon);
 }
 
+static void
+gof_file_type_info_free (GOFFileTypeInfo *info)
+{
+    _g_object_unref0 (info->icon);
+    _g_free0 (info->description);
+    g_slice_free (GOFFileTypeInfo, info);
+}
+
+static void
+gof_file_type_cache_invalidate (void)
+{
+    G_LOCK (type_cache_mutex);
+    if (type_cache != NULL) {
+        g_debug ("%s: dropping %u content types (hits %u, misses %u)", G_STRFUNC,
+                 g_hash_table_size (type_cache), type_cache_hits, type_cache_misses);
+        g_hash_table_remove_all (type_cache);
+    }
+    G_UNLOCK (type_cache_mutex);
+}
+
+static void
+type_cache_mime_database_changed (GFileMonitor      *monitor,
+                                  GFile             *file,
+                                  GFile             *other_file,
+                                  GFileMonitorEvent  event_type,
+                                  gpointer           user_data)
+{
+    switch (event_type) {
+    case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+    case G_FILE_MONITOR_EVENT_CREATED:
+    case G_FILE_MONITOR_EVENT_DELETED:
+        gof_file_type_cache_invalidate ();
+        break;
+    default:
+        break;
+    }
+}
+
+static void
+type_cache_monitor_data_dir (const gchar *data_dir)
+{
+    GFile *mime_cache;
+    GFileMonitor *monitor;
+    gchar *path;
+
+    /* update-mime-database rewrites mime.cache whenever a package or the user adds a type */
+    path = g_build_filename (data_dir, "mime", "mime.cache", NULL);
+    mime_cache = g_file_new_for_path (path);
+    monitor = g_file_monitor_file (mime_cache, G_FILE_MONITOR_NONE, NULL, NULL);
+    if (monitor != NULL) {
+        g_signal_connect (monitor, "changed", G_CALLBACK (type_cache_mime_database_changed), NULL);
+        type_cache_monitors = g_list_prepend (type_cache_monitors, monitor);
+    }
+
+    g_object_unref (mime_cache);
+    g_free (path);
+}
+
+/* Must be called with type_cache_mutex held */
+static GOFFileTypeInfo *
+type_cache_lookup_locked (const gchar *ftype)
+{
+    GOFFileTypeInfo *info;
+    const gchar * const *dirs;
+
+    if (G_UNLIKELY (type_cache == NULL)) {
+        type_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, (GDestroyNotify) gof_file_type_info_free);
+
+        type_cache_monitor_data_dir (g_get_user_data_dir ());
+        for (dirs = g_get_system_data_dirs (); *dirs != NULL; dirs++)
+            type_cache_monitor_data_dir (*dirs);
+    }
+
+    info = g_hash_table_lookup (type_cache, ftype);
+    if (info != NULL) {
+        type_cache_hits++;
+    } else {
+        type_cache_misses++;
+        info = g_slice_new0 (GOFFileTypeInfo);
+        info->icon = g_content_type_get_icon (ftype);
+        info->description = g_content_type_get_description (ftype);
+        g_hash_table_insert (type_cache, g_strdup (ftype), info);
+    }
+
+    if ((type_cache_hits + type_cache_misses) % TYPE_CACHE_STATS_INTERVAL == 0) {
+        g_debug ("content type cache: %u types, hits %u, misses %u",
+                 g_hash_table_size (type_cache), type_cache_hits, type_cache_misses);
+    }
+
+    return info;
+}
+
+/* Returns a new reference to the icon for @ftype */
+static GIcon *
+gof_file_type_cache_get_icon (const gchar *ftype)
+{
+    GIcon *icon;
+
+    g_return_val_if_fail (ftype != NULL, NULL);
+
+    G_LOCK (type_cache_mutex);
+    icon = _g_object_ref0 (type_cache_lookup_locked (ftype)->icon);
+    G_UNLOCK (type_cache_mutex);
+
+    return icon;
+}
+
+/* Returns a newly allocated copy of the description for @ftype */
+static gchar *
+gof_file_type_cache_get_description (const gchar *ftype)
+{
+    gchar *description;
+
+    g_return_val_if_fail (ftype != NULL, NULL);
+
+    G_LOCK (type_cache_mutex);
+    description = g_strdup (type_cache_lookup_locked (ftype)->description);
+    G_UNLOCK (type_cache_mutex);
+
+    return description;
+}
+
 GOFFile *
 gof_file_new (GFile *location, GFile *dir)
 {
@@ -94,7 +232,6 @@ gof_file_new (GFile *location, GFile *dir)
 
     file = (GOFFile*) g_object_new (GOF_TYPE_FILE, NULL);
     file->location = g_object_ref (location);
-    file->uri = g_file_get_uri (location);
     if (dir != NULL)
         file->directory = g_object_ref (dir);
     else
@@ -105,6 +242,18 @@ gof_file_new (GFile *location, GFile *dir)
     return (file);
 }
 
+/* The uri is only built when first asked for, most files in a large folder never need it */
+const gchar *
+gof_file_get_uri (GOFFile *file)
+{
+    g_return_val_if_fail (GOF_IS_FILE (file), NULL);
+
+    if (file->uri == NULL)
+        file->uri = g_file_get_uri (file->location);
+
+    return file->uri;
+}
+
 void
 gof_file_icon_changed (GOFFile *file)
 {
@@ -164,7 +313,7 @@ gof_file_is_location_uri_default (GOFFile *file)
     const char *target_uri = g_file_info_get_attribute_string (file->info, G_FILE_ATTRIBUTE_STANDARD_TARGET_URI);
 
     if (target_uri == NULL)
-        target_uri = file->uri;
+        target_uri = gof_file_get_uri (file);
 
     gchar **split = g_strsplit (target_uri, "/", 4);
     res = (split[3] == NULL || !strcmp (split[3], ""));
@@ -186,7 +335,7 @@ get_number_of_uri_parts (GOFFile *file) {
         target_uri = g_file_info_get_attribute_string (file->info, G_FILE_ATTRIBUTE_STANDARD_TARGET_URI);
 
     if (target_uri == NULL)
-        target_uri = file->uri;
+        target_uri = gof_file_get_uri (file);
 
     gchar **split = g_strsplit (target_uri, "/", 6);
     guint i, count;
@@ -290,8 +439,8 @@ gof_file_get_folder_icon_from_uri_or_path (GOFFile *file)
     if (file->icon != NULL)
         return;
 
-    if (!file->is_hidden && file->uri != NULL) {
-        char *path = g_filename_from_uri (file->uri, NULL, NULL);
+    if (!file->is_hidden) {
+        char *path = g_filename_from_uri (gof_file_get_uri (file), NULL, NULL);
         file->icon = get_icon_user_special_dirs(path);
         _g_free0 (path);
     }
@@ -342,7 +491,7 @@ gof_file_update_formated_type (GOFFile *file)
     const gchar *ftype = gof_file_get_ftype (file);
     /* Do not interpret desktop files (lp:1660742) */
     if (ftype != NULL) {
-        formated_type = g_content_type_get_description (ftype);
+        formated_type = gof_file_type_cache_get_description (ftype);
         if (G_UNLIKELY (gof_file_is_symlink (file))) {
             file->formated_type = g_strdup_printf (_("link to %s"), formated_type);
         } else {
@@ -364,7 +513,8 @@ gof_file_update_type (GOFFile *file)
 
     gof_file_update_formated_type (file);
     /* update icon */
-    file->icon = g_content_type_get_icon (ftype);
+    _g_object_unref0 (file->icon);
+    file->icon = gof_file_type_cache_get_icon (ftype);
     if (file->pix_size > 1 && file->pix_scale > 0)
         gof_file_update_icon_internal (file, file->pix_size, file->pix_scale);
 
@@ -513,7 +663,7 @@ gof_file_update (GOFFile *file)
     } else {
         const gchar *ftype = gof_file_get_ftype (file);
         if (ftype != NULL && file->icon == NULL)
-            file->icon = g_content_type_get_icon (ftype);
+            file->icon = gof_file_type_cache_get_icon (ftype);
     }
 
     file->utf8_collation_key = g_utf8_collate_key_for_filename  (gof_file_get_display_name (file), -1);
@@ -839,7 +989,7 @@ gof_file_query_thumbnail_update (GOFFile *file)
 
     if (gof_file_get_thumbnail_path (file) == NULL) {
         /* get the thumbnail path from md5 filename */
-        md5_hash = g_compute_checksum_for_string (G_CHECKSUM_MD5, file->uri, -1);
+        md5_hash = g_compute_checksum_for_string (G_CHECKSUM_MD5, gof_file_get_uri (file), -1);
         base_name = g_strdup_printf ("%s.png", md5_hash);
 
         /* Use $XDG_CACHE_HOME specified thumbnail directory instead of hard coding */
@@ -876,7 +1026,7 @@ void gof_file_remove_from_caches (GOFFile *file)
 {
     /* remove from file_cache */
     if (file_cache != NULL && g_hash_table_remove (file_cache, file->location))
-        g_debug ("remove from file_cache %s", file->uri);
+        g_debug ("remove from file_cache %s", file->basename);
 
     /* remove from directory_cache */
     if (file->directory && G_OBJECT (file->directory)->ref_count > 0) {
@@ -1397,7 +1547,7 @@ gof_file_set_thumb_state (GOFFile *file, GOFFileThumbState state)
 
     /* set the new thumbnail state */
     file->flags = (file->flags & ~GOF_FILE_THUMB_STATE_MASK) | (state);
-    g_debug ("%s %s %u", G_STRFUNC, file->uri, file->flags);
+    g_debug ("%s %s %u", G_STRFUNC, gof_file_get_uri (file), file->flags);
     if (file->flags == GOF_FILE_THUMB_STATE_READY)
         gof_file_query_thumbnail_update (file);
 
@@ -1490,7 +1640,7 @@ GOFFile* gof_file_get_by_uri (const char *uri)
 
     file = gof_file_get (location);
 #ifdef ENABLE_DEBUG
-    g_debug ("%s %s", G_STRFUNC, file->uri);
+    g_debug ("%s %s", G_STRFUNC, gof_file_get_uri (file));
 #endif
     g_object_unref (location);
 
@@ -1519,7 +1669,7 @@ gchar* gof_file_list_to_string (GList *list, gsize *len)
 
     for (lp = list; lp != NULL; lp = lp->next)
     {
-        string = g_string_append (string, GOF_FILE(lp->data)->uri);
+        string = g_string_append (string, gof_file_get_uri (GOF_FILE (lp->data)));
         string = g_string_append (string, "\r\n");
     }
 
@@ -1664,13 +1814,13 @@ gof_file_update_existing (GOFFile *file, GFile *new_location)
     g_object_unref (file->location);
     file->location = g_object_ref (new_location);
 
-    if (dir != NULL)
-        gof_directory_async_file_hash_add_file (dir, file);
-
     _g_free0 (file->uri);
-    file->uri = g_file_get_uri (new_location);
     _g_free0 (file->basename);
     file->basename = g_file_get_basename (file->location);
+
+    /* The directory hashes files by basename so only add back once it is updated */
+    if (dir != NULL)
+        gof_directory_async_file_hash_add_file (dir, file);
     file->pix_size = -1;
     file->pix_scale = -1;
     _g_free0 (file->thumbnail_path);
@@ -1905,7 +2055,7 @@ gof_file_get_ftype (GOFFile *file)
         return NULL;
 
     if (file->is_directory) {
-        return g_strdup ("inode/directory");
+        return "inode/directory";
     }
 
     const char *ftype = NULL;
@@ -1944,7 +2094,7 @@ gof_file_get_display_target_uri (GOFFile *file)
     uri = g_file_info_get_attribute_as_string (file->info, G_FILE_ATTRIBUTE_STANDARD_TARGET_URI);
 
     if (uri == NULL) {
-        uri = strdup (file->uri);
+        uri = strdup (gof_file_get_uri (file));
     }
 
     return uri;
@@ -72,7 +72,7 @@ struct _GOFFile {
     GOFFile         *target_gof;
     GFile           *directory;
     gchar           *custom_display_name;
-    gchar           *uri;
+    gchar           *uri;   /* built lazily, use gof_file_get_uri () */
     char            *basename;
     gchar           *tagstype;
     gchar           *formated_type;
@@ -214,8 +214,7 @@ void            gof_file_set_thumb_state (GOFFile *file, GOFFileThumbState state
 void            gof_file_add_emblem(GOFFile* file, const gchar* emblem);
 GMount*         gof_file_get_mount_at (GFile* target);
 
-/* To provide a wrapper around g_file_get_uri (not sure it is really useful tough) */
-#define gof_file_get_uri(obj) g_file_get_uri(obj->location)
+const gchar     *gof_file_get_uri (GOFFile *file);
 /**
  * gof_file_get_thumb_state:
  * @file : a #GOFFile.
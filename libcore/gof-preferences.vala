@@ -26,6 +26,9 @@ namespace GOF {
         public bool show_hidden_files {get; set; default=false;}
         public bool show_remote_thumbnails {set; get; default=false;}
         public bool confirm_trash {set; get; default=true;}
+        public bool preserve_hardlinks {set; get; default=false;}
+        public bool delta_copy {set; get; default=false;}
+        public int background_bandwidth_limit {set; get; default=0;}
         public bool force_icon_size {set; get; default=true;}
         public bool sort_directories_first { get; set; default = true; }
 
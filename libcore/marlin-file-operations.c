@@ -22,6 +22,10 @@
  *          Pavel Cisler <pavel@eazel.com>
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -29,7 +33,16 @@
 #include <math.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
 
 #include "marlin-file-operations.h"
 
@@ -46,6 +59,30 @@
 #include "marlin-undostack-manager.h"
 #include "pantheon-files-core.h"
 
+typedef struct ScanManifest ScanManifest;
+typedef struct HardlinkMap HardlinkMap;
+typedef struct CopyJournal CopyJournal;
+typedef struct ConflictPreflight ConflictPreflight;
+typedef struct FsCapsCache FsCapsCache;
+
+/* The job thread only stores plain counters here, formatting them into the progress
+ * info is left to a timeout in the main loop, see start_progress_sampler ().
+ */
+typedef struct {
+    gint started;
+    gint num_files;
+    gint done_files;
+    goffset num_bytes;
+    goffset done_bytes;
+    goffset skipped_bytes;
+    /* Only used by the main loop */
+    guint source_id;
+    gboolean sampled;
+    gint sampled_files;
+    goffset sampled_bytes;
+    int last_reported_files_left;
+} ProgressCounters;
+
 typedef struct {
     GIOSchedulerJob *io_job;
     GTimer *time;
@@ -61,8 +98,17 @@ typedef struct {
     gboolean merge_all;
     gboolean replace_all;
     gboolean keep_all_newest;
+    gboolean update_all;
+    gboolean update_compare_contents;
     gboolean delete_all;
     MarlinUndoActionData *undo_redo_data;
+    ScanManifest *manifest;
+    HardlinkMap *links;
+    gboolean scheduled;
+    gboolean background;        /* as last applied to the job thread */
+    gint64 throttle_start;
+    goffset throttle_bytes;
+    ProgressCounters counters;
 } CommonJob;
 
 typedef struct {
@@ -76,6 +122,28 @@ typedef struct {
     GHashTable *debuting_files;
     MarlinCopyCallback  done_callback;
     gpointer done_callback_data;
+    GThreadPool *copy_pool;
+    int n_reflinked;
+    int n_copied_in_kernel;
+    int n_copied_sparse;
+    int n_hardlinked;
+    int n_delta;
+    goffset delta_bytes_written;
+    int n_streamed;
+    goffset streamed_bytes;
+    gint64 streamed_usec;
+    gboolean delta_copy;
+    gboolean verify;
+    int n_verified;
+    int n_copied;
+    CopyJournal *journal;
+    char *resume_journal;
+    GHashTable *name_indexes;   /* folder to NameIndex, for duplicates */
+    int n_name_index_dirs;
+    int n_name_index_misses;
+    ConflictPreflight *preflight;
+    FsCapsCache *fs_caps;
+    GFile *update_scope;        /* merged folder the user chose to update */
 } CopyMoveJob;
 
 typedef struct {
@@ -105,6 +173,7 @@ typedef struct {
 typedef struct {
     CommonJob common;
     GList *trash_dirs;
+    GList *trash_roots;
     gboolean should_confirm;
     MarlinOpCallback done_callback;
     gpointer done_callback_data;
@@ -139,9 +208,8 @@ typedef struct {
 typedef struct {
     int num_files;
     goffset num_bytes;
+    goffset skipped_bytes;      /* unchanged files in update mode, part of num_bytes */
     OpKind op;
-    guint64 last_report_time;
-    int last_reported_files_left;
 } TransferInfo;
 
 #define SECONDS_NEEDED_FOR_RELIABLE_TRANSFER_RATE 15
@@ -913,6 +981,9 @@ finalize_common (CommonJob *common)
     }
 
     common->inhibit_cookie = -1;
+    if (common->counters.source_id != 0) {
+        g_source_remove (common->counters.source_id);
+    }
     g_timer_destroy (common->time);
 
     if (common->parent_window) {
@@ -1226,6 +1297,337 @@ job_aborted (CommonJob *job)
     return g_cancellable_is_cancelled (job->cancellable);
 }
 
+/* Called from the job thread while it reports progress. A paused job keeps its place
+ * in the device queue */
+static void
+job_wait_while_paused (CommonJob *job)
+{
+    while (pf_progress_info_get_is_paused (job->progress) && !job_aborted (job)) {
+        g_usleep (100 * G_TIME_SPAN_MILLISECOND);
+    }
+}
+
+/* Relaxed accesses are enough, the counters are sampled one by one anyway */
+#define counter_store(counter, value) __atomic_store_n ((counter), (value), __ATOMIC_RELAXED)
+#define counter_load(counter) __atomic_load_n ((counter), __ATOMIC_RELAXED)
+
+/* Called from the job thread for every file or chunk, so it must stay cheap */
+static void
+publish_progress (CommonJob *job,
+                  SourceInfo *source_info,
+                  TransferInfo *transfer_info)
+{
+    ProgressCounters *counters = &job->counters;
+
+    counter_store (&counters->num_files, source_info->num_files);
+    counter_store (&counters->num_bytes, source_info->num_bytes);
+    counter_store (&counters->done_files, transfer_info->num_files);
+    counter_store (&counters->done_bytes, transfer_info->num_bytes);
+    counter_store (&counters->skipped_bytes, transfer_info->skipped_bytes);
+
+    if (!g_atomic_int_get (&counters->started)) {
+        g_atomic_int_set (&counters->started, TRUE);
+    }
+}
+
+/* Takes a snapshot for the sampler, FALSE when nothing happened since the last one */
+static gboolean
+sample_progress (CommonJob *job,
+                 SourceInfo *source_info,
+                 TransferInfo *transfer_info)
+{
+    ProgressCounters *counters = &job->counters;
+
+    if (!g_atomic_int_get (&counters->started)) {
+        return FALSE;
+    }
+
+    memset (source_info, 0, sizeof (SourceInfo));
+    memset (transfer_info, 0, sizeof (TransferInfo));
+    source_info->num_files = counter_load (&counters->num_files);
+    source_info->num_bytes = counter_load (&counters->num_bytes);
+    transfer_info->num_files = counter_load (&counters->done_files);
+    transfer_info->num_bytes = counter_load (&counters->done_bytes);
+    transfer_info->skipped_bytes = counter_load (&counters->skipped_bytes);
+
+    /* Nothing moved, as while the job is paused */
+    if (counters->sampled &&
+        counters->sampled_files == transfer_info->num_files &&
+        counters->sampled_bytes == transfer_info->num_bytes) {
+        return FALSE;
+    }
+
+    counters->sampled = TRUE;
+    counters->sampled_files = transfer_info->num_files;
+    counters->sampled_bytes = transfer_info->num_bytes;
+
+    return TRUE;
+}
+
+#define PROGRESS_SAMPLE_INTERVAL 100 /* ms */
+
+/* Called from the main loop when the job is created */
+static void
+start_progress_sampler (CommonJob *job,
+                        GSourceFunc sample_func)
+{
+    job->counters.source_id = g_timeout_add (PROGRESS_SAMPLE_INTERVAL, sample_func, job);
+}
+
+/* A job running in the background, as toggled from its progress info, moves its thread
+ * to the idle I/O class, so that it only gets the disk when nothing else needs it, and
+ * is held to the background-bandwidth-limit preference if that is set.
+ */
+#ifdef __linux__
+#ifndef IOPRIO_CLASS_SHIFT
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+#define IOPRIO_CLASS_NONE 0
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#endif
+#endif
+
+static void
+set_thread_io_background (gboolean background)
+{
+#if defined (__linux__) && defined (SYS_ioprio_set)
+    /* Class none means derived from the CPU nice value, the default */
+    syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+             background ? IOPRIO_PRIO_VALUE (IOPRIO_CLASS_IDLE, 0) : IOPRIO_PRIO_VALUE (IOPRIO_CLASS_NONE, 0));
+#endif
+}
+
+/* Called from the job thread as it makes progress, @bytes_done being what it has
+ * transferred so far */
+static void
+job_apply_background (CommonJob *job, goffset bytes_done)
+{
+    gboolean background;
+    gint64 ahead;
+    int limit;
+
+    /* Other jobs run on shared threads that are not reset afterwards */
+    if (!job->scheduled) {
+        return;
+    }
+
+    background = pf_progress_info_get_is_background (job->progress);
+    if (background != job->background) {
+        job->background = background;
+        set_thread_io_background (background);
+        job->throttle_start = g_get_monotonic_time ();
+        job->throttle_bytes = bytes_done;
+    }
+
+    limit = gof_preferences_get_background_bandwidth_limit (gof_preferences_get_default ());
+    if (!background || limit <= 0) {
+        return;
+    }
+
+    /* How far the job is ahead of the limit, in microseconds */
+    ahead = (bytes_done - job->throttle_bytes) * G_USEC_PER_SEC / ((gint64) limit * 1024) -
+            (g_get_monotonic_time () - job->throttle_start);
+    if (ahead > 0 && !job_aborted (job)) {
+        g_usleep (MIN (ahead, G_USEC_PER_SEC));
+    }
+}
+
+/* Long running jobs are queued per device rather than all started at once. Jobs on
+ * the same device take turns, highest priority first, so that they do not compete
+ * for one disk, while jobs on different devices run side by side. Quick jobs such as
+ * creating, linking or trashing files are pushed directly. A waiting job is shown as
+ * started and queued in its progress info, so it can be seen and cancelled meanwhile.
+ */
+#define JOBS_PER_DEVICE 1
+
+typedef struct {
+    char *id;
+    GQueue waiting;             /* ScheduledJob, by priority then in order */
+    guint running;
+} DeviceQueue;
+
+typedef struct {
+    GIOSchedulerJobFunc func;
+    gpointer data;
+    PFProgressInfo *progress;   /* set while waiting */
+    GCancellable *cancellable;
+    gint io_priority;
+    DeviceQueue *device;
+} ScheduledJob;
+
+G_LOCK_DEFINE_STATIC (job_scheduler);
+static GHashTable *job_scheduler_devices = NULL;
+
+static void
+device_queue_free (DeviceQueue *device)
+{
+    g_free (device->id);
+    g_slice_free (DeviceQueue, device);
+}
+
+/* Does not touch remote locations, all jobs on one server share a queue */
+static char *
+get_device_id (GFile *file)
+{
+    GFileInfo *info;
+    GFile *dir, *parent;
+    char *uri, *id = NULL;
+    const char *host, *path;
+
+    if (file == NULL) {
+        return g_strdup ("");
+    }
+
+    if (!g_file_is_native (file)) {
+        uri = g_file_get_uri (file);
+        host = strstr (uri, "://");
+        path = host != NULL ? strchr (host + 3, '/') : NULL;
+        id = path != NULL ? g_strndup (uri, path - uri) : g_strdup (uri);
+        g_free (uri);
+        return id;
+    }
+
+    /* The file itself may not exist yet */
+    dir = g_object_ref (file);
+    while (id == NULL && dir != NULL) {
+        info = g_file_query_info (dir, G_FILE_ATTRIBUTE_ID_FILESYSTEM, 0, NULL, NULL);
+        if (info != NULL) {
+            id = g_strdup (g_file_info_get_attribute_string (info, G_FILE_ATTRIBUTE_ID_FILESYSTEM));
+            g_object_unref (info);
+        }
+
+        parent = g_file_get_parent (dir);
+        g_object_unref (dir);
+        dir = parent;
+    }
+    if (dir != NULL) {
+        g_object_unref (dir);
+    }
+
+    return id != NULL ? id : g_strdup ("");
+}
+
+static gboolean scheduled_job_run (GIOSchedulerJob *io_job, GCancellable *cancellable, gpointer user_data);
+
+/* Called with the scheduler lock held */
+static void
+scheduled_job_start (ScheduledJob *sjob)
+{
+    sjob->device->running++;
+    g_io_scheduler_push_job (scheduled_job_run,
+                             sjob,
+                             NULL,
+                             sjob->io_priority,
+                             sjob->cancellable);
+}
+
+static gboolean
+scheduled_job_run (GIOSchedulerJob *io_job,
+                   GCancellable *cancellable,
+                   gpointer user_data)
+{
+    ScheduledJob *sjob = user_data;
+    DeviceQueue *device = sjob->device;
+    ScheduledJob *next;
+
+    if (sjob->progress != NULL) {
+        pf_progress_info_set_queued (sjob->progress, FALSE);
+        g_object_unref (sjob->progress);
+    }
+
+    /* A job cancelled while waiting still runs, to clean up after itself */
+    while (sjob->func (io_job, cancellable, sjob->data)) {
+        ;
+    }
+
+    /* The thread goes back to the pool */
+    set_thread_io_background (FALSE);
+
+    G_LOCK (job_scheduler);
+    device->running--;
+    next = g_queue_pop_head (&device->waiting);
+    if (next != NULL) {
+        scheduled_job_start (next);
+    } else if (device->running == 0) {
+        g_hash_table_remove (job_scheduler_devices, device->id);
+    }
+    G_UNLOCK (job_scheduler);
+
+    if (sjob->cancellable != NULL) {
+        g_object_unref (sjob->cancellable);
+    }
+    g_slice_free (ScheduledJob, sjob);
+
+    return FALSE;
+}
+
+/* Queues @func on the device holding @location. @job may be NULL for jobs without progress */
+static void
+schedule_job (GIOSchedulerJobFunc func,
+              gpointer data,
+              CommonJob *job,
+              GFile *location,
+              gint io_priority)
+{
+    ScheduledJob *sjob;
+    DeviceQueue *device;
+    GList *l;
+    char *id;
+
+    sjob = g_slice_new0 (ScheduledJob);
+    sjob->func = func;
+    sjob->data = data;
+    sjob->io_priority = io_priority;
+    if (job != NULL) {
+        sjob->cancellable = g_object_ref (job->cancellable);
+        job->scheduled = TRUE;
+    }
+
+    id = get_device_id (location);
+
+    G_LOCK (job_scheduler);
+
+    if (job_scheduler_devices == NULL) {
+        job_scheduler_devices = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                       NULL, (GDestroyNotify) device_queue_free);
+    }
+
+    device = g_hash_table_lookup (job_scheduler_devices, id);
+    if (device == NULL) {
+        device = g_slice_new0 (DeviceQueue);
+        device->id = id;
+        g_queue_init (&device->waiting);
+        g_hash_table_insert (job_scheduler_devices, device->id, device);
+    } else {
+        g_free (id);
+    }
+    sjob->device = device;
+
+    if (device->running < JOBS_PER_DEVICE) {
+        scheduled_job_start (sjob);
+    } else {
+        for (l = device->waiting.head; l != NULL; l = l->next) {
+            if (((ScheduledJob *) l->data)->io_priority > io_priority) {
+                break;
+            }
+        }
+        if (l != NULL) {
+            g_queue_insert_before (&device->waiting, l, sjob);
+        } else {
+            g_queue_push_tail (&device->waiting, sjob);
+        }
+
+        if (job != NULL) {
+            sjob->progress = g_object_ref (job->progress);
+            pf_progress_info_set_queued (job->progress, TRUE);
+            pf_progress_info_start (job->progress);
+        }
+    }
+
+    G_UNLOCK (job_scheduler);
+}
+
 /* Since this happens on a thread we can't use the global prefs object */
 static gboolean
 should_confirm_trash (void)
@@ -1357,18 +1759,25 @@ report_delete_progress (CommonJob *job,
                         SourceInfo *source_info,
                         TransferInfo *transfer_info)
 {
+    job_wait_while_paused (job);
+    job_apply_background (job, 0);
+    publish_progress (job, source_info, transfer_info);
+}
+
+static gboolean
+sample_delete_progress (gpointer user_data)
+{
+    CommonJob *job = user_data;
+    SourceInfo si, *source_info = &si;
+    TransferInfo ti, *transfer_info = &ti;
     int files_left;
     double elapsed, transfer_rate;
     int remaining_time;
-    guint64 now;
     char *files_left_s;
 
-    now = g_thread_gettime ();
-    if (transfer_info->last_report_time != 0 &&
-        ABS ((gint64)(transfer_info->last_report_time - now)) < 100 * NSEC_PER_MSEC) {
-        return;
+    if (!sample_progress (job, source_info, transfer_info)) {
+        return G_SOURCE_CONTINUE;
     }
-    transfer_info->last_report_time = now;
 
     files_left = source_info->num_files - transfer_info->num_files;
 
@@ -1412,6 +1821,8 @@ report_delete_progress (CommonJob *job,
     if (source_info->num_files != 0) {
         pf_progress_info_set_progress (job->progress, transfer_info->num_files, source_info->num_files);
     }
+
+    return G_SOURCE_CONTINUE;
 }
 
 static void delete_file (CommonJob *job, GFile *file,
@@ -1420,6 +1831,210 @@ static void delete_file (CommonJob *job, GFile *file,
                          TransferInfo *transfer_info,
                          gboolean toplevel);
 
+#ifdef __linux__
+/* Local folders are emptied without GIO: the tree is walked with getdents64 on
+ * directory descriptors and entries are removed with unlinkat relative to them, the
+ * subfolders of the top folder being handed out to worker threads. The fast path
+ * stops at the first problem and leaves whatever remains to the regular code below,
+ * which then reports it with the usual dialogs.
+ */
+#define DELETE_THREADS 4
+#define DELETE_DIRENT_BUFFER_SIZE (32 * 1024)
+
+struct linux_dirent64 {
+    guint64        d_ino;
+    gint64         d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+typedef struct {
+    GCancellable *cancellable;
+    int parent_fd;
+    volatile gint deleted;
+    volatile gint pending;
+    volatile gint failed;
+} FastDelete;
+
+static gboolean fast_delete_tree_at (FastDelete *del, int parent_fd, const char *name);
+
+/* Removes everything in @fd. Subfolders are added to @defer instead when it is given */
+static gboolean
+fast_delete_dir_contents (FastDelete *del, int fd, GPtrArray *defer)
+{
+    char *buf;
+    long n, pos;
+    struct linux_dirent64 *entry;
+    struct stat st;
+    unsigned char type;
+    gboolean removed_any, ok = TRUE;
+
+    buf = g_malloc (DELETE_DIRENT_BUFFER_SIZE);
+
+    /* Some filesystems skip entries when the folder changes while being read,
+     * so keep going over it until nothing is left */
+    do {
+        removed_any = FALSE;
+        lseek (fd, 0, SEEK_SET);
+
+        while (ok && (n = syscall (SYS_getdents64, fd, buf, DELETE_DIRENT_BUFFER_SIZE)) > 0) {
+            for (pos = 0; pos < n; pos += entry->d_reclen) {
+                entry = (struct linux_dirent64 *) (buf + pos);
+
+                if (strcmp (entry->d_name, ".") == 0 || strcmp (entry->d_name, "..") == 0) {
+                    continue;
+                }
+
+                if (g_cancellable_is_cancelled (del->cancellable) || g_atomic_int_get (&del->failed)) {
+                    ok = FALSE;
+                    break;
+                }
+
+                type = entry->d_type;
+                if (type == DT_UNKNOWN) {
+                    if (fstatat (fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                        ok = FALSE;
+                        break;
+                    }
+                    type = S_ISDIR (st.st_mode) ? DT_DIR : DT_REG;
+                }
+
+                if (type == DT_DIR) {
+                    if (defer != NULL) {
+                        g_ptr_array_add (defer, g_strdup (entry->d_name));
+                        continue;
+                    }
+                    ok = fast_delete_tree_at (del, fd, entry->d_name);
+                } else if (unlinkat (fd, entry->d_name, 0) == 0) {
+                    g_atomic_int_inc (&del->deleted);
+                } else {
+                    ok = FALSE;
+                }
+
+                if (!ok) {
+                    break;
+                }
+                removed_any = TRUE;
+            }
+        }
+
+        if (n < 0) {
+            ok = FALSE;
+        }
+    } while (ok && removed_any && defer == NULL);
+
+    g_free (buf);
+
+    return ok;
+}
+
+static gboolean
+fast_delete_tree_at (FastDelete *del, int parent_fd, const char *name)
+{
+    int fd;
+    gboolean ok;
+
+    fd = openat (parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return FALSE;
+    }
+
+    ok = fast_delete_dir_contents (del, fd, NULL);
+    close (fd);
+
+    if (ok && unlinkat (parent_fd, name, AT_REMOVEDIR) == 0) {
+        g_atomic_int_inc (&del->deleted);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void
+fast_delete_worker (gpointer data, gpointer user_data)
+{
+    char *name = data;
+    FastDelete *del = user_data;
+
+    if (!g_atomic_int_get (&del->failed) &&
+        !fast_delete_tree_at (del, del->parent_fd, name)) {
+        g_atomic_int_set (&del->failed, 1);
+    }
+
+    g_free (name);
+    g_atomic_int_add (&del->pending, -1);
+}
+#endif
+
+/* Returns TRUE if @dir was emptied, FALSE if the regular path has to take over */
+static gboolean
+delete_dir_contents_fast (CommonJob *job, GFile *dir,
+                          SourceInfo *source_info,
+                          TransferInfo *transfer_info)
+{
+#ifdef __linux__
+    FastDelete del = { 0 };
+    GThreadPool *pool;
+    GPtrArray *subdirs;
+    char *path;
+    int base_num_files;
+    guint i;
+    gboolean ok;
+
+    /* Files skipped while scanning have to be left in place */
+    if (job->skip_files != NULL || !g_file_is_native (dir)) {
+        return FALSE;
+    }
+
+    path = g_file_get_path (dir);
+    if (path == NULL) {
+        return FALSE;
+    }
+
+    del.cancellable = job->cancellable;
+    del.parent_fd = open (path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    g_free (path);
+    if (del.parent_fd < 0) {
+        return FALSE;
+    }
+
+    base_num_files = transfer_info->num_files;
+    subdirs = g_ptr_array_new ();
+    ok = fast_delete_dir_contents (&del, del.parent_fd, subdirs);
+
+    if (ok && subdirs->len > 0) {
+        pool = g_thread_pool_new (fast_delete_worker, &del, DELETE_THREADS, FALSE, NULL);
+        del.pending = subdirs->len;
+        for (i = 0; i < subdirs->len; i++) {
+            g_thread_pool_push (pool, g_ptr_array_index (subdirs, i), NULL);
+        }
+
+        while (g_atomic_int_get (&del.pending) > 0) {
+            g_usleep (50 * G_TIME_SPAN_MILLISECOND);
+            transfer_info->num_files = base_num_files + g_atomic_int_get (&del.deleted);
+            report_delete_progress (job, source_info, transfer_info);
+        }
+
+        g_thread_pool_free (pool, FALSE, TRUE);
+    } else {
+        g_ptr_array_foreach (subdirs, (GFunc) g_free, NULL);
+    }
+    g_ptr_array_free (subdirs, TRUE);
+
+    /* Pick up anything a worker gave up on or that appeared meanwhile */
+    ok = ok && !del.failed && fast_delete_dir_contents (&del, del.parent_fd, NULL);
+    close (del.parent_fd);
+
+    transfer_info->num_files = base_num_files + del.deleted;
+    report_delete_progress (job, source_info, transfer_info);
+
+    return ok;
+#else
+    return FALSE;
+#endif
+}
+
 static void
 delete_dir (CommonJob *job, GFile *dir,
             gboolean *skipped_file,
@@ -1438,6 +2053,10 @@ delete_dir (CommonJob *job, GFile *dir,
 
     local_skipped_file = FALSE;
 
+    if (delete_dir_contents_fast (job, dir, source_info, transfer_info)) {
+        goto remove_dir;
+    }
+
     skip_error = should_skip_readdir_error (job, dir);
 retry:
     error = NULL;
@@ -1529,9 +2148,11 @@ retry:
         }
     }
 
+remove_dir:
     if (!job_aborted (job) &&
         /* Don't delete dir if there was a skipped file */
         !local_skipped_file) {
+        error = NULL;
         if (!g_file_delete (dir, job->cancellable, &error)) {
             if (job->skip_all_error) {
                 goto skip;
@@ -1712,28 +2333,211 @@ report_trash_progress (CommonJob *job,
 }
 
 
-static void
-trash_files (CommonJob *job, GList *files, int *files_skipped)
+/* Local files on the same filesystem as the home trash are trashed here directly rather
+ * than through one g_file_trash () each, following the freedesktop.org trash layout that
+ * the trash:/// backend, TrashMonitor and restore rely on. The trash folders are opened
+ * once per job and every file costs one exclusive create of its .trashinfo and one rename.
+ * Folders, anything else, and any failure go through g_file_trash () as before.
+ */
+typedef struct {
+    int files_fd;
+    int info_fd;
+    dev_t dev;
+    char *trash_path;
+    char *deletion_date;
+    guint generation;
+} HomeTrash;
+
+/* Emptying the trash renames its folders away, see stage_trash_root (). This lock keeps
+ * that apart from trashing a file here, and the generation tells open folders are stale */
+G_LOCK_DEFINE_STATIC (home_trash);
+static guint home_trash_generation;
+
+/* Called with the home_trash lock held */
+static gboolean
+home_trash_open_dirs (HomeTrash *trash)
 {
-    GList *l;
-    GFile *file;
-    GList *to_delete;
-    GError *error;
-    GFileInfo *info;
-    GFileInfo *parent_info;
-    GFileInfo *fsinfo;
-    int total_files, files_trashed;
-    char *primary, *secondary, *details;
-    int response;
-    guint64 mtime;
-    gboolean can_delete;
-    gboolean can_write;
-    gboolean is_folder;
-    gboolean parent_can_write;
-    gboolean readonly_fs;
-    gboolean have_info;
+    char *files_path, *info_path;
+    struct stat st;
+
+    if (trash->files_fd >= 0) {
+        close (trash->files_fd);
+    }
+    if (trash->info_fd >= 0) {
+        close (trash->info_fd);
+    }
+    trash->files_fd = -1;
+    trash->info_fd = -1;
+    trash->generation = home_trash_generation;
+
+    files_path = g_build_filename (trash->trash_path, "files", NULL);
+    info_path = g_build_filename (trash->trash_path, "info", NULL);
+
+    if (g_mkdir_with_parents (files_path, 0700) == 0 && g_mkdir_with_parents (info_path, 0700) == 0) {
+        trash->files_fd = open (files_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        trash->info_fd = open (info_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+
+    g_free (files_path);
+    g_free (info_path);
+
+    if (trash->files_fd < 0 || trash->info_fd < 0 || fstat (trash->files_fd, &st) != 0) {
+        return FALSE;
+    }
+
+    trash->dev = st.st_dev;
+
+    return TRUE;
+}
+
+static gboolean
+home_trash_open (HomeTrash *trash)
+{
+    GDateTime *now;
+    gboolean res;
+
+    trash->files_fd = -1;
+    trash->info_fd = -1;
+    trash->deletion_date = NULL;
+    trash->trash_path = g_build_filename (g_get_user_data_dir (), "Trash", NULL);
+
+    G_LOCK (home_trash);
+    res = home_trash_open_dirs (trash);
+    G_UNLOCK (home_trash);
+
+    if (!res) {
+        return FALSE;
+    }
+
+    now = g_date_time_new_now_local ();
+    trash->deletion_date = g_date_time_format (now, "%Y-%m-%dT%H:%M:%S");
+    g_date_time_unref (now);
+
+    return TRUE;
+}
+
+static void
+home_trash_close (HomeTrash *trash)
+{
+    if (trash->files_fd >= 0) {
+        close (trash->files_fd);
+    }
+    if (trash->info_fd >= 0) {
+        close (trash->info_fd);
+    }
+    g_free (trash->trash_path);
+    g_free (trash->deletion_date);
+}
+
+static gboolean
+home_trash_file (HomeTrash *trash, GFile *file)
+{
+    char *path, *basename, *name, *info_name, *escaped, *contents;
+    struct stat st;
+    gboolean res = FALSE;
+    gsize written, len, trash_len;
+    ssize_t n;
+    int fd = -1;
+    int i;
+
+    /* Folders are left to g_file_trash (), this does not keep the directorysizes
+     * cache of the trash that the layout asks for with them */
+    path = g_file_get_path (file);
+    trash_len = strlen (trash->trash_path);
+    if (path == NULL || lstat (path, &st) != 0 || st.st_dev != trash->dev || S_ISDIR (st.st_mode) ||
+        (strncmp (path, trash->trash_path, trash_len) == 0 &&
+         (path[trash_len] == '/' || path[trash_len] == '\0'))) {
+        g_free (path);
+        return FALSE;
+    }
+
+    basename = g_path_get_basename (path);
+    name = NULL;
+    info_name = NULL;
+
+    G_LOCK (home_trash);
+    if (trash->generation != home_trash_generation && !home_trash_open_dirs (trash)) {
+        goto out;
+    }
+
+    /* Creating the .trashinfo exclusively is what reserves the name in the trash */
+    for (i = 1; i < 1000 && fd < 0; i++) {
+        g_free (name);
+        g_free (info_name);
+        name = (i == 1) ? g_strdup (basename) : g_strdup_printf ("%s.%d", basename, i);
+        info_name = g_strconcat (name, ".trashinfo", NULL);
+
+        if (faccessat (trash->files_fd, name, F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
+            continue;
+        }
+
+        fd = openat (trash->info_fd, info_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd < 0 && errno != EEXIST) {
+            break;
+        }
+    }
+
+    if (fd < 0) {
+        goto out;
+    }
+
+    escaped = g_uri_escape_string (path, "/", FALSE);
+    contents = g_strdup_printf ("[Trash Info]\nPath=%s\nDeletionDate=%s\n", escaped, trash->deletion_date);
+    len = strlen (contents);
+    for (written = 0; written < len; written += n) {
+        n = write (fd, contents + written, len - written);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+        } else if (n <= 0) {
+            break;
+        }
+    }
+    g_free (escaped);
+    g_free (contents);
+
+    if (close (fd) == 0 && written == len &&
+        renameat (AT_FDCWD, path, trash->files_fd, name) == 0) {
+        res = TRUE;
+    } else {
+        unlinkat (trash->info_fd, info_name, 0);
+    }
+
+out:
+    G_UNLOCK (home_trash);
+
+    g_free (path);
+    g_free (basename);
+    g_free (name);
+    g_free (info_name);
+
+    return res;
+}
+
+static void
+trash_files (CommonJob *job, GList *files, int *files_skipped)
+{
+    GList *l;
+    GFile *file;
+    GList *to_delete;
+    GError *error;
+    GFileInfo *info;
+    GFileInfo *parent_info;
+    GFileInfo *fsinfo;
+    int total_files, files_trashed;
+    char *primary, *secondary, *details;
+    int response;
+    guint64 mtime;
+    gboolean can_delete;
+    gboolean can_write;
+    gboolean is_folder;
+    gboolean parent_can_write;
+    gboolean readonly_fs;
+    gboolean have_info;
     gboolean have_parent_info;
     gboolean have_filesystem_info;
+    HomeTrash home_trash;
+    gboolean use_home_trash;
+    guint64 now, last_report_time;
 
     if (job_aborted (job)) {
         return;
@@ -1743,6 +2547,9 @@ trash_files (CommonJob *job, GList *files, int *files_skipped)
     files_trashed = 0;
 
     report_trash_progress (job, files_trashed, total_files);
+    last_report_time = g_thread_gettime ();
+
+    use_home_trash = home_trash_open (&home_trash);
 
     to_delete = NULL;
     for (l = files;
@@ -1754,7 +2561,8 @@ trash_files (CommonJob *job, GList *files, int *files_skipped)
 
         mtime = marlin_undo_manager_get_file_modification_time (file);
 
-        if (!g_file_trash (file, job->cancellable, &error)) {
+        if (!(use_home_trash && home_trash_file (&home_trash, file)) &&
+            !g_file_trash (file, job->cancellable, &error)) {
             if (job->skip_all_error) {
                 (*files_skipped)++;
                 goto skip;
@@ -1865,10 +2673,17 @@ skip:
             // End UNDO-REDO
 
             files_trashed++;
-            report_trash_progress (job, files_trashed, total_files);
+
+            now = g_thread_gettime ();
+            if (now - last_report_time >= 100 * NSEC_PER_MSEC || files_trashed == total_files) {
+                report_trash_progress (job, files_trashed, total_files);
+                last_report_time = now;
+            }
         }
     }
 
+    home_trash_close (&home_trash);
+
     if (to_delete) {
         to_delete = g_list_reverse (to_delete);
         delete_files (job, to_delete, files_skipped);
@@ -2002,6 +2817,7 @@ trash_or_delete_internal (GList                  *files,
     job->user_cancel = FALSE;
     job->done_callback = done_callback;
     job->done_callback_data = done_callback_data;
+    start_progress_sampler ((CommonJob *)job, sample_delete_progress);
 
     if (try_trash) {
         inhibit_power_manager ((CommonJob *)job, _("Trashing Files"));
@@ -2015,11 +2831,15 @@ trash_or_delete_internal (GList                  *files,
         marlin_undo_manager_data_set_src_dir (job->common.undo_redo_data, src_dir);
     }
 
-    g_io_scheduler_push_job (delete_job,
-                             job,
-                             NULL,
-                             0,
-                             NULL);
+    if (try_trash) {
+        g_io_scheduler_push_job (delete_job,
+                                 job,
+                                 NULL,
+                                 0,
+                                 NULL);
+    } else {
+        schedule_job (delete_job, job, (CommonJob *)job, files->data, G_PRIORITY_DEFAULT);
+    }
 }
 
 void
@@ -2341,6 +3161,373 @@ marlin_file_operations_mount_volume_full (GtkWindow *parent_window,
     g_volume_mount (volume, 0, mount_op, NULL, volume_mount_cb, mount_op);
 }
 
+/* While scanning for a copy, the listing of every folder is kept so that the copy
+ * itself does not have to enumerate the tree a second time. Each listing is packed as
+ * records of a type byte, a 64 bit size and a nul terminated name. Once the listings
+ * use more than SCAN_MANIFEST_MAX_MEMORY further ones go to an unlinked temporary file.
+ */
+#define SCAN_MANIFEST_MAX_MEMORY (32 * 1024 * 1024)
+/* Set in the type byte of files that have more than one link */
+#define SCAN_MANIFEST_MULTI_LINK 0x80
+
+#define SCAN_LINK_ATTRIBUTES G_FILE_ATTRIBUTE_UNIX_NLINK "," \
+                             G_FILE_ATTRIBUTE_UNIX_DEVICE "," \
+                             G_FILE_ATTRIBUTE_UNIX_INODE
+
+struct ScanManifest {
+    GMutex lock;                /* listings are added from the scan workers */
+    GHashTable *dirs;           /* GFile -> ManifestListing */
+    gsize memory_used;
+    int spill_fd;
+    goffset spill_size;
+};
+
+typedef struct {
+    GByteArray *data;           /* NULL once spilled */
+    goffset offset;
+    gsize length;
+} ManifestListing;
+
+static void
+manifest_listing_free (ManifestListing *listing)
+{
+    if (listing->data != NULL) {
+        g_byte_array_unref (listing->data);
+    }
+    g_slice_free (ManifestListing, listing);
+}
+
+static ScanManifest *
+scan_manifest_new (void)
+{
+    ScanManifest *manifest;
+
+    manifest = g_new0 (ScanManifest, 1);
+    manifest->dirs = g_hash_table_new_full (g_file_hash, (GEqualFunc)g_file_equal,
+                                            g_object_unref, (GDestroyNotify)manifest_listing_free);
+    manifest->spill_fd = -1;
+    g_mutex_init (&manifest->lock);
+
+    return manifest;
+}
+
+static void
+scan_manifest_free (ScanManifest *manifest)
+{
+    g_hash_table_destroy (manifest->dirs);
+    if (manifest->spill_fd >= 0) {
+        close (manifest->spill_fd);
+    }
+    g_mutex_clear (&manifest->lock);
+    g_free (manifest);
+}
+
+static void
+scan_manifest_append (GByteArray *data, GFileInfo *info)
+{
+    guint8 type;
+    gint64 size;
+    const char *name;
+
+    type = (guint8) g_file_info_get_file_type (info);
+    if (g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_NLINK) > 1) {
+        type |= SCAN_MANIFEST_MULTI_LINK;
+    }
+    size = g_file_info_get_size (info);
+    name = g_file_info_get_name (info);
+
+    g_byte_array_append (data, &type, sizeof (type));
+    g_byte_array_append (data, (guint8 *) &size, sizeof (size));
+    g_byte_array_append (data, (const guint8 *) name, strlen (name) + 1);
+}
+
+static gboolean
+scan_manifest_spill (ScanManifest *manifest, ManifestListing *listing)
+{
+    char *path;
+    gsize written;
+    ssize_t n;
+
+    if (manifest->spill_fd < 0) {
+        manifest->spill_fd = g_file_open_tmp ("io.elementary.files-scan-XXXXXX", &path, NULL);
+        if (manifest->spill_fd < 0) {
+            return FALSE;
+        }
+        /* Only the descriptor is needed, nothing is left behind if we crash */
+        g_unlink (path);
+        g_free (path);
+    }
+
+    for (written = 0; written < listing->data->len; written += n) {
+        n = pwrite (manifest->spill_fd, listing->data->data + written, listing->data->len - written,
+                    manifest->spill_size + written);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+        } else if (n <= 0) {
+            return FALSE;
+        }
+    }
+
+    listing->offset = manifest->spill_size;
+    manifest->spill_size += listing->length;
+    g_byte_array_unref (listing->data);
+    listing->data = NULL;
+
+    return TRUE;
+}
+
+/* Takes ownership of @data */
+static void
+scan_manifest_add_dir (ScanManifest *manifest, GFile *dir, GByteArray *data)
+{
+    ManifestListing *listing;
+
+    listing = g_slice_new0 (ManifestListing);
+    listing->data = data;
+    listing->length = data->len;
+
+    g_mutex_lock (&manifest->lock);
+
+    if (manifest->memory_used + data->len > SCAN_MANIFEST_MAX_MEMORY &&
+        !scan_manifest_spill (manifest, listing)) {
+        /* The copy will enumerate this folder itself */
+        manifest_listing_free (listing);
+    } else {
+        if (listing->data != NULL) {
+            manifest->memory_used += data->len;
+        }
+
+        g_hash_table_replace (manifest->dirs, g_object_ref (dir), listing);
+    }
+
+    g_mutex_unlock (&manifest->lock);
+}
+
+/* Returns the recorded listing of @dir, or NULL if it has to be enumerated */
+/* Leaves the listing in @manifest, see scan_manifest_take_dir () */
+static GByteArray *
+scan_manifest_read_dir (ScanManifest *manifest, GFile *dir)
+{
+    ManifestListing *listing;
+    GByteArray *data;
+    gsize done;
+    ssize_t n;
+
+    /* Only called once the scan is over */
+    listing = g_hash_table_lookup (manifest->dirs, dir);
+    if (listing == NULL) {
+        return NULL;
+    }
+
+    if (listing->data != NULL) {
+        data = g_byte_array_ref (listing->data);
+    } else {
+        data = g_byte_array_sized_new (listing->length);
+        g_byte_array_set_size (data, listing->length);
+        for (done = 0; done < listing->length; done += n) {
+            n = pread (manifest->spill_fd, data->data + done, listing->length - done, listing->offset + done);
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+            } else if (n <= 0) {
+                g_byte_array_unref (data);
+                data = NULL;
+                break;
+            }
+        }
+    }
+
+    return data;
+}
+
+static GByteArray *
+scan_manifest_take_dir (ScanManifest *manifest, GFile *dir)
+{
+    ManifestListing *listing;
+    GByteArray *data;
+
+    data = scan_manifest_read_dir (manifest, dir);
+
+    /* Each folder is only copied once */
+    listing = g_hash_table_lookup (manifest->dirs, dir);
+    if (listing != NULL && listing->data != NULL) {
+        manifest->memory_used -= listing->length;
+    }
+    g_hash_table_remove (manifest->dirs, dir);
+
+    return data;
+}
+
+/* Returns the next child recorded in @data, advancing @pos, or NULL at the end */
+static GFileInfo *
+scan_manifest_next_info (GByteArray *data, gsize *pos)
+{
+    GFileInfo *info;
+    guint8 type;
+    gint64 size;
+    const char *name;
+
+    if (*pos >= data->len) {
+        return NULL;
+    }
+
+    type = data->data[*pos];
+    memcpy (&size, data->data + *pos + sizeof (type), sizeof (size));
+    name = (const char *) data->data + *pos + sizeof (type) + sizeof (size);
+    *pos += sizeof (type) + sizeof (size) + strlen (name) + 1;
+
+    info = g_file_info_new ();
+    g_file_info_set_name (info, name);
+    g_file_info_set_file_type (info, (GFileType) (type & ~SCAN_MANIFEST_MULTI_LINK));
+    g_file_info_set_size (info, size);
+    if (type & SCAN_MANIFEST_MULTI_LINK) {
+        g_file_info_set_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_NLINK, 2);
+    }
+
+    return info;
+}
+
+/* When copying with the preserve-hardlinks preference set, regular files with several
+ * links are tracked by device and inode. The scan counts the size of each inode once,
+ * and the copy transfers the first link it meets and recreates the others as hardlinks
+ * of that copy, provided they end up on the same filesystem.
+ */
+typedef struct {
+    guint32 dev;                /* truncated as in G_FILE_ATTRIBUTE_UNIX_DEVICE */
+    guint64 ino;
+} InodeKey;
+
+struct HardlinkMap {
+    GMutex lock;                /* the scan workers add to it */
+    GHashTable *inodes;         /* InodeKey -> path of the first copy, "" until copied */
+};
+
+static guint
+inode_key_hash (gconstpointer key)
+{
+    const InodeKey *k = key;
+
+    return (guint) (k->ino ^ (k->ino >> 32)) ^ k->dev;
+}
+
+static gboolean
+inode_key_equal (gconstpointer a, gconstpointer b)
+{
+    const InodeKey *ka = a, *kb = b;
+
+    return ka->ino == kb->ino && ka->dev == kb->dev;
+}
+
+static HardlinkMap *
+hardlink_map_new (void)
+{
+    HardlinkMap *map;
+
+    map = g_new0 (HardlinkMap, 1);
+    map->inodes = g_hash_table_new_full (inode_key_hash, inode_key_equal, g_free, g_free);
+    g_mutex_init (&map->lock);
+
+    return map;
+}
+
+static void
+hardlink_map_free (HardlinkMap *map)
+{
+    g_hash_table_destroy (map->inodes);
+    g_mutex_clear (&map->lock);
+    g_free (map);
+}
+
+/* Fills in @key when @info is a regular file with several links */
+static gboolean
+hardlink_key_for_info (GFileInfo *info, InodeKey *key)
+{
+    if (g_file_info_get_file_type (info) != G_FILE_TYPE_REGULAR ||
+        g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_NLINK) < 2) {
+        return FALSE;
+    }
+
+    key->dev = g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_DEVICE);
+    key->ino = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_UNIX_INODE);
+
+    return TRUE;
+}
+
+/* Returns TRUE if @key was already counted, otherwise registers it */
+static gboolean
+hardlink_map_seen_key (HardlinkMap *map, const InodeKey *key)
+{
+    gboolean seen;
+
+    g_mutex_lock (&map->lock);
+    seen = g_hash_table_contains (map->inodes, key);
+    if (!seen) {
+        g_hash_table_insert (map->inodes, g_memdup (key, sizeof (*key)), g_strdup (""));
+    }
+    g_mutex_unlock (&map->lock);
+
+    return seen;
+}
+
+/* Returns TRUE if @info is a further link to an inode that was already counted */
+static gboolean
+hardlink_map_seen (HardlinkMap *map, GFileInfo *info)
+{
+    InodeKey key;
+
+    return hardlink_key_for_info (info, &key) && hardlink_map_seen_key (map, &key);
+}
+
+/* Creates @dest as a hardlink to the earlier copy of @src, if there is one. Otherwise,
+ * when @src has several links, fills in @key for hardlink_map_add () after the copy.
+ */
+static gboolean
+hardlink_map_link (HardlinkMap *map, GFile *src, GFile *dest, InodeKey *key)
+{
+    struct stat st;
+    char *src_path, *dest_path;
+    const char *target;
+    gboolean linked = FALSE;
+
+    key->ino = 0;
+
+    src_path = g_file_get_path (src);
+    dest_path = g_file_get_path (dest);
+    if (src_path == NULL || dest_path == NULL ||
+        lstat (src_path, &st) != 0 || !S_ISREG (st.st_mode) || st.st_nlink < 2) {
+        goto out;
+    }
+
+    key->dev = (guint32) st.st_dev;
+    key->ino = st.st_ino;
+
+    g_mutex_lock (&map->lock);
+    target = g_hash_table_lookup (map->inodes, key);
+    /* An existing dest is left for the normal conflict handling */
+    linked = target != NULL && *target != '\0' && link (target, dest_path) == 0;
+    g_mutex_unlock (&map->lock);
+
+out:
+    g_free (src_path);
+    g_free (dest_path);
+
+    return linked;
+}
+
+static void
+hardlink_map_add (HardlinkMap *map, const InodeKey *key, GFile *dest)
+{
+    char *path;
+
+    path = g_file_get_path (dest);
+    if (path == NULL) {
+        return;
+    }
+
+    g_mutex_lock (&map->lock);
+    g_hash_table_replace (map->inodes, g_memdup (key, sizeof (*key)), path);
+    g_mutex_unlock (&map->lock);
+}
+
 static void
 report_count_progress (CommonJob *job,
                        SourceInfo *source_info)
@@ -2385,7 +3572,9 @@ count_file (GFileInfo *info,
             SourceInfo *source_info)
 {
     source_info->num_files += 1;
-    source_info->num_bytes += g_file_info_get_size (info);
+    if (job->links == NULL || !hardlink_map_seen (job->links, info)) {
+        source_info->num_bytes += g_file_info_get_size (info);
+    }
 
     if (source_info->num_files_since_progress++ > 100) {
         report_count_progress (job, source_info);
@@ -2422,6 +3611,7 @@ scan_dir (GFile *dir,
     char *primary, *secondary, *details;
     int response;
     SourceInfo saved_info;
+    GByteArray *listing;
 
     saved_info = *source_info;
 
@@ -2430,15 +3620,21 @@ retry:
     enumerator = g_file_enumerate_children (dir,
                                             G_FILE_ATTRIBUTE_STANDARD_NAME","
                                             G_FILE_ATTRIBUTE_STANDARD_TYPE","
-                                            G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                                            G_FILE_ATTRIBUTE_STANDARD_SIZE","
+                                            SCAN_LINK_ATTRIBUTES,
                                             G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
                                             job->cancellable,
                                             &error);
     if (enumerator) {
         error = NULL;
+        listing = job->manifest != NULL ? g_byte_array_new () : NULL;
         while ((info = g_file_enumerator_next_file (enumerator, job->cancellable, &error)) != NULL) {
             count_file (info, job, source_info);
 
+            if (listing != NULL) {
+                scan_manifest_append (listing, info);
+            }
+
             if (g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY) {
                 subdir = g_file_get_child (dir,
                                            g_file_info_get_name (info));
@@ -2452,6 +3648,15 @@ retry:
         g_file_enumerator_close (enumerator, job->cancellable, NULL);
         g_object_unref (enumerator);
 
+        if (listing != NULL) {
+            /* Incomplete listings are dropped, the copy then reads the folder itself */
+            if (error == NULL) {
+                scan_manifest_add_dir (job->manifest, dir, listing);
+            } else {
+                g_byte_array_unref (listing);
+            }
+        }
+
         if (error && IS_IO_ERROR (error, CANCELLED)) {
             g_error_free (error);
         } else if (error) {
@@ -2532,35 +3737,231 @@ retry:
     }
 }
 
+/* Folders are read by a pool of enumerator threads, breadth first. A worker only adds
+ * a folder's totals to the shared SourceInfo once it was read completely. Any folder a
+ * worker fails on is handed back to the job thread, which reads it again with scan_dir ()
+ * so that error dialogs, skip and retry are handled there one at a time as before.
+ */
+#define SCAN_THREADS 4
+
+typedef struct {
+    InodeKey key;
+    goffset size;
+} ScanLink;
+
+typedef struct {
+    CommonJob *job;
+    SourceInfo *source_info;    /* protected by lock */
+    GThreadPool *pool;
+    GMutex lock;
+    GCond cond;
+    guint pending;              /* folders queued or being read */
+    GQueue failed;              /* folders left to the job thread */
+} ParallelScan;
+
+static void
+parallel_scan_push (ParallelScan *scan, GFile *dir)
+{
+    g_mutex_lock (&scan->lock);
+    scan->pending++;
+    g_mutex_unlock (&scan->lock);
+
+    g_thread_pool_push (scan->pool, dir, NULL);
+}
+
+static void
+parallel_scan_worker (gpointer data, gpointer user_data)
+{
+    GFile *dir = data;
+    ParallelScan *scan = user_data;
+    CommonJob *job = scan->job;
+    GFileEnumerator *enumerator;
+    GFileInfo *info;
+    GError *error = NULL;
+    GByteArray *listing = NULL;
+    GSList *subdirs = NULL, *l;
+    GArray *links = NULL;
+    ScanLink link;
+    guint i;
+    int num_files = 0;
+    goffset num_bytes = 0;
+    gboolean failed = FALSE;
+
+    if (g_cancellable_is_cancelled (job->cancellable)) {
+        goto done;
+    }
+
+    enumerator = g_file_enumerate_children (dir,
+                                            G_FILE_ATTRIBUTE_STANDARD_NAME","
+                                            G_FILE_ATTRIBUTE_STANDARD_TYPE","
+                                            G_FILE_ATTRIBUTE_STANDARD_SIZE","
+                                            SCAN_LINK_ATTRIBUTES,
+                                            G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                            job->cancellable,
+                                            &error);
+    if (enumerator != NULL) {
+        listing = job->manifest != NULL ? g_byte_array_new () : NULL;
+        links = g_array_new (FALSE, FALSE, sizeof (ScanLink));
+
+        while ((info = g_file_enumerator_next_file (enumerator, job->cancellable, &error)) != NULL) {
+            num_files++;
+            /* Links are registered once the folder was read completely, see below */
+            if (job->links != NULL && hardlink_key_for_info (info, &link.key)) {
+                link.size = g_file_info_get_size (info);
+                g_array_append_val (links, link);
+            } else {
+                num_bytes += g_file_info_get_size (info);
+            }
+
+            if (listing != NULL) {
+                scan_manifest_append (listing, info);
+            }
+
+            if (g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY) {
+                subdirs = g_slist_prepend (subdirs, g_file_get_child (dir, g_file_info_get_name (info)));
+            }
+
+            g_object_unref (info);
+        }
+        g_file_enumerator_close (enumerator, job->cancellable, NULL);
+        g_object_unref (enumerator);
+    }
+
+    if (error != NULL) {
+        failed = !IS_IO_ERROR (error, CANCELLED);
+        g_error_free (error);
+
+        /* scan_dir () reads the whole folder again, nothing of it may be counted yet */
+        num_files = 0;
+        num_bytes = 0;
+        g_slist_free_full (subdirs, g_object_unref);
+        if (listing != NULL) {
+            g_byte_array_unref (listing);
+        }
+        goto done;
+    }
+
+    for (i = 0; links != NULL && i < links->len; i++) {
+        link = g_array_index (links, ScanLink, i);
+        if (!hardlink_map_seen_key (job->links, &link.key)) {
+            num_bytes += link.size;
+        }
+    }
+
+    if (listing != NULL) {
+        scan_manifest_add_dir (job->manifest, dir, listing);
+    }
+
+    for (l = subdirs; l != NULL; l = l->next) {
+        parallel_scan_push (scan, l->data);
+    }
+    g_slist_free (subdirs);
+
+done:
+    if (links != NULL) {
+        g_array_unref (links);
+    }
+
+    g_mutex_lock (&scan->lock);
+    scan->source_info->num_files += num_files;
+    scan->source_info->num_bytes += num_bytes;
+    if (failed) {
+        g_queue_push_tail (&scan->failed, dir);
+    } else {
+        g_object_unref (dir);
+    }
+    scan->pending--;
+    g_cond_signal (&scan->cond);
+    g_mutex_unlock (&scan->lock);
+}
+
+/* Called on the job thread, with the lock held */
+static void
+parallel_scan_handle_failed (ParallelScan *scan, GFile *dir)
+{
+    SourceInfo before, info;
+    GQueue dirs = G_QUEUE_INIT;
+    GFile *subdir;
+
+    before = *scan->source_info;
+    info = before;
+    g_mutex_unlock (&scan->lock);
+
+    scan_dir (dir, &info, scan->job, &dirs);
+    g_object_unref (dir);
+
+    while ((subdir = g_queue_pop_head (&dirs)) != NULL) {
+        if (job_aborted (scan->job)) {
+            g_object_unref (subdir);
+        } else {
+            parallel_scan_push (scan, subdir);
+        }
+    }
+
+    g_mutex_lock (&scan->lock);
+    scan->source_info->num_files += info.num_files - before.num_files;
+    scan->source_info->num_bytes += info.num_bytes - before.num_bytes;
+}
+
+static void
+parallel_scan_wait (ParallelScan *scan)
+{
+    GFile *dir;
+    gint64 next_report;
+
+    next_report = g_get_monotonic_time () + 100 * G_TIME_SPAN_MILLISECOND;
+
+    g_mutex_lock (&scan->lock);
+    while (scan->pending > 0 || !g_queue_is_empty (&scan->failed)) {
+        if ((dir = g_queue_pop_head (&scan->failed)) != NULL) {
+            if (job_aborted (scan->job)) {
+                g_object_unref (dir);
+            } else {
+                parallel_scan_handle_failed (scan, dir);
+            }
+            continue;
+        }
+
+        /* The workers never touch the progress info, it is only updated from here */
+        if (!g_cond_wait_until (&scan->cond, &scan->lock, next_report) ||
+            g_get_monotonic_time () >= next_report) {
+            report_count_progress (scan->job, scan->source_info);
+            next_report = g_get_monotonic_time () + 100 * G_TIME_SPAN_MILLISECOND;
+        }
+    }
+    g_mutex_unlock (&scan->lock);
+}
+
 static void
 scan_file (GFile *file,
            SourceInfo *source_info,
-           CommonJob *job)
+           CommonJob *job,
+           ParallelScan *scan)
 {
     GFileInfo *info;
     GError *error;
-    GQueue *dirs;
-    GFile *dir;
     char *primary;
     char *secondary;
     char *details;
     int response;
 
-    dirs = g_queue_new ();
 retry:
     error = NULL;
     info = g_file_query_info (file,
                               G_FILE_ATTRIBUTE_STANDARD_TYPE","
-                              G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                              G_FILE_ATTRIBUTE_STANDARD_SIZE","
+                              SCAN_LINK_ATTRIBUTES,
                               G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
                               job->cancellable,
                               &error);
 
     if (info) {
+        g_mutex_lock (&scan->lock);
         count_file (info, job, source_info);
+        g_mutex_unlock (&scan->lock);
 
         if (g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY) {
-            g_queue_push_head (dirs, g_object_ref (file));
+            parallel_scan_push (scan, g_object_ref (file));
         }
 
         g_object_unref (info);
@@ -2606,16 +4007,6 @@ retry:
             g_assert_not_reached ();
         }
     }
-
-    while (!job_aborted (job) &&
-           (dir = g_queue_pop_head (dirs)) != NULL) {
-        scan_dir (dir, source_info, job, dirs);
-        g_object_unref (dir);
-    }
-
-    /* Free all from queue if we exited early */
-    g_queue_foreach (dirs, (GFunc)g_object_unref, NULL);
-    g_queue_free (dirs);
 }
 
 static void
@@ -2626,20 +4017,36 @@ scan_sources (GList *files,
 {
     GList *l;
     GFile *file;
+    ParallelScan scan;
 
     memset (source_info, 0, sizeof (SourceInfo));
     source_info->op = kind;
 
     report_count_progress (job, source_info);
 
+    memset (&scan, 0, sizeof (ParallelScan));
+    scan.job = job;
+    scan.source_info = source_info;
+    g_mutex_init (&scan.lock);
+    g_cond_init (&scan.cond);
+    g_queue_init (&scan.failed);
+    scan.pool = g_thread_pool_new (parallel_scan_worker, &scan, SCAN_THREADS, FALSE, NULL);
+
     for (l = files; l != NULL && !job_aborted (job); l = l->next) {
         file = l->data;
 
         scan_file (file,
                    source_info,
-                   job);
+                   job,
+                   &scan);
     }
 
+    parallel_scan_wait (&scan);
+
+    g_thread_pool_free (scan.pool, FALSE, TRUE);
+    g_mutex_clear (&scan.lock);
+    g_cond_clear (&scan.cond);
+
     /* Make sure we report the final count */
     report_count_progress (job, source_info);
 }
@@ -2806,27 +4213,33 @@ report_copy_progress (CopyMoveJob *copy_job,
                       SourceInfo *source_info,
                       TransferInfo *transfer_info)
 {
-    CommonJob *job;
+    CommonJob *job = (CommonJob *)copy_job;
+
+    job_wait_while_paused (job);
+    job_apply_background (job, transfer_info->num_bytes - transfer_info->skipped_bytes);
+    publish_progress (job, source_info, transfer_info);
+}
+
+static gboolean
+sample_copy_progress (gpointer user_data)
+{
+    CopyMoveJob *copy_job = user_data;
+    CommonJob *job = user_data;
+    SourceInfo si, *source_info = &si;
+    TransferInfo ti, *transfer_info = &ti;
     gboolean is_move;
     int files_left;
     goffset total_size;
     double elapsed, transfer_rate;
     int remaining_time;
-    guint64 now;
     gchar *s = NULL;
+    gchar *details;
 
-    job = (CommonJob *)copy_job;
-
-    is_move = copy_job->is_move;
-
-    now = g_thread_gettime ();
-
-    if (transfer_info->last_report_time != 0 &&
-        ABS ((gint64)(transfer_info->last_report_time - now)) < 100 * NSEC_PER_MSEC) {
-        return;
+    if (!sample_progress (job, source_info, transfer_info)) {
+        return G_SOURCE_CONTINUE;
     }
 
-    transfer_info->last_report_time = now;
+    is_move = copy_job->is_move;
 
     files_left = source_info->num_files - transfer_info->num_files;
 
@@ -2835,10 +4248,10 @@ report_copy_progress (CopyMoveJob *copy_job,
         files_left = 1;
     }
 
-    if (files_left != transfer_info->last_reported_files_left ||
-        transfer_info->last_reported_files_left == 0) {
+    if (files_left != job->counters.last_reported_files_left ||
+        job->counters.last_reported_files_left == 0) {
         /* Avoid changing this unless files_left changed since last time */
-        transfer_info->last_reported_files_left = files_left;
+        job->counters.last_reported_files_left = files_left;
 
         if (source_info->num_files == 1) {
             if (copy_job->destination != NULL) {
@@ -2898,54 +4311,50 @@ report_copy_progress (CopyMoveJob *copy_job,
     elapsed = g_timer_elapsed (job->time, NULL);
     transfer_rate = 0;
     if (elapsed > 0) {
-        transfer_rate = transfer_info->num_bytes / elapsed;
+        /* Skipped files take no time */
+        transfer_rate = (transfer_info->num_bytes - transfer_info->skipped_bytes) / elapsed;
     }
 
-    if (elapsed < SECONDS_NEEDED_FOR_RELIABLE_TRANSFER_RATE &&
-        transfer_rate > 0) {
-        char *s;
+    /* Nothing may have been transferred yet when everything so far was unchanged */
+    if (elapsed < SECONDS_NEEDED_FOR_RELIABLE_TRANSFER_RATE ||
+        transfer_rate <= 0) {
         /// TRANSLATORS: %S will expand to a size like "2 bytes" or "3 MB", so something like "4 kb of 4 MB"
-        s = f (_("%S of %S"), transfer_info->num_bytes, total_size);
-        pf_progress_info_take_details (job->progress, s);
+        details = f (_("%S of %S"), transfer_info->num_bytes, total_size);
     } else {
-        char *s;
         remaining_time = (total_size - transfer_info->num_bytes) / transfer_rate;
 
 
         /// TRANSLATORS: %S will expand to a size like "2 bytes" or "3 MB", %T to a time duration like
         /// "2 minutes". So the whole thing will be something like "2 kb of 4 MB -- 2 hours left (4kb/sec)"
         /// The singular/plural form will be used depending on the remaining time (i.e. the %T argument).
-        s = f (ngettext ("%S of %S \xE2\x80\x94 %T left (%S/sec)",
-                 "%S of %S \xE2\x80\x94 %T left (%S/sec)",
-                 seconds_count_format_time_units (remaining_time)),
-               transfer_info->num_bytes, total_size,
-               remaining_time,
-               (goffset)transfer_rate);
-        pf_progress_info_take_details (job->progress, s);
+        details = f (ngettext ("%S of %S \xE2\x80\x94 %T left (%S/sec)",
+                     "%S of %S \xE2\x80\x94 %T left (%S/sec)",
+                     seconds_count_format_time_units (remaining_time)),
+                     transfer_info->num_bytes, total_size,
+                     remaining_time,
+                     (goffset)transfer_rate);
     }
 
+    if (transfer_info->skipped_bytes > 0) {
+        /// TRANSLATORS: %s is the progress detail above, %S a size like "3 MB"
+        s = f (_("%s, %S unchanged"), details, transfer_info->skipped_bytes);
+        g_free (details);
+        details = s;
+    }
+
+    pf_progress_info_take_details (job->progress, details);
+
     pf_progress_info_set_progress (job->progress, transfer_info->num_bytes, total_size);
+
+    return G_SOURCE_CONTINUE;
 }
 
 static int
-get_max_name_length (GFile *file_dir)
+max_name_length_in (const char *dir,
+                    long max_path,
+                    long max_name)
 {
     int max_length;
-    char *dir;
-    long max_path;
-    long max_name;
-
-    max_length = -1;
-
-    if (!g_file_has_uri_scheme (file_dir, "file"))
-        return max_length;
-
-    dir = g_file_get_path (file_dir);
-    if (!dir)
-        return max_length;
-
-    max_path = pathconf (dir, _PC_PATH_MAX);
-    max_name = pathconf (dir, _PC_NAME_MAX);
 
     if (max_name == -1 && max_path == -1) {
         max_length = -1;
@@ -2961,6 +4370,26 @@ get_max_name_length (GFile *file_dir)
         max_length = MIN (leftover, max_name);
     }
 
+    return max_length;
+}
+
+static int
+get_max_name_length (GFile *file_dir)
+{
+    int max_length;
+    char *dir;
+
+    max_length = -1;
+
+    if (!g_file_has_uri_scheme (file_dir, "file"))
+        return max_length;
+
+    dir = g_file_get_path (file_dir);
+    if (!dir)
+        return max_length;
+
+    max_length = max_name_length_in (dir, pathconf (dir, _PC_PATH_MAX), pathconf (dir, _PC_NAME_MAX));
+
     g_free (dir);
 
     return max_length;
@@ -3017,99 +4446,361 @@ make_file_name_valid_for_dest_fs (char *filename,
     return FALSE;
 }
 
-static GFile *
-get_unique_target_file (GFile *src,
-                        GFile *dest_dir,
-                        gboolean same_fs,
-                        const char *dest_fs_type,
-                        int count)
+/* Filesystem capabilities
+ *
+ * Copies and moves ask a destination filesystem for its type, name limits and readonly
+ * state once for the whole job rather than for every file or folder that needs them.
+ * A folder seen before maps straight to its filesystem, a new one costs a stat for the
+ * filesystem id. The characters to replace in names follow from the type.
+ */
+typedef struct {
+    char *type;                 /* "" when it cannot be queried, as query_fs_type () */
+    long max_path;
+    long max_name;
+    gboolean readonly;
+} FsCaps;
+
+struct FsCapsCache {
+    GPtrArray *caps;
+    GHashTable *by_id;          /* filesystem id to FsCaps, not owned */
+    GHashTable *by_dir;         /* folder to FsCaps, not owned */
+    int n_calls;                /* made to fill the cache */
+    int n_calls_saved;          /* the uncached lookups would have made */
+};
+
+static void
+fs_caps_free (FsCaps *caps)
 {
-    const char *editname, *end;
-    char *basename, *new_name;
-    GFileInfo *info;
-    GFile *dest;
-    int max_length;
+    g_free (caps->type);
+    g_free (caps);
+}
 
-    max_length = get_max_name_length (dest_dir);
+static void
+fs_caps_cache_free (FsCapsCache *cache)
+{
+    g_hash_table_unref (cache->by_dir);
+    g_hash_table_unref (cache->by_id);
+    g_ptr_array_free (cache->caps, TRUE);
+    g_free (cache);
+}
 
-    dest = NULL;
-    info = g_file_query_info (src,
-                              G_FILE_ATTRIBUTE_STANDARD_EDIT_NAME,
-                              0, NULL, NULL);
-    if (info != NULL) {
-        editname = g_file_info_get_attribute_string (info, G_FILE_ATTRIBUTE_STANDARD_EDIT_NAME);
+/* @uncached_cost is the number of calls the caller would have made without the cache */
+static FsCaps *
+get_fs_caps (CopyMoveJob *job,
+             GFile *dir,
+             int uncached_cost)
+{
+    FsCapsCache *cache;
+    FsCaps *caps;
+    GFileInfo *info, *fsinfo;
+    const char *id;
+    char *path;
 
-        if (editname != NULL) {
-            new_name = get_duplicate_name (editname, count, max_length);
-            make_file_name_valid_for_dest_fs (new_name, dest_fs_type);
-            dest = g_file_get_child_for_display_name (dest_dir, new_name, NULL);
-            g_free (new_name);
-        }
+    if (job->fs_caps == NULL) {
+        job->fs_caps = g_new0 (FsCapsCache, 1);
+        job->fs_caps->caps = g_ptr_array_new_with_free_func ((GDestroyNotify) fs_caps_free);
+        job->fs_caps->by_id = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        job->fs_caps->by_dir = g_hash_table_new_full (g_file_hash, (GEqualFunc) g_file_equal,
+                                                      g_object_unref, NULL);
+    }
+    cache = job->fs_caps;
 
-        g_object_unref (info);
+    caps = g_hash_table_lookup (cache->by_dir, dir);
+    if (caps != NULL) {
+        cache->n_calls_saved += uncached_cost;
+        return caps;
     }
 
-    if (dest == NULL) {
-        basename = g_file_get_basename (src);
+    info = g_file_query_info (dir, G_FILE_ATTRIBUTE_ID_FILESYSTEM, 0,
+                              job->common.cancellable, NULL);
+    cache->n_calls++;
+    id = info != NULL ? g_file_info_get_attribute_string (info, G_FILE_ATTRIBUTE_ID_FILESYSTEM) : NULL;
+    if (id != NULL) {
+        caps = g_hash_table_lookup (cache->by_id, id);
+    }
 
-        if (g_utf8_validate (basename, -1, NULL)) {
-            new_name = get_duplicate_name (basename, count, max_length);
-            make_file_name_valid_for_dest_fs (new_name, dest_fs_type);
-            dest = g_file_get_child_for_display_name (dest_dir, new_name, NULL);
-            g_free (new_name);
+    if (caps != NULL) {
+        cache->n_calls_saved += uncached_cost - 1;
+    } else {
+        caps = g_new0 (FsCaps, 1);
+        caps->max_path = caps->max_name = -1;
+
+        fsinfo = g_file_query_filesystem_info (dir,
+                                               G_FILE_ATTRIBUTE_FILESYSTEM_TYPE","
+                                               G_FILE_ATTRIBUTE_FILESYSTEM_READONLY,
+                                               job->common.cancellable,
+                                               NULL);
+        cache->n_calls++;
+        if (fsinfo != NULL) {
+            caps->type = g_strdup (g_file_info_get_attribute_string (fsinfo, G_FILE_ATTRIBUTE_FILESYSTEM_TYPE));
+            caps->readonly = g_file_info_get_attribute_boolean (fsinfo, G_FILE_ATTRIBUTE_FILESYSTEM_READONLY);
+            g_object_unref (fsinfo);
+        }
+        if (caps->type == NULL) {
+            caps->type = g_strdup ("");
         }
 
-        if (dest == NULL) {
-            end = strrchr (basename, '.');
-            if (end != NULL) {
-                count += atoi (end + 1);
-            }
-            new_name = g_strdup_printf ("%s.%d", basename, count);
-            make_file_name_valid_for_dest_fs (new_name, dest_fs_type);
-            dest = g_file_get_child (dest_dir, new_name);
-            g_free (new_name);
+        if (g_file_has_uri_scheme (dir, "file") && (path = g_file_get_path (dir)) != NULL) {
+            caps->max_path = pathconf (path, _PC_PATH_MAX);
+            caps->max_name = pathconf (path, _PC_NAME_MAX);
+            cache->n_calls += 2;
+            g_free (path);
         }
 
-        g_free (basename);
+        g_ptr_array_add (cache->caps, caps);
+        if (id != NULL) {
+            g_hash_table_insert (cache->by_id, g_strdup (id), caps);
+        }
     }
 
-    return dest;
+    g_clear_object (&info);
+    g_hash_table_insert (cache->by_dir, g_object_ref (dir), caps);
+
+    return caps;
 }
 
-static GFile *
-get_target_file_for_link (GFile *src,
-                          GFile *dest_dir,
-                          const char *dest_fs_type,
-                          int count)
+/* Cached query_fs_type () */
+static char *
+get_dest_fs_type (CopyMoveJob *job,
+                  GFile *dir)
 {
-    const char *editname;
-    char *basename, *new_name;
-    GFileInfo *info;
-    GFile *dest;
-    int max_length;
-
-    max_length = get_max_name_length (dest_dir);
+    return g_strdup (get_fs_caps (job, dir, 1)->type);
+}
 
-    dest = NULL;
-    info = g_file_query_info (src,
-                              G_FILE_ATTRIBUTE_STANDARD_EDIT_NAME,
-                              0, NULL, NULL);
-    if (info != NULL) {
-        editname = g_file_info_get_attribute_string (info, G_FILE_ATTRIBUTE_STANDARD_EDIT_NAME);
+/* Cached get_max_name_length () */
+static int
+get_dest_max_name_length (CopyMoveJob *job,
+                          GFile *dir)
+{
+    FsCaps *caps;
+    char *path;
+    int max_length;
 
-        if (editname != NULL) {
-            new_name = get_link_name (editname, count, max_length);
-            make_file_name_valid_for_dest_fs (new_name, dest_fs_type);
-            dest = g_file_get_child_for_display_name (dest_dir, new_name, NULL);
-            g_free (new_name);
-        }
+    if (!g_file_has_uri_scheme (dir, "file")) {
+        return -1;
+    }
 
-        g_object_unref (info);
+    caps = get_fs_caps (job, dir, 2);
+    path = g_file_get_path (dir);
+    if (path == NULL) {
+        return -1;
     }
 
-    if (dest == NULL) {
-        basename = g_file_get_basename (src);
-        make_file_name_valid_for_dest_fs (basename, dest_fs_type);
+    max_length = max_name_length_in (path, caps->max_path, caps->max_name);
+    g_free (path);
+
+    return max_length;
+}
+
+/* Duplicates have their "(copy)" names checked against an index of the destination
+ * folder, read with one enumeration, rather than tried one after the other against
+ * the filesystem. The names handed out are added to it, and the last count used for
+ * each original name is kept, so many copies of one file do not start over at
+ * "(copy)" every time. A name taken by someone else meanwhile still fails with EXISTS
+ * and the next one is handed out. A folder is only indexed once a name tried in it
+ * turned out to be taken, so duplicating a file or two just tries their names.
+ */
+typedef struct {
+    GHashTable *names;          /* basenames in the folder */
+    GHashTable *counts;         /* original name to the last count used */
+    int max_length;
+} NameIndex;
+
+static void
+name_index_free (NameIndex *index)
+{
+    g_hash_table_unref (index->names);
+    g_hash_table_unref (index->counts);
+    g_free (index);
+}
+
+static NameIndex *
+name_index_new (GFile *dir, int max_length, GCancellable *cancellable)
+{
+    NameIndex *index;
+    GFileEnumerator *enumerator;
+    GFileInfo *info;
+
+    index = g_new0 (NameIndex, 1);
+    index->names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    index->counts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    index->max_length = max_length;
+
+    enumerator = g_file_enumerate_children (dir, G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                            G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                            cancellable, NULL);
+    if (enumerator != NULL) {
+        while ((info = g_file_enumerator_next_file (enumerator, cancellable, NULL)) != NULL) {
+            g_hash_table_add (index->names, g_strdup (g_file_info_get_name (info)));
+            g_object_unref (info);
+        }
+        g_object_unref (enumerator);
+    }
+
+    return index;
+}
+
+/* Returns NULL if @dir has no index yet, unless @build is set */
+static NameIndex *
+get_name_index (CopyMoveJob *job, GFile *dir, gboolean build)
+{
+    NameIndex *index;
+
+    if (job->name_indexes == NULL) {
+        if (!build) {
+            return NULL;
+        }
+        job->name_indexes = g_hash_table_new_full (g_file_hash, (GEqualFunc) g_file_equal,
+                                                   g_object_unref, (GDestroyNotify) name_index_free);
+    }
+
+    index = g_hash_table_lookup (job->name_indexes, dir);
+    if (index == NULL && build) {
+        index = name_index_new (dir, get_dest_max_name_length (job, dir), job->common.cancellable);
+        g_hash_table_insert (job->name_indexes, g_object_ref (dir), index);
+        job->n_name_index_dirs++;
+    }
+
+    return index;
+}
+
+/* Returns NULL when @name cannot be used as a display name in @dest_dir */
+static GFile *
+get_indexed_duplicate_file (const char *name,
+                            GFile *dest_dir,
+                            const char *dest_fs_type,
+                            NameIndex *index)
+{
+    char *new_name, *basename;
+    GFile *dest;
+    int count;
+
+    count = GPOINTER_TO_INT (g_hash_table_lookup (index->counts, name));
+
+    for (;;) {
+        new_name = get_duplicate_name (name, ++count, index->max_length);
+        make_file_name_valid_for_dest_fs (new_name, dest_fs_type);
+        dest = g_file_get_child_for_display_name (dest_dir, new_name, NULL);
+        g_free (new_name);
+
+        if (dest == NULL) {
+            return NULL;
+        }
+
+        basename = g_file_get_basename (dest);
+        if (!g_hash_table_contains (index->names, basename)) {
+            break;
+        }
+
+        g_free (basename);
+        g_object_unref (dest);
+    }
+
+    g_hash_table_add (index->names, basename);
+    g_hash_table_replace (index->counts, g_strdup (name), GINT_TO_POINTER (count));
+
+    return dest;
+}
+
+/* With @index, @count is ignored and the next free name is handed out */
+static GFile *
+get_unique_target_file (GFile *src,
+                        GFile *dest_dir,
+                        gboolean same_fs,
+                        const char *dest_fs_type,
+                        NameIndex *index,
+                        int count)
+{
+    const char *editname, *end;
+    char *basename, *new_name;
+    GFileInfo *info;
+    GFile *dest;
+    int max_length;
+
+    max_length = index != NULL ? index->max_length : get_max_name_length (dest_dir);
+
+    dest = NULL;
+    info = g_file_query_info (src,
+                              G_FILE_ATTRIBUTE_STANDARD_EDIT_NAME,
+                              0, NULL, NULL);
+    if (info != NULL) {
+        editname = g_file_info_get_attribute_string (info, G_FILE_ATTRIBUTE_STANDARD_EDIT_NAME);
+
+        if (editname != NULL && index != NULL) {
+            dest = get_indexed_duplicate_file (editname, dest_dir, dest_fs_type, index);
+        } else if (editname != NULL) {
+            new_name = get_duplicate_name (editname, count, max_length);
+            make_file_name_valid_for_dest_fs (new_name, dest_fs_type);
+            dest = g_file_get_child_for_display_name (dest_dir, new_name, NULL);
+            g_free (new_name);
+        }
+
+        g_object_unref (info);
+    }
+
+    if (dest == NULL) {
+        basename = g_file_get_basename (src);
+
+        if (g_utf8_validate (basename, -1, NULL) && index != NULL) {
+            dest = get_indexed_duplicate_file (basename, dest_dir, dest_fs_type, index);
+        } else if (g_utf8_validate (basename, -1, NULL)) {
+            new_name = get_duplicate_name (basename, count, max_length);
+            make_file_name_valid_for_dest_fs (new_name, dest_fs_type);
+            dest = g_file_get_child_for_display_name (dest_dir, new_name, NULL);
+            g_free (new_name);
+        }
+
+        if (dest == NULL) {
+            end = strrchr (basename, '.');
+            if (end != NULL) {
+                count += atoi (end + 1);
+            }
+            new_name = g_strdup_printf ("%s.%d", basename, count);
+            make_file_name_valid_for_dest_fs (new_name, dest_fs_type);
+            dest = g_file_get_child (dest_dir, new_name);
+            g_free (new_name);
+        }
+
+        g_free (basename);
+    }
+
+    return dest;
+}
+
+static GFile *
+get_target_file_for_link (GFile *src,
+                          GFile *dest_dir,
+                          const char *dest_fs_type,
+                          int count)
+{
+    const char *editname;
+    char *basename, *new_name;
+    GFileInfo *info;
+    GFile *dest;
+    int max_length;
+
+    max_length = get_max_name_length (dest_dir);
+
+    dest = NULL;
+    info = g_file_query_info (src,
+                              G_FILE_ATTRIBUTE_STANDARD_EDIT_NAME,
+                              0, NULL, NULL);
+    if (info != NULL) {
+        editname = g_file_info_get_attribute_string (info, G_FILE_ATTRIBUTE_STANDARD_EDIT_NAME);
+
+        if (editname != NULL) {
+            new_name = get_link_name (editname, count, max_length);
+            make_file_name_valid_for_dest_fs (new_name, dest_fs_type);
+            dest = g_file_get_child_for_display_name (dest_dir, new_name, NULL);
+            g_free (new_name);
+        }
+
+        g_object_unref (info);
+    }
+
+    if (dest == NULL) {
+        basename = g_file_get_basename (src);
+        make_file_name_valid_for_dest_fs (basename, dest_fs_type);
 
         if (g_utf8_validate (basename, -1, NULL)) {
             new_name = get_link_name (basename, count, max_length);
@@ -3241,18 +4932,20 @@ typedef enum {
 } CreateDestDirResult;
 
 static CreateDestDirResult
-create_dest_dir (CommonJob *job,
+create_dest_dir (CopyMoveJob *copy_job,
                  GFile *src,
                  GFile **dest,
                  gboolean same_fs,
                  char **dest_fs_type)
 {
+    CommonJob *job;
     GError *error;
     GFile *new_dest, *dest_dir;
     char *primary, *secondary, *details;
     int response;
     gboolean handled_invalid_filename;
 
+    job = (CommonJob *)copy_job;
     handled_invalid_filename = *dest_fs_type != NULL;
 
 retry:
@@ -3273,7 +4966,7 @@ retry:
             dest_dir = g_file_get_parent (*dest);
 
             if (dest_dir != NULL) {
-                *dest_fs_type = query_fs_type (dest_dir, job->cancellable);
+                *dest_fs_type = get_dest_fs_type (copy_job, dest_dir);
 
                 new_dest = get_target_file (src, dest_dir, *dest_fs_type, same_fs);
                 g_object_unref (dest_dir);
@@ -3331,532 +5024,3011 @@ retry:
     return CREATE_DEST_DIR_SUCCESS;
 }
 
-/* a return value of FALSE means retry, i.e.
- * the destination has changed and the source
- * is expected to re-try the preceeding
- * g_file_move() or g_file_copy() call with
- * the new destination.
- */
-static gboolean
-copy_move_directory (CopyMoveJob *copy_job,
-                     GFile *src,
-                     GFile **dest,
-                     gboolean same_fs,
-                     gboolean create_dest,
-                     char **parent_dest_fs_type,
-                     SourceInfo *source_info,
-                     TransferInfo *transfer_info,
-                     GHashTable *debuting_files,
-                     gboolean *skipped_file,
-                     gboolean readonly_source_fs)
+typedef enum {
+    COPY_METHOD_USERSPACE,
+    COPY_METHOD_REFLINK,
+    COPY_METHOD_COPY_FILE_RANGE,
+    COPY_METHOD_SPARSE,
+    COPY_METHOD_HARDLINK,
+    COPY_METHOD_DELTA,
+    COPY_METHOD_STREAMED
+} CopyMethod;
+
+#define COPY_FILE_RANGE_CHUNK (64 * 1024 * 1024)
+#define STREAM_COPY_MIN_SIZE (64 * 1024 * 1024)
+#define SPARSE_COPY_BUFFER_SIZE (1024 * 1024)
+
+/* The temporary files of copies replacing @dest_path are named after it, so that what
+ * an interrupted one left behind can be found, see remove_copy_target_leftovers () */
+static char *
+get_copy_target_tmp_prefix (const char *dest_path)
 {
-    GFileInfo *info;
-    GError *error;
-    GFile *src_file;
-    GFileEnumerator *enumerator;
-    char *primary, *secondary, *details;
-    char *dest_fs_type;
-    int response;
-    gboolean skip_error;
-    gboolean local_skipped_file;
-    CommonJob *job;
-    GFileCopyFlags flags;
+    char *basename, *prefix;
 
-    job = (CommonJob *)copy_job;
+    basename = g_path_get_basename (dest_path);
+    prefix = g_strdup_printf (".marlin-copy-%08x-", g_str_hash (basename));
+    g_free (basename);
 
-    if (create_dest) {
-        switch (create_dest_dir (job, src, dest, same_fs, parent_dest_fs_type)) {
-        case CREATE_DEST_DIR_RETRY:
-            /* next time copy_move_directory() is called,
-             * create_dest will be FALSE if a directory already
-             * exists under the new name (i.e. WOULD_RECURSE)
-             */
-            return FALSE;
+    return prefix;
+}
 
-        case CREATE_DEST_DIR_FAILED:
-            *skipped_file = TRUE;
-            return TRUE;
+static void
+remove_copy_target_leftovers (GFile *dest)
+{
+    GDir *dir;
+    const char *name;
+    char *dest_path, *dir_path, *prefix, *path;
 
-        case CREATE_DEST_DIR_SUCCESS:
-        default:
-            break;
-        }
+    dest_path = g_file_get_path (dest);
+    if (dest_path == NULL) {
+        return;
+    }
 
-        if (debuting_files) {
-            g_hash_table_replace (debuting_files, g_object_ref (*dest), GINT_TO_POINTER (TRUE));
+    dir_path = g_path_get_dirname (dest_path);
+    prefix = get_copy_target_tmp_prefix (dest_path);
+    dir = g_dir_open (dir_path, 0, NULL);
+    while (dir != NULL && (name = g_dir_read_name (dir)) != NULL) {
+        if (g_str_has_prefix (name, prefix) && strlen (name) == strlen (prefix) + 6) {
+            path = g_build_filename (dir_path, name, NULL);
+            g_unlink (path);
+            g_free (path);
         }
-
     }
 
-    local_skipped_file = FALSE;
-    dest_fs_type = NULL;
+    if (dir != NULL) {
+        g_dir_close (dir);
+    }
+    g_free (prefix);
+    g_free (dir_path);
+    g_free (dest_path);
+}
 
-    skip_error = should_skip_readdir_error (job, src);
-retry:
-    error = NULL;
-    enumerator = g_file_enumerate_children (src,
-                                            G_FILE_ATTRIBUTE_STANDARD_NAME,
-                                            G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                            job->cancellable,
-                                            &error);
-    if (enumerator) {
-        error = NULL;
+/* A copy replacing @dest_path is written to a temporary file next to it and renamed
+ * over it once complete, as g_file_replace () does. A failed or cancelled copy then
+ * leaves the original alone, and a symlink at @dest_path is replaced, not followed.
+ * Otherwise @dest_path is created, failing if it exists. Returns the fd to write to,
+ * @tmp_path is set when it is a temporary file.
+ */
+static int
+open_copy_target (const char *dest_path,
+                  gboolean replace,
+                  mode_t mode,
+                  char **tmp_path)
+{
+    char *dir, *prefix, *name;
+    int fd;
 
-        while (!job_aborted (job) &&
-               (info = g_file_enumerator_next_file (enumerator, job->cancellable, skip_error?NULL:&error)) != NULL) {
-            src_file = g_file_get_child (src,
-                                         g_file_info_get_name (info));
-            copy_move_file (copy_job, src_file, *dest, same_fs, FALSE, &dest_fs_type,
-                            source_info, transfer_info, NULL, NULL, FALSE, &local_skipped_file,
-                            readonly_source_fs);
-            g_object_unref (src_file);
-            g_object_unref (info);
-        }
-        g_file_enumerator_close (enumerator, job->cancellable, NULL);
-        g_object_unref (enumerator);
+    *tmp_path = NULL;
+    if (!replace) {
+        return open (dest_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC | O_NOFOLLOW, mode);
+    }
 
-        if (error && IS_IO_ERROR (error, CANCELLED)) {
-            g_error_free (error);
-        } else if (error) {
-            if (copy_job->is_move) {
-                primary = f (_("Error while moving."));
-            } else {
-                primary = f (_("Error while copying."));
-            }
-            details = NULL;
+    dir = g_path_get_dirname (dest_path);
+    prefix = get_copy_target_tmp_prefix (dest_path);
+    name = g_strconcat (prefix, "XXXXXX", NULL);
+    *tmp_path = g_build_filename (dir, name, NULL);
+    g_free (name);
+    g_free (prefix);
+    g_free (dir);
 
-            if (IS_IO_ERROR (error, PERMISSION_DENIED)) {
-                secondary = f (_("Files in the folder \"%B\" cannot be copied because you do "
-                                 "not have permissions to see them."), src);
-            } else {
-                secondary = f (_("There was an error getting information about the files in the folder \"%B\"."), src);
-                details = error->message;
-            }
+    fd = g_mkstemp_full (*tmp_path, O_WRONLY | O_CLOEXEC, mode);
+    if (fd < 0) {
+        g_clear_pointer (tmp_path, g_free);
+    }
 
-            response = run_warning (job,
-                                    primary,
-                                    secondary,
-                                    details,
-                                    FALSE,
-                                    GTK_STOCK_CANCEL, _("_Skip files"),
-                                    NULL);
+    return fd;
+}
 
-            g_error_free (error);
+/* Closes @fd from open_copy_target (). With @keep the copy is moved into place,
+ * otherwise, or if that fails, only what this copy created is removed.
+ */
+static gboolean
+close_copy_target (int fd,
+                   const char *dest_path,
+                   char *tmp_path,
+                   gboolean keep)
+{
+    gboolean ok;
 
-            if (response == 0 || response == GTK_RESPONSE_DELETE_EVENT) {
-                abort_job (job);
-            } else if (response == 1) {
-                /* Skip: Do Nothing */
-                local_skipped_file = TRUE;
-            } else {
-                g_assert_not_reached ();
-            }
+    ok = close (fd) == 0 && keep;
+    if (tmp_path != NULL) {
+        if (ok && rename (tmp_path, dest_path) != 0) {
+            ok = FALSE;
         }
+        if (!ok) {
+            unlink (tmp_path);
+        }
+        g_free (tmp_path);
+    } else if (!ok) {
+        unlink (dest_path);
+    }
 
-        /* Count the copied directory as a file */
-        transfer_info->num_files ++;
-        report_copy_progress (copy_job, source_info, transfer_info);
+    return ok;
+}
 
-        if (debuting_files) {
-            g_hash_table_replace (debuting_files, g_object_ref (*dest), GINT_TO_POINTER (create_dest));
+/* Copies only the data extents of @in_fd to the same offsets in @out_fd so that the
+ * holes in between stay holes, then sets the size to cover a trailing hole.
+ */
+static gboolean
+copy_sparse_extents (int in_fd, int out_fd, goffset size, GCancellable *cancellable)
+{
+#if defined (SEEK_DATA) && defined (SEEK_HOLE)
+    off_t data, hole, in_off, out_off;
+    ssize_t n, written, w;
+    char *buf = NULL;
+    gboolean use_range = TRUE, ok = TRUE;
+
+    for (data = 0; ok && data < size; data = hole) {
+        data = lseek (in_fd, data, SEEK_DATA);
+        if (data < 0) {
+            /* Only a hole is left */
+            ok = errno == ENXIO;
+            break;
         }
-    } else if (IS_IO_ERROR (error, CANCELLED)) {
-        g_error_free (error);
-    } else {
-        if (copy_job->is_move) {
-            primary = f (_("Error while moving."));
-        } else {
-            primary = f (_("Error while copying."));
+
+        hole = lseek (in_fd, data, SEEK_HOLE);
+        if (hole < 0) {
+            ok = FALSE;
+            break;
         }
-        details = NULL;
 
-        if (IS_IO_ERROR (error, PERMISSION_DENIED)) {
-            secondary = f (_("The folder \"%B\" cannot be copied because you do not have "
-                             "permissions to read it."), src);
-        } else {
-            secondary = f (_("There was an error reading the folder \"%B\"."), src);
-            details = error->message;
+        in_off = data;
+        while (ok && in_off < hole) {
+            if (g_cancellable_is_cancelled (cancellable)) {
+                ok = FALSE;
+                break;
+            }
+
+#ifdef HAVE_COPY_FILE_RANGE
+            if (use_range) {
+                out_off = in_off;
+                n = copy_file_range (in_fd, &in_off, out_fd, &out_off,
+                                     MIN (hole - in_off, COPY_FILE_RANGE_CHUNK), 0);
+                if (n > 0 || (n < 0 && errno == EINTR)) {
+                    continue;
+                } else if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                    use_range = FALSE;
+                } else {
+                    ok = FALSE;
+                    break;
+                }
+            }
+#endif
+
+            if (buf == NULL) {
+                buf = g_malloc (SPARSE_COPY_BUFFER_SIZE);
+            }
+
+            n = pread (in_fd, buf, MIN (hole - in_off, SPARSE_COPY_BUFFER_SIZE), in_off);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n <= 0) {
+                ok = FALSE;
+                break;
+            }
+
+            for (written = 0; written < n; written += w) {
+                w = pwrite (out_fd, buf + written, n - written, in_off + written);
+                if (w < 0 && errno == EINTR) {
+                    w = 0;
+                } else if (w <= 0) {
+                    ok = FALSE;
+                    break;
+                }
+            }
+            in_off += n;
         }
+    }
 
-        response = run_warning (job,
-                                primary,
-                                secondary,
-                                details,
-                                FALSE,
-                                GTK_STOCK_CANCEL, SKIP, RETRY,
-                                NULL);
+    g_free (buf);
 
-        g_error_free (error);
+    return ok && ftruncate (out_fd, size) == 0;
+#else
+    return FALSE;
+#endif
+}
 
-        if (response == 0 || response == GTK_RESPONSE_DELETE_EVENT) {
-            abort_job (job);
-        } else if (response == 1) {
-            /* Skip: Do Nothing  */
-            local_skipped_file = TRUE;
-        } else if (response == 2) {
-            goto retry;
+/* Copies a local regular file without moving its data through userspace, by sharing
+ * extents (FICLONE) or with copy_file_range (). Sparse files only have their data
+ * extents copied. Returns COPY_METHOD_USERSPACE, with @dest as it was, when neither
+ * is possible and g_file_copy () should be used.
+ */
+static CopyMethod
+copy_file_in_kernel (GFile *src,
+                     GFile *dest,
+                     GFileCopyFlags flags,
+                     GCancellable *cancellable,
+                     goffset *size)
+{
+    CopyMethod method = COPY_METHOD_USERSPACE;
+    char *src_path, *dest_path, *tmp_path;
+    struct stat st, dest_st;
+    int in_fd = -1, out_fd = -1;
+    mode_t mode;
+    goffset remaining;
+    ssize_t n;
+#ifdef HAVE_COPY_FILE_RANGE
+    off_t in_off, out_off;
+#endif
+
+    src_path = g_file_get_path (src);
+    dest_path = g_file_get_path (dest);
+    if (src_path == NULL || dest_path == NULL) {
+        goto out;
+    }
+
+    in_fd = open (src_path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (in_fd < 0 || fstat (in_fd, &st) != 0 || !S_ISREG (st.st_mode)) {
+        goto out;
+    }
+
+    mode = (flags & G_FILE_COPY_TARGET_DEFAULT_PERMS) ? 0666 : (st.st_mode & 07777);
+    /* Without OVERWRITE an existing dest is left for g_file_copy () to report */
+    out_fd = open_copy_target (dest_path, (flags & G_FILE_COPY_OVERWRITE) != 0, mode, &tmp_path);
+    if (out_fd < 0) {
+        goto out;
+    }
+
+#ifdef FICLONE
+    if (ioctl (out_fd, FICLONE, in_fd) == 0) {
+        method = COPY_METHOD_REFLINK;
+    }
+#endif
+
+    /* Fewer blocks than the size needs means holes. Copying them as data would write
+     * out every zero and allocate the full size at @dest */
+    if (method == COPY_METHOD_USERSPACE && (goffset) st.st_blocks * 512 < st.st_size) {
+        /* On failure whatever was written is overwritten by the full copy below */
+        if (copy_sparse_extents (in_fd, out_fd, st.st_size, cancellable)) {
+            method = COPY_METHOD_SPARSE;
+        }
+    }
+
+#ifdef HAVE_COPY_FILE_RANGE
+    /* Large files going to another device are left to copy_file_streaming (), which
+     * keeps them out of the page cache */
+    if (method == COPY_METHOD_USERSPACE &&
+        (st.st_size < STREAM_COPY_MIN_SIZE || (fstat (out_fd, &dest_st) == 0 && dest_st.st_dev == st.st_dev))) {
+        /* A failed sparse copy has moved the file offsets, start over from the beginning */
+        in_off = 0;
+        out_off = 0;
+        remaining = st.st_size;
+        while (remaining > 0 && !g_cancellable_is_cancelled (cancellable)) {
+            n = copy_file_range (in_fd, &in_off, out_fd, &out_off, MIN (remaining, COPY_FILE_RANGE_CHUNK), 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n <= 0) {
+                break;
+            }
+            remaining -= n;
+        }
+
+        if (remaining == 0) {
+            method = COPY_METHOD_COPY_FILE_RANGE;
+        }
+    }
+#endif
+
+    /* A dest that is a folder cannot be renamed over, g_file_copy () reports it */
+    if (!close_copy_target (out_fd, dest_path, tmp_path, method != COPY_METHOD_USERSPACE)) {
+        method = COPY_METHOD_USERSPACE;
+    }
+    out_fd = -1;
+
+    if (method != COPY_METHOD_USERSPACE) {
+        *size = st.st_size;
+        /* g_file_copy () would have carried these over too. Not a hard error */
+        g_file_copy_attributes (src, dest,
+                                flags & (G_FILE_COPY_NOFOLLOW_SYMLINKS | G_FILE_COPY_TARGET_DEFAULT_PERMS),
+                                cancellable, NULL);
+    }
+
+out:
+    if (in_fd >= 0) {
+        close (in_fd);
+    }
+    g_free (src_path);
+    g_free (dest_path);
+
+    return method;
+}
+
+static void
+count_copy_method (CopyMoveJob *copy_job, CopyMethod method)
+{
+    switch (method) {
+    case COPY_METHOD_REFLINK:
+        copy_job->n_reflinked++;
+        break;
+    case COPY_METHOD_COPY_FILE_RANGE:
+        copy_job->n_copied_in_kernel++;
+        break;
+    case COPY_METHOD_SPARSE:
+        copy_job->n_copied_sparse++;
+        break;
+    case COPY_METHOD_HARDLINK:
+        copy_job->n_hardlinked++;
+        break;
+    case COPY_METHOD_DELTA:
+        copy_job->n_delta++;
+        break;
+    case COPY_METHOD_STREAMED:
+        copy_job->n_streamed++;
+        break;
+    default:
+        copy_job->n_copied++;
+        break;
+    }
+}
+
+/* Copy and move jobs keep a journal of the files they finished, so that a job cut
+ * short by a crash or the end of the session can be resumed, skipping what was done,
+ * see marlin_file_operations_get_interrupted_copies (). Records are buffered and only
+ * written out, with an fdatasync, every couple of seconds. Large streamed files also
+ * record how far they got, once what was written up to there has been synced. A job
+ * that ends, even cancelled or failed, removes its journal. The journal is locked
+ * while its job runs.
+ *
+ * Every record is one line. The job itself comes first, "C flags dest" or "M flags
+ * dest" and "F file", so that it can be described and started again without reading
+ * the rest. The flags are the MarlinCopyFlags the job was started with. Then come "S file
+ * dest" when a file is started on a dest it creates, "R file dest" when it replaces
+ * dest, "U file" when it was not started because dest was in the way, "O offset file"
+ * for a checkpoint, "D file" when it is done and "P files bytes file" when a folder is
+ * done with everything in it. Files are the source URIs.
+ *
+ * The start of a file the job creates is synced before it is created, so that after a
+ * crash whatever the job left at dest is known to be its own. Within a folder the job
+ * created, the start of that folder covers everything in it. A replace is written to a
+ * temporary file, dest is still the original until the copy is complete.
+ *
+ * Once the journal has doubled in size, it is rewritten with only what a resumed job
+ * needs, which leaves out anything inside finished folders.
+ */
+#define COPY_JOURNAL_BUFFER_SIZE (64 * 1024)
+#define COPY_JOURNAL_SYNC_INTERVAL (2 * G_USEC_PER_SEC)
+#define COPY_JOURNAL_CHECKPOINT_INTERVAL (5 * G_USEC_PER_SEC)
+#define COPY_JOURNAL_COMPACT_SIZE (1024 * 1024)
+
+struct CopyJournal {
+    char *path;
+    int fd;
+    char *header;
+    GString *pending;
+    goffset size;
+    goffset compacted_size;
+    guint n_syncs;
+    guint n_open;               /* files started by this job and not done yet */
+    guint n_new_folders;        /* folders created by the job being copied into */
+    gint64 last_sync;
+    gint64 last_checkpoint;
+    gboolean resumed;
+    GHashTable *done;           /* uri to CopyJournalFolder, NULL for files */
+    GHashTable *started;        /* uri to CopyJournalEntry */
+};
+
+typedef struct {
+    char *dest_uri;
+    goffset offset;
+    guint n_syncs;              /* at the time it was recorded by this job */
+    gboolean open;              /* counted in n_open */
+    gboolean replace;           /* dest existed before */
+} CopyJournalEntry;
+
+typedef struct {
+    int n_files;
+    goffset size;
+} CopyJournalFolder;
+
+static void
+copy_journal_entry_free (CopyJournalEntry *entry)
+{
+    g_free (entry->dest_uri);
+    g_free (entry);
+}
+
+static char *
+copy_journal_get_dir (void)
+{
+    return g_build_filename (g_get_user_cache_dir (), "io.elementary.files", "journals", NULL);
+}
+
+static char *
+copy_journal_make_header (CopyMoveJob *job)
+{
+    GString *header;
+    MarlinCopyFlags flags;
+    char *uri;
+    GList *l;
+
+    header = g_string_new (NULL);
+
+    flags = MARLIN_COPY_FLAGS_NONE;
+    if (job->common.update_all) {
+        flags |= MARLIN_COPY_FLAGS_UPDATE;
+    }
+    if (job->common.update_compare_contents) {
+        flags |= MARLIN_COPY_FLAGS_COMPARE_CONTENTS;
+    }
+    if (job->verify) {
+        flags |= MARLIN_COPY_FLAGS_VERIFY;
+    }
+
+    uri = g_file_get_uri (job->destination);
+    g_string_append_printf (header, "%c %u %s\n", job->is_move ? 'M' : 'C', flags, uri);
+    g_free (uri);
+    for (l = job->files; l != NULL; l = l->next) {
+        uri = g_file_get_uri (l->data);
+        g_string_append_printf (header, "F %s\n", uri);
+        g_free (uri);
+    }
+
+    return g_string_free (header, FALSE);
+}
+
+/* Only reads the records about the job itself. Any of the results may be NULL.
+ * Returns FALSE if @path is not a usable journal */
+static gboolean
+copy_journal_load_header (const char *path,
+                          gboolean *is_move,
+                          MarlinCopyFlags *copy_flags,
+                          GFile **destination,
+                          GList **files)
+{
+    FILE *stream;
+    char *line = NULL, *uri;
+    size_t line_size = 0;
+    ssize_t len;
+    GFile *dest = NULL;
+    GList *srcs = NULL;
+    gboolean move = FALSE;
+    MarlinCopyFlags flags = MARLIN_COPY_FLAGS_NONE;
+
+    stream = fopen (path, "re");
+    if (stream == NULL) {
+        return FALSE;
+    }
+
+    /* A record cut short has no newline */
+    while ((len = getline (&line, &line_size, stream)) > 2 &&
+           line[len - 1] == '\n' && line[1] == ' ') {
+        line[len - 1] = '\0';
+        if ((line[0] == 'C' || line[0] == 'M') && dest == NULL) {
+            move = line[0] == 'M';
+            uri = line + 2;
+            /* Journals from before the flags were recorded start with the uri */
+            if (g_ascii_isdigit (*uri)) {
+                flags = (MarlinCopyFlags) g_ascii_strtoull (uri, &uri, 10);
+                uri++;
+            }
+            dest = g_file_new_for_uri (uri);
+        } else if (line[0] == 'F') {
+            srcs = g_list_prepend (srcs, g_file_new_for_uri (line + 2));
         } else {
-            g_assert_not_reached ();
+            break;
         }
     }
 
-    if (create_dest) {
-        flags = (readonly_source_fs) ? G_FILE_COPY_NOFOLLOW_SYMLINKS | G_FILE_COPY_TARGET_DEFAULT_PERMS
-            : G_FILE_COPY_NOFOLLOW_SYMLINKS;
-        /* Ignore errors here. Failure to copy metadata is not a hard error */
-        g_file_copy_attributes (src, *dest,
-                                flags,
-                                job->cancellable, NULL);
+    free (line);
+    fclose (stream);
+
+    if (dest == NULL || srcs == NULL) {
+        g_clear_object (&dest);
+        g_list_free_full (srcs, g_object_unref);
+        return FALSE;
     }
 
-    if (!job_aborted (job) && copy_job->is_move &&
-        /* Don't delete source if there was a skipped file */
-        !local_skipped_file) {
-        if (!g_file_delete (src, job->cancellable, &error)) {
-            if (job->skip_all_error) {
-                goto skip;
+    if (is_move != NULL) {
+        *is_move = move;
+    }
+    if (copy_flags != NULL) {
+        *copy_flags = flags;
+    }
+    if (destination != NULL) {
+        *destination = g_object_ref (dest);
+    }
+    if (files != NULL) {
+        *files = g_list_reverse (srcs);
+        srcs = NULL;
+    }
+
+    g_object_unref (dest);
+    g_list_free_full (srcs, g_object_unref);
+
+    return TRUE;
+}
+
+/* Reads what was done and what was being done into @done and @started, either may be NULL */
+static void
+copy_journal_load (const char *path,
+                   GHashTable *done,
+                   GHashTable *started)
+{
+    char *contents, **lines, *line, *sep;
+    CopyJournalEntry *entry;
+    CopyJournalFolder *folder;
+    guint i, n_lines;
+
+    if (!g_file_get_contents (path, &contents, NULL, NULL)) {
+        return;
+    }
+
+    lines = g_strsplit (contents, "\n", -1);
+    n_lines = g_strv_length (lines);
+    g_free (contents);
+
+    /* The last piece is either empty or a record cut short */
+    for (i = 0; i + 1 < n_lines; i++) {
+        line = lines[i];
+        if (line[0] == '\0' || line[1] != ' ') {
+            continue;
+        }
+
+        switch (line[0]) {
+        case 'S':
+        case 'R':
+            if (started != NULL && (sep = strchr (line + 2, ' ')) != NULL) {
+                *sep = '\0';
+                entry = g_new0 (CopyJournalEntry, 1);
+                entry->dest_uri = g_strdup (sep + 1);
+                entry->replace = line[0] == 'R';
+                g_hash_table_replace (started, g_strdup (line + 2), entry);
             }
-            primary = f (_("Error while moving \"%B\"."), src);
-            secondary = f (_("Could not remove the source folder."));
-            details = error->message;
+            break;
+        case 'O':
+            if (started != NULL && (sep = strchr (line + 2, ' ')) != NULL &&
+                (entry = g_hash_table_lookup (started, sep + 1)) != NULL) {
+                entry->offset = g_ascii_strtoll (line + 2, NULL, 10);
+            }
+            break;
+        case 'U':
+            if (started != NULL) {
+                g_hash_table_remove (started, line + 2);
+            }
+            break;
+        case 'D':
+            if (done != NULL) {
+                g_hash_table_replace (done, g_strdup (line + 2), NULL);
+            }
+            if (started != NULL) {
+                g_hash_table_remove (started, line + 2);
+            }
+            break;
+        case 'P':
+            folder = g_new0 (CopyJournalFolder, 1);
+            folder->n_files = (int) g_ascii_strtoll (line + 2, &sep, 10);
+            folder->size = g_ascii_strtoll (sep, &sep, 10);
+            if (*sep == ' ') {
+                if (started != NULL) {
+                    g_hash_table_remove (started, sep + 1);
+                }
+                if (done != NULL) {
+                    g_hash_table_replace (done, g_strdup (sep + 1), folder);
+                    folder = NULL;
+                }
+            }
+            g_free (folder);
+            break;
+        default:
+            break;
+        }
+    }
 
-            response = run_warning (job,
-                                    primary,
-                                    secondary,
-                                    details,
-                                    (source_info->num_files - transfer_info->num_files) > 1,
-                                    GTK_STOCK_CANCEL, SKIP_ALL, SKIP,
-                                    NULL);
+    g_strfreev (lines);
+}
 
-            if (response == 0 || response == GTK_RESPONSE_DELETE_EVENT) {
-                abort_job (job);
-            } else if (response == 1) { /* skip all */
-                job->skip_all_error = TRUE;
-                local_skipped_file = TRUE;
-            } else if (response == 2) { /* skip */
-                local_skipped_file = TRUE;
-            } else {
-                g_assert_not_reached ();
+static gboolean
+copy_journal_write (CopyJournal *journal, int fd, const char *data, gsize left)
+{
+    gssize written;
+
+    while (left > 0) {
+        written = write (fd, data, left);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            g_debug ("%s: could not write %s: %s", G_STRFUNC, journal->path, g_strerror (errno));
+            return FALSE;
+        }
+        data += written;
+        left -= written;
+    }
+
+    return TRUE;
+}
+
+/* Whether @uri is somewhere inside a folder recorded as done */
+static gboolean
+copy_journal_in_done_folder (CopyJournal *journal, const char *uri)
+{
+    char *parent, *slash;
+    gboolean found = FALSE;
+
+    parent = g_strdup (uri);
+    while (!found && (slash = strrchr (parent, '/')) != NULL) {
+        *slash = '\0';
+        found = g_hash_table_lookup (journal->done, parent) != NULL;
+    }
+    g_free (parent);
+
+    return found;
+}
+
+/* Rewrites the journal with only what a resumed job would need. The new file is
+ * locked before it takes the place of the old one, so that the job is not taken
+ * for an interrupted one in between */
+static void
+copy_journal_compact (CopyJournal *journal)
+{
+    GString *contents;
+    GHashTableIter iter;
+    const char *uri;
+    CopyJournalFolder *folder;
+    CopyJournalEntry *entry;
+    char *dir, *tmp_path;
+    int fd;
+
+    contents = g_string_new (journal->header);
+
+    g_hash_table_iter_init (&iter, journal->done);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &uri, (gpointer *) &folder)) {
+        if (copy_journal_in_done_folder (journal, uri)) {
+            /* Never looked up again, the whole folder is skipped */
+            g_hash_table_iter_remove (&iter);
+        } else if (folder != NULL) {
+            g_string_append_printf (contents, "P %d %" G_GOFFSET_FORMAT " %s\n",
+                                    folder->n_files, folder->size, uri);
+        } else {
+            g_string_append_printf (contents, "D %s\n", uri);
+        }
+    }
+
+    g_hash_table_iter_init (&iter, journal->started);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &uri, (gpointer *) &entry)) {
+        g_string_append_printf (contents, "%c %s %s\n", entry->replace ? 'R' : 'S', uri, entry->dest_uri);
+        if (entry->offset > 0) {
+            g_string_append_printf (contents, "O %" G_GOFFSET_FORMAT " %s\n", entry->offset, uri);
+        }
+    }
+
+    /* Hidden, not to be listed as a journal of its own if left behind */
+    dir = g_path_get_dirname (journal->path);
+    tmp_path = g_build_filename (dir, ".compact-XXXXXX", NULL);
+    fd = g_mkstemp_full (tmp_path, O_WRONLY | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        g_debug ("%s: could not compact %s: %s", G_STRFUNC, journal->path, g_strerror (errno));
+        goto out;
+    }
+
+    flock (fd, LOCK_EX | LOCK_NB);
+    if (!copy_journal_write (journal, fd, contents->str, contents->len) ||
+        fdatasync (fd) != 0 ||
+        g_rename (tmp_path, journal->path) != 0) {
+        g_debug ("%s: could not compact %s", G_STRFUNC, journal->path);
+        close (fd);
+        g_unlink (tmp_path);
+        goto out;
+    }
+
+    g_debug ("%s: %s from %" G_GOFFSET_FORMAT " to %" G_GSIZE_FORMAT " bytes",
+             G_STRFUNC, journal->path, journal->size, contents->len);
+
+    close (journal->fd);
+    journal->fd = fd;
+    journal->size = contents->len;
+    journal->compacted_size = contents->len;
+
+out:
+    g_string_free (contents, TRUE);
+    g_free (tmp_path);
+    g_free (dir);
+}
+
+static void
+copy_journal_sync (CopyJournal *journal)
+{
+    if (copy_journal_write (journal, journal->fd, journal->pending->str, journal->pending->len)) {
+        journal->size += journal->pending->len;
+    }
+
+    fdatasync (journal->fd);
+    g_string_truncate (journal->pending, 0);
+    journal->n_syncs++;
+    journal->last_sync = g_get_monotonic_time ();
+
+    if (journal->size >= COPY_JOURNAL_COMPACT_SIZE &&
+        journal->size >= 2 * journal->compacted_size) {
+        copy_journal_compact (journal);
+    }
+}
+
+static void
+copy_journal_maybe_sync (CopyJournal *journal)
+{
+    if (journal->pending->len >= COPY_JOURNAL_BUFFER_SIZE ||
+        g_get_monotonic_time () - journal->last_sync >= COPY_JOURNAL_SYNC_INTERVAL) {
+        copy_journal_sync (journal);
+    }
+}
+
+/* Called from the job thread before anything is copied */
+static CopyJournal *
+copy_journal_open (CopyMoveJob *job)
+{
+    CopyJournal *journal;
+    struct stat st;
+    char *dir;
+
+    journal = g_new0 (CopyJournal, 1);
+    journal->header = copy_journal_make_header (job);
+    journal->pending = g_string_new (NULL);
+    journal->done = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    journal->started = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                              (GDestroyNotify) copy_journal_entry_free);
+
+    if (job->resume_journal != NULL) {
+        journal->path = g_strdup (job->resume_journal);
+        journal->resumed = TRUE;
+        copy_journal_load (journal->path, journal->done, journal->started);
+        journal->fd = open (journal->path, O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (journal->fd >= 0 && fstat (journal->fd, &st) == 0) {
+            journal->size = st.st_size;
+        }
+    } else {
+        dir = copy_journal_get_dir ();
+        g_mkdir_with_parents (dir, 0700);
+        journal->path = g_build_filename (dir, "job-XXXXXX", NULL);
+        journal->fd = g_mkstemp_full (journal->path, O_WRONLY | O_APPEND | O_CLOEXEC, 0600);
+        g_free (dir);
+
+        g_string_append (journal->pending, journal->header);
+    }
+
+    if (journal->fd < 0) {
+        g_debug ("%s: no journal for this job: %s", G_STRFUNC, g_strerror (errno));
+        if (job->resume_journal == NULL) {
+            g_unlink (journal->path);
+        }
+        g_string_free (journal->pending, TRUE);
+        g_hash_table_unref (journal->done);
+        g_hash_table_unref (journal->started);
+        g_free (journal->header);
+        g_free (journal->path);
+        g_free (journal);
+        return NULL;
+    }
+
+    flock (journal->fd, LOCK_EX | LOCK_NB);
+    copy_journal_sync (journal);
+
+    return journal;
+}
+
+/* The job is over one way or another, nothing is left to resume */
+static void
+copy_journal_finish (CopyMoveJob *job)
+{
+    CopyJournal *journal = job->journal;
+
+    if (journal == NULL) {
+        if (job->resume_journal != NULL) {
+            g_unlink (job->resume_journal);
+        }
+        return;
+    }
+
+    g_unlink (journal->path);
+    close (journal->fd);
+
+    g_string_free (journal->pending, TRUE);
+    g_hash_table_unref (journal->done);
+    g_hash_table_unref (journal->started);
+    g_free (journal->header);
+    g_free (journal->path);
+    g_free (journal);
+
+    job->journal = NULL;
+}
+
+/* Files started by this job that are not done yet, see copy_journal_folder_done () */
+static guint
+copy_journal_get_n_open (CopyJournal *journal)
+{
+    return journal != NULL ? journal->n_open : 0;
+}
+
+static void
+copy_journal_settle (CopyJournal *journal, const char *uri)
+{
+    CopyJournalEntry *entry;
+
+    entry = g_hash_table_lookup (journal->started, uri);
+    if (entry != NULL) {
+        if (entry->open) {
+            journal->n_open--;
+        }
+        g_hash_table_remove (journal->started, uri);
+    }
+}
+
+/* Whether a file created now needs its start synced first, see copy_journal_file_started () */
+static gboolean
+copy_journal_needs_write_ahead (CopyJournal *journal)
+{
+    return journal != NULL && journal->n_new_folders == 0;
+}
+
+/* Called by copy_move_directory () for @src, returns whether @src was created by the
+ * job, in which case copy_journal_leave_folder () has to be called at the end */
+static gboolean
+copy_journal_enter_folder (CopyJournal *journal, GFile *src)
+{
+    CopyJournalEntry *entry;
+    char *uri;
+
+    if (journal == NULL) {
+        return FALSE;
+    }
+
+    uri = g_file_get_uri (src);
+    entry = g_hash_table_lookup (journal->started, uri);
+    g_free (uri);
+
+    if (entry == NULL || entry->replace) {
+        return FALSE;
+    }
+
+    journal->n_new_folders++;
+    return TRUE;
+}
+
+static void
+copy_journal_leave_folder (CopyJournal *journal)
+{
+    journal->n_new_folders--;
+}
+
+/* Nothing is checked first, dest may be in the way, see copy_journal_file_abandoned ().
+ * Unless @replace is set, dest is about to be created and, with @write_ahead and outside
+ * of a folder the job created, the record is synced right away. Otherwise the caller
+ * syncs before creating dest */
+static void
+copy_journal_file_started (CopyJournal *journal,
+                           GFile *src,
+                           GFile *dest,
+                           gboolean replace,
+                           gboolean write_ahead)
+{
+    CopyJournalEntry *entry;
+    char *src_uri;
+
+    if (journal == NULL) {
+        return;
+    }
+
+    src_uri = g_file_get_uri (src);
+    copy_journal_settle (journal, src_uri);
+
+    entry = g_new0 (CopyJournalEntry, 1);
+    entry->dest_uri = g_file_get_uri (dest);
+    entry->n_syncs = journal->n_syncs;
+    entry->open = TRUE;
+    entry->replace = replace;
+    journal->n_open++;
+
+    g_string_append_printf (journal->pending, "%c %s %s\n", replace ? 'R' : 'S', src_uri, entry->dest_uri);
+    g_hash_table_replace (journal->started, src_uri, entry);
+
+    if (write_ahead && !replace && journal->n_new_folders == 0) {
+        copy_journal_sync (journal);
+    } else {
+        copy_journal_maybe_sync (journal);
+    }
+}
+
+/* @dest was in the way of @src and was left alone, it must not be taken for a file
+ * the job was writing. Unless the start is still pending, it is taken back right away */
+static void
+copy_journal_file_abandoned (CopyJournal *journal, GFile *src)
+{
+    CopyJournalEntry *entry;
+    gboolean synced;
+    char *uri;
+
+    if (journal == NULL) {
+        return;
+    }
+
+    uri = g_file_get_uri (src);
+    entry = g_hash_table_lookup (journal->started, uri);
+    if (entry != NULL) {
+        synced = entry->n_syncs != journal->n_syncs;
+        copy_journal_settle (journal, uri);
+        g_string_append_printf (journal->pending, "U %s\n", uri);
+        if (synced) {
+            copy_journal_sync (journal);
+        }
+    }
+    g_free (uri);
+}
+
+static void
+copy_journal_file_done (CopyJournal *journal, GFile *src)
+{
+    char *uri;
+
+    if (journal == NULL) {
+        return;
+    }
+
+    uri = g_file_get_uri (src);
+    g_string_append_printf (journal->pending, "D %s\n", uri);
+    copy_journal_settle (journal, uri);
+    g_hash_table_replace (journal->done, uri, NULL);
+
+    copy_journal_maybe_sync (journal);
+}
+
+/* @src was copied with all of its @n_files files, worth @size. A resumed job skips it
+ * as a whole, and what it holds is left out of the journal when compacted */
+static void
+copy_journal_folder_done (CopyJournal *journal, GFile *src, int n_files, goffset size)
+{
+    CopyJournalFolder *folder;
+    char *uri;
+
+    if (journal == NULL) {
+        return;
+    }
+
+    uri = g_file_get_uri (src);
+    g_string_append_printf (journal->pending, "P %d %" G_GOFFSET_FORMAT " %s\n", n_files, size, uri);
+    copy_journal_settle (journal, uri);
+
+    folder = g_new0 (CopyJournalFolder, 1);
+    folder->n_files = n_files;
+    folder->size = size;
+    g_hash_table_replace (journal->done, uri, folder);
+
+    copy_journal_maybe_sync (journal);
+}
+
+/* @written bytes of @fd are synced before they are recorded as copied */
+static void
+copy_journal_checkpoint (CopyJournal *journal, GFile *src, int fd, goffset written)
+{
+    CopyJournalEntry *entry;
+    char *uri;
+    gint64 now;
+
+    if (journal == NULL) {
+        return;
+    }
+
+    now = g_get_monotonic_time ();
+    if (now - journal->last_checkpoint < COPY_JOURNAL_CHECKPOINT_INTERVAL) {
+        return;
+    }
+    journal->last_checkpoint = now;
+
+    if (fdatasync (fd) != 0) {
+        return;
+    }
+
+    uri = g_file_get_uri (src);
+    g_string_append_printf (journal->pending, "O %" G_GOFFSET_FORMAT " %s\n", written, uri);
+    entry = g_hash_table_lookup (journal->started, uri);
+    if (entry != NULL) {
+        entry->offset = written;
+    }
+    g_free (uri);
+
+    copy_journal_sync (journal);
+}
+
+/* Whether the interrupted job was done with @src. For a folder, @n_files and @size
+ * are what it held, for a file @size is -1 */
+static gboolean
+copy_journal_is_done (CopyJournal *journal, GFile *src, int *n_files, goffset *size)
+{
+    CopyJournalFolder *folder;
+    char *uri;
+    gboolean done;
+
+    if (journal == NULL || !journal->resumed) {
+        return FALSE;
+    }
+
+    uri = g_file_get_uri (src);
+    done = g_hash_table_lookup_extended (journal->done, uri, NULL, (gpointer *) &folder);
+    if (done) {
+        *n_files = folder != NULL ? folder->n_files : 1;
+        *size = folder != NULL ? folder->size : -1;
+    }
+    g_free (uri);
+
+    return done;
+}
+
+/* Whether the interrupted job had started writing @src to @dest, and how far it got.
+ * @replace is set if dest was not created by the job. Anything in a folder the job
+ * created is its own too, whether its start was recorded or not */
+static gboolean
+copy_journal_was_started (CopyJournal *journal,
+                          GFile *src,
+                          GFile *dest,
+                          goffset *offset,
+                          gboolean *replace)
+{
+    CopyJournalEntry *entry;
+    char *src_uri, *dest_uri, *slash;
+    gboolean started = FALSE;
+    gsize len;
+
+    if (journal == NULL || !journal->resumed) {
+        return FALSE;
+    }
+
+    src_uri = g_file_get_uri (src);
+    dest_uri = g_file_get_uri (dest);
+    entry = g_hash_table_lookup (journal->started, src_uri);
+    if (entry != NULL) {
+        started = strcmp (entry->dest_uri, dest_uri) == 0;
+        *offset = started ? entry->offset : 0;
+        *replace = entry->replace;
+    } else {
+        while (!started && (slash = strrchr (src_uri, '/')) != NULL) {
+            *slash = '\0';
+            entry = g_hash_table_lookup (journal->started, src_uri);
+            if (entry != NULL && !entry->replace) {
+                len = strlen (entry->dest_uri);
+                started = strncmp (entry->dest_uri, dest_uri, len) == 0 && dest_uri[len] == '/';
+                *offset = 0;
+                *replace = FALSE;
+            }
+        }
+    }
+    g_free (dest_uri);
+    g_free (src_uri);
+
+    return started;
+}
+
+static gboolean
+copy_journal_knows (CopyJournal *journal, GFile *src)
+{
+    char *uri;
+    gboolean known;
+
+    if (journal == NULL || !journal->resumed) {
+        return FALSE;
+    }
+
+    uri = g_file_get_uri (src);
+    known = g_hash_table_contains (journal->done, uri) || g_hash_table_contains (journal->started, uri);
+    g_free (uri);
+
+    return known;
+}
+
+/* Copies made with MARLIN_COPY_FLAGS_VERIFY are read back and compared with their
+ * source by hash. The hash is XXH64, fast enough to keep up with the disks. Reading
+ * and hashing are pipelined: a thread hashes one buffer while the next is read, and
+ * streamed copies hash their source buffers on the way, so that only the copy has to
+ * be read back. That read skips the page cache to check what actually reached the disk.
+ */
+#define XXH_PRIME64_1 G_GUINT64_CONSTANT (0x9E3779B185EBCA87)
+#define XXH_PRIME64_2 G_GUINT64_CONSTANT (0xC2B2AE3D27D4EB4F)
+#define XXH_PRIME64_3 G_GUINT64_CONSTANT (0x165667B19E3779F9)
+#define XXH_PRIME64_4 G_GUINT64_CONSTANT (0x85EBCA77C2B2AE63)
+#define XXH_PRIME64_5 G_GUINT64_CONSTANT (0x27D4EB2F165667C5)
+
+#define VERIFY_BUFFER_SIZE (1024 * 1024)
+
+typedef struct {
+    guint64 total_len;
+    guint64 v[4];
+    guchar mem[32];
+    gsize mem_size;
+} Xxh64State;
+
+static inline guint64
+xxh64_rotl (guint64 x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline guint64
+xxh64_read64 (const guchar *p)
+{
+    guint64 v;
+
+    memcpy (&v, p, sizeof (v));
+    return GUINT64_FROM_LE (v);
+}
+
+static inline guint32
+xxh64_read32 (const guchar *p)
+{
+    guint32 v;
+
+    memcpy (&v, p, sizeof (v));
+    return GUINT32_FROM_LE (v);
+}
+
+static inline guint64
+xxh64_round (guint64 acc, guint64 input)
+{
+    acc += input * XXH_PRIME64_2;
+    acc = xxh64_rotl (acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline guint64
+xxh64_merge_round (guint64 acc, guint64 val)
+{
+    acc ^= xxh64_round (0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static void
+xxh64_init (Xxh64State *state)
+{
+    memset (state, 0, sizeof (Xxh64State));
+    state->v[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->v[1] = XXH_PRIME64_2;
+    state->v[2] = 0;
+    state->v[3] = -XXH_PRIME64_1;
+}
+
+static inline void
+xxh64_stripe (Xxh64State *state, const guchar *p)
+{
+    state->v[0] = xxh64_round (state->v[0], xxh64_read64 (p));
+    state->v[1] = xxh64_round (state->v[1], xxh64_read64 (p + 8));
+    state->v[2] = xxh64_round (state->v[2], xxh64_read64 (p + 16));
+    state->v[3] = xxh64_round (state->v[3], xxh64_read64 (p + 24));
+}
+
+static void
+xxh64_update (Xxh64State *state, const void *data, gsize len)
+{
+    const guchar *p = data;
+    const guchar *end = p + len;
+    gsize fill;
+
+    state->total_len += len;
+
+    if (state->mem_size + len < sizeof (state->mem)) {
+        memcpy (state->mem + state->mem_size, p, len);
+        state->mem_size += len;
+        return;
+    }
+
+    if (state->mem_size > 0) {
+        fill = sizeof (state->mem) - state->mem_size;
+        memcpy (state->mem + state->mem_size, p, fill);
+        xxh64_stripe (state, state->mem);
+        p += fill;
+        state->mem_size = 0;
+    }
+
+    while (p + 32 <= end) {
+        xxh64_stripe (state, p);
+        p += 32;
+    }
+
+    if (p < end) {
+        memcpy (state->mem, p, end - p);
+        state->mem_size = end - p;
+    }
+}
+
+static guint64
+xxh64_digest (const Xxh64State *state)
+{
+    const guchar *p = state->mem;
+    const guchar *end = p + state->mem_size;
+    guint64 h;
+
+    if (state->total_len >= 32) {
+        h = xxh64_rotl (state->v[0], 1) + xxh64_rotl (state->v[1], 7) +
+            xxh64_rotl (state->v[2], 12) + xxh64_rotl (state->v[3], 18);
+        h = xxh64_merge_round (h, state->v[0]);
+        h = xxh64_merge_round (h, state->v[1]);
+        h = xxh64_merge_round (h, state->v[2]);
+        h = xxh64_merge_round (h, state->v[3]);
+    } else {
+        h = state->v[2] + XXH_PRIME64_5;
+    }
+
+    h += state->total_len;
+
+    while (p + 8 <= end) {
+        h ^= xxh64_round (0, xxh64_read64 (p));
+        h = xxh64_rotl (h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (guint64) xxh64_read32 (p) * XXH_PRIME64_1;
+        h = xxh64_rotl (h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = xxh64_rotl (h, 11) * XXH_PRIME64_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+guint64
+marlin_file_operations_hash_data (const void *data, gsize len)
+{
+    Xxh64State state;
+
+    xxh64_init (&state);
+    xxh64_update (&state, data, len);
+    return xxh64_digest (&state);
+}
+
+/* A buffer on its way through the writer and hasher threads. It goes back to @home
+ * once the last of its @users is done with it */
+typedef struct {
+    char *data;
+    gsize len;                  /* 0 tells the threads to stop */
+    off_t offset;
+    gint users;
+    GAsyncQueue *home;
+} StreamChunk;
+
+static void
+stream_chunk_release (StreamChunk *chunk)
+{
+    if (g_atomic_int_dec_and_test (&chunk->users)) {
+        g_async_queue_push (chunk->home, chunk);
+    }
+}
+
+typedef struct {
+    GThread *thread;
+    GAsyncQueue *queue;
+    Xxh64State state;
+} ChunkHasher;
+
+static gpointer
+chunk_hasher_run (gpointer data)
+{
+    ChunkHasher *hasher = data;
+    StreamChunk *chunk;
+
+    while ((chunk = g_async_queue_pop (hasher->queue))->len > 0) {
+        xxh64_update (&hasher->state, chunk->data, chunk->len);
+        stream_chunk_release (chunk);
+    }
+
+    return NULL;
+}
+
+static void
+chunk_hasher_start (ChunkHasher *hasher)
+{
+    xxh64_init (&hasher->state);
+    hasher->queue = g_async_queue_new ();
+    hasher->thread = g_thread_new ("copy-hash", chunk_hasher_run, hasher);
+}
+
+/* Waits for the chunks already pushed */
+static guint64
+chunk_hasher_finish (ChunkHasher *hasher)
+{
+    StreamChunk stop = { NULL, 0, 0, 0, NULL };
+
+    g_async_queue_push (hasher->queue, &stop);
+    g_thread_join (hasher->thread);
+    g_async_queue_unref (hasher->queue);
+
+    return xxh64_digest (&hasher->state);
+}
+
+/* With @from_disk a local file is synced and dropped from the page cache first */
+static gboolean
+hash_file (GFile *file, gboolean from_disk, GCancellable *cancellable, guint64 *hash)
+{
+    GFileInputStream *in;
+    StreamChunk chunks[2], *chunk;
+    GAsyncQueue *empty = NULL;
+    ChunkHasher hasher;
+    Xxh64State state;
+    gboolean ok = FALSE;
+    char *path;
+    int fd;
+
+    if (from_disk && (path = g_file_get_path (file)) != NULL) {
+        fd = open (path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (fd >= 0) {
+            fdatasync (fd);
+            posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+            close (fd);
+        }
+        g_free (path);
+    }
+
+    in = g_file_read (file, cancellable, NULL);
+    if (in == NULL) {
+        return FALSE;
+    }
+
+    memset (chunks, 0, sizeof (chunks));
+    chunks[0].data = g_malloc (VERIFY_BUFFER_SIZE);
+    chunk = &chunks[0];
+
+    while (g_input_stream_read_all (G_INPUT_STREAM (in), chunk->data, VERIFY_BUFFER_SIZE,
+                                    &chunk->len, cancellable, NULL)) {
+        if (empty == NULL) {
+            if (chunk->len < VERIFY_BUFFER_SIZE) {
+                /* Read in one go, not worth a thread */
+                xxh64_init (&state);
+                xxh64_update (&state, chunk->data, chunk->len);
+                *hash = xxh64_digest (&state);
+                ok = TRUE;
+                break;
+            }
+
+            empty = g_async_queue_new ();
+            chunks[0].home = empty;
+            chunks[1].home = empty;
+            chunks[1].data = g_malloc (VERIFY_BUFFER_SIZE);
+            g_async_queue_push (empty, &chunks[1]);
+            chunk_hasher_start (&hasher);
+        }
+
+        if (chunk->len == 0) {
+            ok = TRUE;
+            break;
+        }
+
+        chunk->users = 1;
+        g_async_queue_push (hasher.queue, chunk);
+        if (chunk->len < VERIFY_BUFFER_SIZE) {
+            ok = TRUE;
+            break;
+        }
+
+        chunk = g_async_queue_pop (empty);
+    }
+
+    if (empty != NULL) {
+        *hash = chunk_hasher_finish (&hasher);
+        g_async_queue_unref (empty);
+    }
+
+    g_object_unref (in);
+    g_free (chunks[0].data);
+    g_free (chunks[1].data);
+
+    return ok;
+}
+
+/* Returns FALSE when @dest does not read back the same as @src, or could not be read.
+ * @src_hash, when the copy already knows it, saves reading @src again */
+static gboolean
+verify_copied_file (GFile *src, GFile *dest, const guint64 *src_hash, GCancellable *cancellable)
+{
+    guint64 expected, found;
+
+    if (g_file_query_file_type (src, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, cancellable) != G_FILE_TYPE_REGULAR) {
+        return TRUE;
+    }
+
+    if (src_hash != NULL) {
+        expected = *src_hash;
+    } else if (!hash_file (src, FALSE, cancellable, &expected)) {
+        return FALSE;
+    }
+
+    return hash_file (dest, TRUE, cancellable, &found) && found == expected;
+}
+
+static goffset
+query_file_size (GFile *file, GCancellable *cancellable)
+{
+    GFileInfo *info;
+    goffset size = 0;
+
+    info = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                              G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, cancellable, NULL);
+    if (info != NULL) {
+        size = g_file_info_get_size (info);
+        g_object_unref (info);
+    }
+
+    return size;
+}
+
+/* Small regular files inside a copied folder are handed to a pool of workers, so that
+ * a tree of many tiny files is not bound by the latency of one copy at a time.
+ * Workers only attempt the plain copy. All bookkeeping, and every failure, is dealt
+ * with back on the job thread through the normal copy_move_file () path, which keeps
+ * dialogs, skip/retry and undo recording where they always were. Folders are still
+ * created by the job thread before anything is copied into them.
+ */
+#define PARALLEL_COPY_THREADS 8
+#define PARALLEL_COPY_MAX_SIZE (1024 * 1024)
+#define PARALLEL_COPY_MAX_PENDING (PARALLEL_COPY_THREADS * 32)
+/* Copies whose start has to be synced first are handed out this many at a time */
+#define PARALLEL_COPY_WRITE_AHEAD 64
+
+typedef struct {
+    GAsyncQueue *results;
+    guint pending;
+    GPtrArray *queued;          /* tasks waiting for their start to be synced */
+} ParallelCopyBatch;
+
+typedef struct {
+    ParallelCopyBatch *batch;
+    GFile *src;
+    GFile *dest;
+    GFileCopyFlags flags;
+    GCancellable *cancellable;
+    goffset size;
+    gboolean same_fs;
+    gboolean verify;
+    CopyMethod method;
+    GError *error;
+} ParallelCopyTask;
+
+static void
+parallel_copy_task_free (ParallelCopyTask *task)
+{
+    g_object_unref (task->src);
+    g_object_unref (task->dest);
+    g_object_unref (task->cancellable);
+    if (task->error != NULL) {
+        g_error_free (task->error);
+    }
+    g_slice_free (ParallelCopyTask, task);
+}
+
+static void
+parallel_copy_worker (gpointer data, gpointer user_data)
+{
+    ParallelCopyTask *task = data;
+
+    if (task->same_fs) {
+        task->method = copy_file_in_kernel (task->src, task->dest, task->flags,
+                                            task->cancellable, &task->size);
+    }
+
+    if (task->method == COPY_METHOD_USERSPACE &&
+        !g_file_copy (task->src, task->dest, task->flags, task->cancellable,
+                      NULL, NULL, &task->error) &&
+        !IS_IO_ERROR (task->error, EXISTS)) {
+        /* Anything at dest was created by this attempt as OVERWRITE is never set.
+         * Remove it so that the retry on the job thread does not see a conflict */
+        g_file_delete (task->dest, NULL, NULL);
+    }
+
+    /* A bad copy is made again, and reported if need be, by the job thread */
+    if (task->error == NULL && task->verify &&
+        !verify_copied_file (task->src, task->dest, NULL, task->cancellable)) {
+        g_file_delete (task->dest, NULL, NULL);
+        g_set_error_literal (&task->error, G_IO_ERROR, G_IO_ERROR_FAILED, "");
+    }
+
+    g_async_queue_push (task->batch->results, task);
+}
+
+/* Hands the queued copies of @batch to the workers once their starts are on disk */
+static void
+parallel_copy_batch_flush (CopyMoveJob *copy_job,
+                           ParallelCopyBatch *batch)
+{
+    guint i;
+
+    if (batch->queued == NULL || batch->queued->len == 0) {
+        return;
+    }
+
+    copy_journal_sync (copy_job->journal);
+    for (i = 0; i < batch->queued->len; i++) {
+        g_thread_pool_push (copy_job->copy_pool, g_ptr_array_index (batch->queued, i), NULL);
+    }
+    g_ptr_array_set_size (batch->queued, 0);
+}
+
+/* Handles finished copies of @batch, waiting for all of them if @wait_all is set */
+static void
+parallel_copy_batch_collect (CopyMoveJob *copy_job,
+                             ParallelCopyBatch *batch,
+                             gboolean wait_all,
+                             GFile *dest_dir,
+                             gboolean same_fs,
+                             char **dest_fs_type,
+                             SourceInfo *source_info,
+                             TransferInfo *transfer_info,
+                             gboolean *skipped_file,
+                             gboolean readonly_source_fs)
+{
+    CommonJob *job;
+    ParallelCopyTask *task;
+
+    job = (CommonJob *)copy_job;
+
+    parallel_copy_batch_flush (copy_job, batch);
+
+    while (batch->pending > 0) {
+        if (wait_all) {
+            task = g_async_queue_pop (batch->results);
+        } else if ((task = g_async_queue_try_pop (batch->results)) == NULL) {
+            return;
+        }
+
+        batch->pending--;
+
+        if (task->error == NULL) {
+            transfer_info->num_files++;
+            transfer_info->num_bytes += task->size;
+            report_copy_progress (copy_job, source_info, transfer_info);
+            count_copy_method (copy_job, task->method);
+            if (task->verify) {
+                copy_job->n_verified++;
+            }
+            copy_journal_file_done (copy_job->journal, task->src);
+
+            marlin_file_changes_queue_file_added (task->dest);
+
+            // Start UNDO-REDO
+            marlin_undo_manager_data_add_origin_target_pair (job->undo_redo_data, task->src, task->dest);
+            // End UNDO-REDO
+        } else if (IS_IO_ERROR (task->error, CANCELLED) || job_aborted (job)) {
+            *skipped_file = TRUE;
+        } else {
+            /* An existing dest was left alone, anything else was removed */
+            copy_journal_file_abandoned (copy_job->journal, task->src);
+
+            /* Let the sequential path retry and report the problem */
+            copy_move_file (copy_job, task->src, dest_dir, same_fs, FALSE, dest_fs_type,
+                            source_info, transfer_info, NULL, NULL, FALSE, skipped_file,
+                            readonly_source_fs);
+        }
+
+        parallel_copy_task_free (task);
+    }
+}
+
+static void
+parallel_copy_batch_push (CopyMoveJob *copy_job,
+                          ParallelCopyBatch *batch,
+                          GFile *src,
+                          GFile *dest,
+                          goffset size,
+                          gboolean same_fs,
+                          gboolean readonly_source_fs)
+{
+    ParallelCopyTask *task;
+
+    if (copy_job->copy_pool == NULL) {
+        copy_job->copy_pool = g_thread_pool_new (parallel_copy_worker, NULL,
+                                                 PARALLEL_COPY_THREADS, FALSE, NULL);
+    }
+
+    if (batch->results == NULL) {
+        batch->results = g_async_queue_new ();
+    }
+
+    task = g_slice_new0 (ParallelCopyTask);
+    task->batch = batch;
+    task->src = g_object_ref (src);
+    task->dest = dest;
+    task->flags = G_FILE_COPY_NOFOLLOW_SYMLINKS;
+    if (readonly_source_fs) {
+        task->flags |= G_FILE_COPY_TARGET_DEFAULT_PERMS;
+    }
+    task->cancellable = g_object_ref (copy_job->common.cancellable);
+    task->size = size;
+    task->same_fs = same_fs;
+    task->verify = copy_job->verify;
+    task->method = COPY_METHOD_USERSPACE;
+
+    copy_journal_file_started (copy_job->journal, src, dest, FALSE, FALSE);
+    batch->pending++;
+
+    /* One sync covers a run of copies */
+    if (copy_journal_needs_write_ahead (copy_job->journal)) {
+        if (batch->queued == NULL) {
+            batch->queued = g_ptr_array_new ();
+        }
+        g_ptr_array_add (batch->queued, task);
+        if (batch->queued->len >= PARALLEL_COPY_WRITE_AHEAD) {
+            parallel_copy_batch_flush (copy_job, batch);
+        }
+    } else {
+        g_thread_pool_push (copy_job->copy_pool, task, NULL);
+    }
+}
+
+/* a return value of FALSE means retry, i.e.
+ * the destination has changed and the source
+ * is expected to re-try the preceeding
+ * g_file_move() or g_file_copy() call with
+ * the new destination.
+ */
+static gboolean
+copy_move_directory (CopyMoveJob *copy_job,
+                     GFile *src,
+                     GFile **dest,
+                     gboolean same_fs,
+                     gboolean create_dest,
+                     char **parent_dest_fs_type,
+                     SourceInfo *source_info,
+                     TransferInfo *transfer_info,
+                     GHashTable *debuting_files,
+                     gboolean *skipped_file,
+                     gboolean readonly_source_fs)
+{
+    GFileInfo *info;
+    GError *error;
+    GFile *src_file;
+    GFileEnumerator *enumerator;
+    char *primary, *secondary, *details;
+    char *dest_fs_type;
+    int response;
+    gboolean skip_error;
+    gboolean local_skipped_file;
+    gboolean read_all, new_folder;
+    int n_files_before;
+    goffset n_bytes_before;
+    guint n_open_before;
+    CommonJob *job;
+    GFileCopyFlags flags;
+    ParallelCopyBatch batch = { NULL, 0, NULL };
+    gboolean parallel;
+    GByteArray *listing;
+    gsize listing_pos = 0;
+    GList *deferred_files, *l;
+
+    job = (CommonJob *)copy_job;
+
+    if (create_dest) {
+        switch (create_dest_dir (copy_job, src, dest, same_fs, parent_dest_fs_type)) {
+        case CREATE_DEST_DIR_RETRY:
+            /* next time copy_move_directory() is called,
+             * create_dest will be FALSE if a directory already
+             * exists under the new name (i.e. WOULD_RECURSE)
+             */
+            return FALSE;
+
+        case CREATE_DEST_DIR_FAILED:
+            *skipped_file = TRUE;
+            return TRUE;
+
+        case CREATE_DEST_DIR_SUCCESS:
+        default:
+            break;
+        }
+
+        if (debuting_files) {
+            g_hash_table_replace (debuting_files, g_object_ref (*dest), GINT_TO_POINTER (TRUE));
+        }
+
+    }
+
+    local_skipped_file = FALSE;
+    read_all = TRUE;
+    n_files_before = transfer_info->num_files;
+    n_bytes_before = transfer_info->num_bytes;
+    n_open_before = copy_journal_get_n_open (copy_job->journal);
+    new_folder = copy_journal_enter_folder (copy_job->journal, src);
+    /* Names had to be fixed for the parent, so fix them up front here too */
+    dest_fs_type = *parent_dest_fs_type != NULL ? get_dest_fs_type (copy_job, *dest) : NULL;
+
+    /* Moves within a filesystem are renames and remote backends may not like concurrent use */
+    parallel = !copy_job->is_move && g_file_is_native (src) && g_file_is_native (*dest);
+
+    /* Reuse what the scan already read when possible */
+    listing = job->manifest != NULL ? scan_manifest_take_dir (job->manifest, src) : NULL;
+
+    skip_error = should_skip_readdir_error (job, src);
+retry:
+    error = NULL;
+    enumerator = NULL;
+    if (listing == NULL) {
+        enumerator = g_file_enumerate_children (src,
+                                                parallel ? G_FILE_ATTRIBUTE_STANDARD_NAME ","
+                                                           G_FILE_ATTRIBUTE_STANDARD_TYPE ","
+                                                           G_FILE_ATTRIBUTE_STANDARD_SIZE ","
+                                                           G_FILE_ATTRIBUTE_UNIX_NLINK
+                                                         : G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                                G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                                job->cancellable,
+                                                &error);
+    }
+    if (enumerator || listing) {
+        error = NULL;
+        deferred_files = NULL;
+
+        while (!job_aborted (job) &&
+               (info = (listing != NULL) ? scan_manifest_next_info (listing, &listing_pos) :
+                       g_file_enumerator_next_file (enumerator, job->cancellable, skip_error?NULL:&error)) != NULL) {
+            src_file = g_file_get_child (src,
+                                         g_file_info_get_name (info));
+            if (conflict_preflight_defers (copy_job, src_file)) {
+                deferred_files = g_list_prepend (deferred_files, g_object_ref (src_file));
+            } else if (parallel &&
+                g_file_info_get_file_type (info) == G_FILE_TYPE_REGULAR &&
+                g_file_info_get_size (info) <= PARALLEL_COPY_MAX_SIZE &&
+                /* Links have to be made one after the other */
+                (job->links == NULL || g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_NLINK) < 2) &&
+                /* Resumed files are checked on the job thread */
+                !copy_journal_knows (copy_job->journal, src_file) &&
+                !should_skip_file (job, src_file)) {
+
+                if (batch.pending >= PARALLEL_COPY_MAX_PENDING) {
+                    parallel_copy_batch_collect (copy_job, &batch, FALSE, *dest, same_fs, &dest_fs_type,
+                                                 source_info, transfer_info, &local_skipped_file,
+                                                 readonly_source_fs);
+                }
+
+                parallel_copy_batch_push (copy_job, &batch, src_file,
+                                          get_target_file (src_file, *dest, dest_fs_type, same_fs),
+                                          g_file_info_get_size (info), same_fs, readonly_source_fs);
+            } else {
+                copy_move_file (copy_job, src_file, *dest, same_fs, FALSE, &dest_fs_type,
+                                source_info, transfer_info, NULL, NULL, FALSE, &local_skipped_file,
+                                readonly_source_fs);
+            }
+            g_object_unref (src_file);
+            g_object_unref (info);
+        }
+        if (enumerator) {
+            g_file_enumerator_close (enumerator, job->cancellable, NULL);
+            g_object_unref (enumerator);
+        }
+
+        /* All files must be in place before the folder attributes are copied below */
+        parallel_copy_batch_collect (copy_job, &batch, TRUE, *dest, same_fs, &dest_fs_type,
+                                     source_info, transfer_info, &local_skipped_file,
+                                     readonly_source_fs);
+
+        /* Conflicts last, the rest of the folder is not held up by the preflight dialog */
+        deferred_files = g_list_reverse (deferred_files);
+        for (l = deferred_files; l != NULL && !job_aborted (job); l = l->next) {
+            copy_move_file (copy_job, l->data, *dest, same_fs, FALSE, &dest_fs_type,
+                            source_info, transfer_info, NULL, NULL, FALSE, &local_skipped_file,
+                            readonly_source_fs);
+        }
+        g_list_free_full (deferred_files, g_object_unref);
+
+        if (error && IS_IO_ERROR (error, CANCELLED)) {
+            g_error_free (error);
+        } else if (error) {
+            if (copy_job->is_move) {
+                primary = f (_("Error while moving."));
+            } else {
+                primary = f (_("Error while copying."));
+            }
+            details = NULL;
+
+            if (IS_IO_ERROR (error, PERMISSION_DENIED)) {
+                secondary = f (_("Files in the folder \"%B\" cannot be copied because you do "
+                                 "not have permissions to see them."), src);
+            } else {
+                secondary = f (_("There was an error getting information about the files in the folder \"%B\"."), src);
+                details = error->message;
+            }
+
+            response = run_warning (job,
+                                    primary,
+                                    secondary,
+                                    details,
+                                    FALSE,
+                                    GTK_STOCK_CANCEL, _("_Skip files"),
+                                    NULL);
+
+            g_error_free (error);
+
+            if (response == 0 || response == GTK_RESPONSE_DELETE_EVENT) {
+                abort_job (job);
+            } else if (response == 1) {
+                /* Skip: Do Nothing */
+                local_skipped_file = TRUE;
+                read_all = FALSE;
+            } else {
+                g_assert_not_reached ();
+            }
+        }
+
+        /* Count the copied directory as a file */
+        transfer_info->num_files ++;
+        report_copy_progress (copy_job, source_info, transfer_info);
+
+        if (debuting_files) {
+            g_hash_table_replace (debuting_files, g_object_ref (*dest), GINT_TO_POINTER (create_dest));
+        }
+    } else if (IS_IO_ERROR (error, CANCELLED)) {
+        g_error_free (error);
+    } else {
+        if (copy_job->is_move) {
+            primary = f (_("Error while moving."));
+        } else {
+            primary = f (_("Error while copying."));
+        }
+        details = NULL;
+
+        if (IS_IO_ERROR (error, PERMISSION_DENIED)) {
+            secondary = f (_("The folder \"%B\" cannot be copied because you do not have "
+                             "permissions to read it."), src);
+        } else {
+            secondary = f (_("There was an error reading the folder \"%B\"."), src);
+            details = error->message;
+        }
+
+        response = run_warning (job,
+                                primary,
+                                secondary,
+                                details,
+                                FALSE,
+                                GTK_STOCK_CANCEL, SKIP, RETRY,
+                                NULL);
+
+        g_error_free (error);
+
+        if (response == 0 || response == GTK_RESPONSE_DELETE_EVENT) {
+            abort_job (job);
+        } else if (response == 1) {
+            /* Skip: Do Nothing  */
+            local_skipped_file = TRUE;
+            read_all = FALSE;
+        } else if (response == 2) {
+            goto retry;
+        } else {
+            g_assert_not_reached ();
+        }
+    }
+
+    if (create_dest) {
+        flags = (readonly_source_fs) ? G_FILE_COPY_NOFOLLOW_SYMLINKS | G_FILE_COPY_TARGET_DEFAULT_PERMS
+            : G_FILE_COPY_NOFOLLOW_SYMLINKS;
+        /* Ignore errors here. Failure to copy metadata is not a hard error */
+        g_file_copy_attributes (src, *dest,
+                                flags,
+                                job->cancellable, NULL);
+    }
+
+    if (!job_aborted (job) && copy_job->is_move &&
+        /* Don't delete source if there was a skipped file */
+        !local_skipped_file) {
+        if (!g_file_delete (src, job->cancellable, &error)) {
+            if (job->skip_all_error) {
+                goto skip;
+            }
+            primary = f (_("Error while moving \"%B\"."), src);
+            secondary = f (_("Could not remove the source folder."));
+            details = error->message;
+
+            response = run_warning (job,
+                                    primary,
+                                    secondary,
+                                    details,
+                                    (source_info->num_files - transfer_info->num_files) > 1,
+                                    GTK_STOCK_CANCEL, SKIP_ALL, SKIP,
+                                    NULL);
+
+            if (response == 0 || response == GTK_RESPONSE_DELETE_EVENT) {
+                abort_job (job);
+            } else if (response == 1) { /* skip all */
+                job->skip_all_error = TRUE;
+                local_skipped_file = TRUE;
+            } else if (response == 2) { /* skip */
+                local_skipped_file = TRUE;
+            } else {
+                g_assert_not_reached ();
+            }
+
+skip:
+            g_error_free (error);
+        }
+    }
+
+    if (new_folder) {
+        copy_journal_leave_folder (copy_job->journal);
+    }
+
+    /* Skipped conflicts are settled, files that failed are not */
+    if (!job_aborted (job) && read_all &&
+        copy_journal_get_n_open (copy_job->journal) == n_open_before) {
+        copy_journal_folder_done (copy_job->journal, src,
+                                  transfer_info->num_files - n_files_before,
+                                  transfer_info->num_bytes - n_bytes_before);
+    }
+
+    if (local_skipped_file) {
+        *skipped_file = TRUE;
+    }
+
+    if (batch.queued != NULL) {
+        g_ptr_array_free (batch.queued, TRUE);
+    }
+    if (batch.results != NULL) {
+        g_async_queue_unref (batch.results);
+    }
+    if (listing != NULL) {
+        g_byte_array_unref (listing);
+    }
+
+    g_free (dest_fs_type);
+    return TRUE;
+}
+
+static gboolean
+remove_target_recursively (CommonJob *job,
+                           GFile *src,
+                           GFile *toplevel_dest,
+                           GFile *file)
+{
+    GFileEnumerator *enumerator;
+    GError *error;
+    GFile *child;
+    gboolean stop;
+    char *primary, *secondary, *details;
+    int response;
+    GFileInfo *info;
+
+    stop = FALSE;
+
+    error = NULL;
+    enumerator = g_file_enumerate_children (file,
+                                            G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                            G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                            job->cancellable,
+                                            &error);
+    if (enumerator) {
+        error = NULL;
+
+        while (!job_aborted (job) &&
+               (info = g_file_enumerator_next_file (enumerator, job->cancellable, &error)) != NULL) {
+            child = g_file_get_child (file,
+                                      g_file_info_get_name (info));
+            if (!remove_target_recursively (job, src, toplevel_dest, child)) {
+                stop = TRUE;
+                break;
+            }
+            g_object_unref (child);
+            g_object_unref (info);
+        }
+        g_file_enumerator_close (enumerator, job->cancellable, NULL);
+        g_object_unref (enumerator);
+
+    } else if (IS_IO_ERROR (error, NOT_DIRECTORY)) {
+        /* Not a dir, continue */
+        g_error_free (error);
+
+    } else if (IS_IO_ERROR (error, CANCELLED)) {
+        g_error_free (error);
+    } else {
+        if (job->skip_all_error) {
+            goto skip1;
+        }
+
+        primary = f (_("Error while copying \"%B\"."), src);
+        secondary = f (_("Could not remove files from the already existing folder %F."), file);
+        details = error->message;
+
+        /* set show_all to TRUE here, as we don't know how many
+         * files we'll end up processing yet.
+         */
+        response = run_warning (job,
+                                primary,
+                                secondary,
+                                details,
+                                TRUE,
+                                GTK_STOCK_CANCEL, SKIP_ALL, SKIP,
+                                NULL);
+
+        if (response == 0 || response == GTK_RESPONSE_DELETE_EVENT) {
+            abort_job (job);
+        } else if (response == 1) { /* skip all */
+            job->skip_all_error = TRUE;
+        } else if (response == 2) { /* skip */
+            /* do nothing */
+        } else {
+            g_assert_not_reached ();
+        }
+skip1:
+        g_error_free (error);
+
+        stop = TRUE;
+    }
+
+    if (stop) {
+        return FALSE;
+    }
+
+    error = NULL;
+
+    if (!g_file_delete (file, job->cancellable, &error)) {
+        if (job->skip_all_error ||
+            IS_IO_ERROR (error, CANCELLED)) {
+            goto skip2;
+        }
+        primary = f (_("Error while copying \"%B\"."), src);
+        secondary = f (_("Could not remove the already existing file %F."), file);
+        details = error->message;
+
+        /* set show_all to TRUE here, as we don't know how many
+         * files we'll end up processing yet.
+         */
+        response = run_warning (job,
+                                primary,
+                                secondary,
+                                details,
+                                TRUE,
+                                GTK_STOCK_CANCEL, SKIP_ALL, SKIP,
+                                NULL);
+
+        if (response == 0 || response == GTK_RESPONSE_DELETE_EVENT) {
+            abort_job (job);
+        } else if (response == 1) { /* skip all */
+            job->skip_all_error = TRUE;
+        } else if (response == 2) { /* skip */
+            /* do nothing */
+        } else {
+            g_assert_not_reached ();
+        }
+
+skip2:
+        g_error_free (error);
+
+        return FALSE;
+    }
+    marlin_file_changes_queue_file_removed (file);
+
+    return TRUE;
+
+}
+
+typedef struct {
+    CopyMoveJob *job;
+    goffset last_size;
+    SourceInfo *source_info;
+    TransferInfo *transfer_info;
+} ProgressData;
+
+static void
+copy_file_progress_callback (goffset current_num_bytes,
+                             goffset total_num_bytes,
+                             gpointer user_data)
+{
+    ProgressData *pdata;
+    goffset new_size;
+
+    pdata = user_data;
+
+    new_size = current_num_bytes - pdata->last_size;
+
+    if (new_size > 0) {
+        pdata->transfer_info->num_bytes += new_size;
+        pdata->last_size = current_num_bytes;
+        report_copy_progress (pdata->job,
+                              pdata->source_info,
+                              pdata->transfer_info);
+    }
+}
+
+static gboolean
+test_dir_is_parent (GFile *child, GFile *root)
+{
+    GFile *f = child;
+    GFile *prev = NULL;
+
+    if (g_file_equal (child, root))
+        return TRUE;
+
+    while ((f = g_file_get_parent (f))) {
+        if (prev) g_object_unref (prev);
+
+        if (g_file_equal (f, root)) {
+            g_object_unref (f);
+            return TRUE;
+        }
+        prev = f;
+    }
+    if (prev) g_object_unref (prev);
+
+    return FALSE;
+}
+
+static char *
+query_fs_type (GFile *file,
+               GCancellable *cancellable)
+{
+    GFileInfo *fsinfo;
+    char *ret;
+
+    ret = NULL;
+
+    fsinfo = g_file_query_filesystem_info (file,
+                                           G_FILE_ATTRIBUTE_FILESYSTEM_TYPE,
+                                           cancellable,
+                                           NULL);
+    if (fsinfo != NULL) {
+        ret = g_strdup (g_file_info_get_attribute_string (fsinfo, G_FILE_ATTRIBUTE_FILESYSTEM_TYPE));
+        g_object_unref (fsinfo);
+    }
+
+    if (ret == NULL) {
+        /* ensure that we don't attempt to query
+         * the FS type for each file in a given
+         * directory, if it can't be queried. */
+        ret = g_strdup ("");
+    }
+
+    return ret;
+}
+
+typedef struct {
+    int id;
+    char *new_name;
+    gboolean apply_to_all;
+} ConflictResponseData;
+
+typedef struct {
+    GFile *src;
+    GFile *dest;
+    GFile *dest_dir;
+    GtkWindow *parent;
+    ConflictResponseData *resp_data;
+} ConflictDialogData;
+
+static gboolean
+do_run_conflict_dialog (gpointer _data)
+{
+    ConflictDialogData *data = _data;
+    GtkWidget *dialog;
+    int response;
+
+    dialog = marlin_file_conflict_dialog_new (data->parent,
+                                              data->src,
+                                              data->dest,
+                                              data->dest_dir);
+    response = gtk_dialog_run (GTK_DIALOG (dialog));
+
+    if (response == MARLIN_FILE_CONFLICT_DIALOG_RESPONSE_TYPE_RENAME) {
+        data->resp_data->new_name =
+            marlin_file_conflict_dialog_get_new_name (MARLIN_FILE_CONFLICT_DIALOG (dialog));
+    } else if (response != GTK_RESPONSE_CANCEL ||
+               response != GTK_RESPONSE_NONE) {
+        data->resp_data->apply_to_all =
+            marlin_file_conflict_dialog_get_apply_to_all
+            (MARLIN_FILE_CONFLICT_DIALOG (dialog));
+    }
+
+    data->resp_data->id = response;
+
+    gtk_widget_destroy (dialog);
+
+    return FALSE;
+}
+
+static ConflictResponseData *
+run_conflict_dialog (CommonJob *job,
+                     GFile *src,
+                     GFile *dest,
+                     GFile *dest_dir)
+{
+    ConflictDialogData *data;
+    ConflictResponseData *resp_data;
+
+    g_timer_stop (job->time);
+
+    data = g_slice_new0 (ConflictDialogData);
+    data->parent = job->parent_window;
+    data->src = src;
+    data->dest = dest;
+    data->dest_dir = dest_dir;
+
+    resp_data = g_slice_new0 (ConflictResponseData);
+    resp_data->new_name = NULL;
+    data->resp_data = resp_data;
+
+    pf_progress_info_pause (job->progress);
+    g_io_scheduler_job_send_to_mainloop (job->io_job,
+                                         do_run_conflict_dialog,
+                                         data,
+                                         NULL);
+
+    pf_progress_info_resume (job->progress);
+    g_slice_free (ConflictDialogData, data);
+    g_timer_continue (job->time);
+
+    return resp_data;
+}
+
+static void
+conflict_response_data_free (ConflictResponseData *data)
+{
+    g_free (data->new_name);
+    g_slice_free (ConflictResponseData, data);
+}
+
+/* Conflict preflight
+ *
+ * Before anything is transferred the destination is checked for every name the job
+ * would create. The collisions are shown in one dialog while the job goes on with the
+ * items that have none: in the job and in every merged folder, the conflicting items
+ * are left until the others are done. The first conflict reached waits for the rule
+ * picked in the dialog.
+ */
+#define CONFLICT_PREFLIGHT_MAX_NAMES 200
+
+struct ConflictPreflight {
+    GMutex lock;
+    GCond cond;
+    gboolean decided;           /* protected by lock */
+    int rule;                   /* protected by lock */
+    gboolean applied;           /* job thread only */
+    GHashTable *conflicts;      /* sources whose dest exists, at any depth */
+    GPtrArray *names;
+    int n_files;
+    int n_folders;
+    GtkWidget *dialog;          /* main loop only */
+};
+
+static void
+conflict_preflight_add (CopyMoveJob *job,
+                        ConflictPreflight *preflight,
+                        GFile *src,
+                        GFile *dest,
+                        gboolean is_merge)
+{
+    char *name;
+
+    g_hash_table_add (preflight->conflicts, g_object_ref (src));
+    if (is_merge) {
+        preflight->n_folders++;
+        return;
+    }
+
+    preflight->n_files++;
+    if (preflight->names->len < CONFLICT_PREFLIGHT_MAX_NAMES) {
+        name = g_file_get_relative_path (job->destination, dest);
+        g_ptr_array_add (preflight->names, name != NULL ? name : g_file_get_parse_name (dest));
+    }
+}
+
+/* A merge only conflicts where both folders have the same names. Each side is listed
+ * once, the source from what the scan kept when it can */
+static void
+conflict_preflight_scan_folder (CopyMoveJob *job,
+                                ConflictPreflight *preflight,
+                                GFile *src,
+                                GFile *dest,
+                                gboolean same_fs)
+{
+    CommonJob *common;
+    GHashTable *dest_types;
+    GFileEnumerator *enumerator;
+    GFileInfo *info;
+    GFile *child, *dest_child;
+    GByteArray *listing;
+    gsize listing_pos = 0;
+    gpointer dest_type;
+    gboolean is_merge;
+    char *name;
+
+    common = &job->common;
+    enumerator = g_file_enumerate_children (dest,
+                                            G_FILE_ATTRIBUTE_STANDARD_NAME ","
+                                            G_FILE_ATTRIBUTE_STANDARD_TYPE,
+                                            G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                            common->cancellable,
+                                            NULL);
+    if (enumerator == NULL) {
+        return;
+    }
+
+    dest_types = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    while ((info = g_file_enumerator_next_file (enumerator, common->cancellable, NULL)) != NULL) {
+        g_hash_table_insert (dest_types, g_strdup (g_file_info_get_name (info)),
+                             GINT_TO_POINTER (g_file_info_get_file_type (info)));
+        g_object_unref (info);
+    }
+    g_file_enumerator_close (enumerator, NULL, NULL);
+    g_object_unref (enumerator);
+
+    enumerator = NULL;
+    listing = common->manifest != NULL ? scan_manifest_read_dir (common->manifest, src) : NULL;
+    if (listing == NULL) {
+        enumerator = g_file_enumerate_children (src,
+                                                G_FILE_ATTRIBUTE_STANDARD_NAME ","
+                                                G_FILE_ATTRIBUTE_STANDARD_TYPE,
+                                                G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                                common->cancellable,
+                                                NULL);
+    }
+
+    while (g_hash_table_size (dest_types) > 0 && !job_aborted (common) &&
+           (listing != NULL || enumerator != NULL) &&
+           (info = (listing != NULL) ? scan_manifest_next_info (listing, &listing_pos) :
+                   g_file_enumerator_next_file (enumerator, common->cancellable, NULL)) != NULL) {
+        child = g_file_get_child (src, g_file_info_get_name (info));
+        dest_child = get_target_file (child, dest, NULL, same_fs);
+        name = g_file_get_basename (dest_child);
+
+        if (g_hash_table_lookup_extended (dest_types, name, NULL, &dest_type)) {
+            is_merge = g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY &&
+                       GPOINTER_TO_INT (dest_type) == G_FILE_TYPE_DIRECTORY;
+            /* Once every name in dest was met, nothing else can conflict */
+            g_hash_table_remove (dest_types, name);
+            conflict_preflight_add (job, preflight, child, dest_child, is_merge);
+            if (is_merge) {
+                conflict_preflight_scan_folder (job, preflight, child, dest_child, same_fs);
+            }
+        }
+
+        g_free (name);
+        g_object_unref (dest_child);
+        g_object_unref (child);
+        g_object_unref (info);
+    }
+
+    if (enumerator != NULL) {
+        g_file_enumerator_close (enumerator, NULL, NULL);
+        g_object_unref (enumerator);
+    }
+    if (listing != NULL) {
+        g_byte_array_unref (listing);
+    }
+    g_hash_table_unref (dest_types);
+}
+
+static void
+conflict_preflight_free (ConflictPreflight *preflight)
+{
+    if (preflight->dialog != NULL) {
+        g_signal_handlers_disconnect_by_data (preflight->dialog, preflight);
+        gtk_widget_destroy (preflight->dialog);
+    }
+
+    g_hash_table_unref (preflight->conflicts);
+    g_ptr_array_free (preflight->names, TRUE);
+    g_mutex_clear (&preflight->lock);
+    g_cond_clear (&preflight->cond);
+    g_free (preflight);
+}
+
+static void
+conflict_preflight_response (GtkDialog *dialog,
+                             int response,
+                             gpointer user_data)
+{
+    ConflictPreflight *preflight = user_data;
+
+    g_mutex_lock (&preflight->lock);
+    preflight->rule = response;
+    preflight->decided = TRUE;
+    g_cond_signal (&preflight->cond);
+    g_mutex_unlock (&preflight->lock);
+
+    preflight->dialog = NULL;
+    gtk_widget_destroy (GTK_WIDGET (dialog));
+}
+
+static gboolean
+do_show_conflict_preflight (gpointer user_data)
+{
+    CopyMoveJob *job = user_data;
+    ConflictPreflight *preflight;
+
+    preflight = job->preflight;
+    preflight->dialog = GTK_WIDGET (marlin_conflict_batch_dialog_new (job->common.parent_window,
+                                                                      job->destination,
+                                                                      job->is_move,
+                                                                      preflight->n_files,
+                                                                      (char **) preflight->names->pdata,
+                                                                      preflight->names->len));
+    g_signal_connect (preflight->dialog, "response",
+                      G_CALLBACK (conflict_preflight_response), preflight);
+    gtk_widget_show (preflight->dialog);
+
+    return FALSE;
+}
+
+/* Runs in the job thread before the transfer. The dialog is not waited for here */
+static void
+conflict_preflight_run (CopyMoveJob *job,
+                        const char *dest_fs_id)
+{
+    ConflictPreflight *preflight;
+    CommonJob *common;
+    GList *l;
+    GFile *src, *dest;
+    GFileType dest_type;
+    gboolean same_fs, is_merge;
+
+    common = &job->common;
+    preflight = g_new0 (ConflictPreflight, 1);
+    g_mutex_init (&preflight->lock);
+    g_cond_init (&preflight->cond);
+    preflight->conflicts = g_hash_table_new_full (g_file_hash, (GEqualFunc) g_file_equal,
+                                                  g_object_unref, NULL);
+    preflight->names = g_ptr_array_new_with_free_func (g_free);
+
+    for (l = job->files; l != NULL && !job_aborted (common); l = l->next) {
+        src = l->data;
+        same_fs = dest_fs_id != NULL && has_fs_id (src, dest_fs_id);
+        dest = get_target_file (src, job->destination, NULL, same_fs);
+        dest_type = g_file_query_file_type (dest, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, common->cancellable);
+        if (dest_type != G_FILE_TYPE_UNKNOWN) {
+            is_merge = dest_type == G_FILE_TYPE_DIRECTORY &&
+                       g_file_query_file_type (src, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                               common->cancellable) == G_FILE_TYPE_DIRECTORY;
+            conflict_preflight_add (job, preflight, src, dest, is_merge);
+            if (is_merge) {
+                conflict_preflight_scan_folder (job, preflight, src, dest, same_fs);
+            }
+        }
+        g_object_unref (dest);
+    }
+
+    g_debug ("%s: %d files and %d folders conflict", G_STRFUNC, preflight->n_files, preflight->n_folders);
+
+    /* Folders alone are merged as before, asking for each */
+    if (job_aborted (common) || preflight->n_files == 0) {
+        conflict_preflight_free (preflight);
+        return;
+    }
+
+    job->preflight = preflight;
+    g_io_scheduler_job_send_to_mainloop_async (job->common.io_job,
+                                               do_show_conflict_preflight,
+                                               job,
+                                               NULL);
+}
+
+/* Items with a conflict are left until the others in the same folder are done */
+static gboolean
+conflict_preflight_defers (CopyMoveJob *job,
+                           GFile *src)
+{
+    return job->preflight != NULL && g_hash_table_contains (job->preflight->conflicts, src);
+}
+
+/* Called by the job thread on a conflict, waits for the rule and applies it once */
+static void
+conflict_preflight_wait (CopyMoveJob *job)
+{
+    ConflictPreflight *preflight;
+    CommonJob *common;
+    gint64 end_time;
 
-skip:
-            g_error_free (error);
-        }
+    preflight = job->preflight;
+    common = &job->common;
+    if (preflight == NULL || preflight->applied) {
+        return;
     }
 
-    if (local_skipped_file) {
-        *skipped_file = TRUE;
+    g_timer_stop (common->time);
+    pf_progress_info_pause (common->progress);
+
+    g_mutex_lock (&preflight->lock);
+    while (!preflight->decided && !job_aborted (common)) {
+        end_time = g_get_monotonic_time () + 100 * G_TIME_SPAN_MILLISECOND;
+        g_cond_wait_until (&preflight->cond, &preflight->lock, end_time);
     }
+    g_mutex_unlock (&preflight->lock);
 
-    g_free (dest_fs_type);
-    return TRUE;
+    pf_progress_info_resume (common->progress);
+    g_timer_continue (common->time);
+
+    if (job_aborted (common)) {
+        return;
+    }
+
+    preflight->applied = TRUE;
+    switch (preflight->rule) {
+    case MARLIN_CONFLICT_BATCH_DIALOG_RESPONSE_TYPE_SKIP:
+        common->merge_all = TRUE;
+        common->skip_all_conflict = TRUE;
+        break;
+    case MARLIN_CONFLICT_BATCH_DIALOG_RESPONSE_TYPE_REPLACE:
+        common->merge_all = TRUE;
+        common->replace_all = TRUE;
+        break;
+    case MARLIN_CONFLICT_BATCH_DIALOG_RESPONSE_TYPE_NEWEST:
+        common->merge_all = TRUE;
+        common->keep_all_newest = TRUE;
+        break;
+    case MARLIN_CONFLICT_BATCH_DIALOG_RESPONSE_TYPE_UPDATE:
+        common->update_all = TRUE;
+        break;
+    case MARLIN_CONFLICT_BATCH_DIALOG_RESPONSE_TYPE_ASK:
+        break;
+    default:
+        abort_job (common);
+        break;
+    }
 }
 
-static gboolean
-remove_target_recursively (CommonJob *job,
-                           GFile *src,
-                           GFile *toplevel_dest,
-                           GFile *file)
+static GFile *
+get_target_file_for_display_name (GFile *dir,
+                                  char *name)
 {
-    GFileEnumerator *enumerator;
-    GError *error;
-    GFile *child;
-    gboolean stop;
-    char *primary, *secondary, *details;
-    int response;
-    GFileInfo *info;
+    GFile *dest;
 
-    stop = FALSE;
+    dest = NULL;
+    dest = g_file_get_child_for_display_name (dir, name, NULL);
 
-    error = NULL;
-    enumerator = g_file_enumerate_children (file,
-                                            G_FILE_ATTRIBUTE_STANDARD_NAME,
-                                            G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                            job->cancellable,
-                                            &error);
-    if (enumerator) {
-        error = NULL;
+    if (dest == NULL) {
+        dest = g_file_get_child (dir, name);
+    }
 
-        while (!job_aborted (job) &&
-               (info = g_file_enumerator_next_file (enumerator, job->cancellable, &error)) != NULL) {
-            child = g_file_get_child (file,
-                                      g_file_info_get_name (info));
-            if (!remove_target_recursively (job, src, toplevel_dest, child)) {
-                stop = TRUE;
-                break;
-            }
-            g_object_unref (child);
-            g_object_unref (info);
-        }
-        g_file_enumerator_close (enumerator, job->cancellable, NULL);
-        g_object_unref (enumerator);
+    return dest;
+}
 
-    } else if (IS_IO_ERROR (error, NOT_DIRECTORY)) {
-        /* Not a dir, continue */
-        g_error_free (error);
+/* With the delta-copy preference set, a large file replacing an existing one is
+ * compared against it block by block and only the blocks that differ are written, to
+ * a clone of it, see copy_file_delta (). Both files have to be reachable through a path.
+ * Data is only ever matched at the same offset: that covers the in place changes of disk
+ * images and databases, and both sides are read anyway so no checksums are needed.
+ */
+#define DELTA_COPY_MIN_SIZE (16 * 1024 * 1024)
+#define DELTA_COPY_BLOCK_SIZE (64 * 1024)
+#define DELTA_COPY_CHUNK_SIZE (4 * 1024 * 1024)
 
-    } else if (IS_IO_ERROR (error, CANCELLED)) {
-        g_error_free (error);
-    } else {
-        if (job->skip_all_error) {
-            goto skip1;
-        }
+static gboolean
+pread_full (int fd, char *buf, gsize count, off_t offset, gsize *n_read)
+{
+    ssize_t n;
 
-        primary = f (_("Error while copying \"%B\"."), src);
-        secondary = f (_("Could not remove files from the already existing folder %F."), file);
-        details = error->message;
+    for (*n_read = 0; *n_read < count; *n_read += n) {
+        n = pread (fd, buf + *n_read, count - *n_read, offset + *n_read);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+        } else if (n < 0) {
+            return FALSE;
+        } else if (n == 0) {
+            break;
+        }
+    }
 
-        /* set show_all to TRUE here, as we don't know how many
-         * files we'll end up processing yet.
-         */
-        response = run_warning (job,
-                                primary,
-                                secondary,
-                                details,
-                                TRUE,
-                                GTK_STOCK_CANCEL, SKIP_ALL, SKIP,
-                                NULL);
+    return TRUE;
+}
 
-        if (response == 0 || response == GTK_RESPONSE_DELETE_EVENT) {
-            abort_job (job);
-        } else if (response == 1) { /* skip all */
-            job->skip_all_error = TRUE;
-        } else if (response == 2) { /* skip */
-            /* do nothing */
-        } else {
-            g_assert_not_reached ();
+static gboolean
+pwrite_full (int fd, const char *buf, gsize count, off_t offset)
+{
+    gsize done;
+    ssize_t n;
+
+    for (done = 0; done < count; done += n) {
+        n = pwrite (fd, buf + done, count - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+        } else if (n <= 0) {
+            return FALSE;
         }
-skip1:
-        g_error_free (error);
+    }
 
-        stop = TRUE;
+    return TRUE;
+}
+
+/* The old @dest is cloned (FICLONE) into a temporary file, only the blocks that differ
+ * are written to that, and it is then renamed over @dest. So an interrupted update
+ * leaves the old @dest whole, and other hardlinks of it keep the old data as they would
+ * with g_file_copy (). Without clones there is nothing to gain over a full copy.
+ * Returns FALSE when g_file_copy () has to do it, @dest is then unchanged.
+ */
+static gboolean
+copy_file_delta (GFile *src,
+                 GFile *dest,
+                 GFileCopyFlags flags,
+                 GCancellable *cancellable,
+                 ProgressData *pdata,
+                 goffset *written)
+{
+#ifdef FICLONE
+    char *src_path, *dest_path, *tmp_path = NULL, *src_buf = NULL, *dest_buf = NULL;
+    struct stat src_st, dest_st;
+    int in_fd = -1, old_fd = -1, out_fd = -1;
+    gsize n_src, n_dest, block, len;
+    off_t offset;
+    gboolean ok = FALSE;
+
+    *written = 0;
+
+    src_path = g_file_get_path (src);
+    dest_path = g_file_get_path (dest);
+    if (src_path == NULL || dest_path == NULL) {
+        goto out;
     }
 
-    if (stop) {
-        return FALSE;
+    in_fd = open (src_path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    old_fd = open (dest_path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (in_fd < 0 || old_fd < 0 ||
+        fstat (in_fd, &src_st) != 0 || fstat (old_fd, &dest_st) != 0 ||
+        !S_ISREG (src_st.st_mode) || !S_ISREG (dest_st.st_mode) ||
+        src_st.st_size < DELTA_COPY_MIN_SIZE || dest_st.st_size == 0 ||
+        (src_st.st_dev == dest_st.st_dev && src_st.st_ino == dest_st.st_ino)) {
+        goto out;
     }
 
-    error = NULL;
+    out_fd = open_copy_target (dest_path, TRUE,
+                               (flags & G_FILE_COPY_TARGET_DEFAULT_PERMS) ? 0666 : (src_st.st_mode & 07777),
+                               &tmp_path);
+    if (out_fd < 0 || ioctl (out_fd, FICLONE, old_fd) != 0) {
+        goto out;
+    }
 
-    if (!g_file_delete (file, job->cancellable, &error)) {
-        if (job->skip_all_error ||
-            IS_IO_ERROR (error, CANCELLED)) {
-            goto skip2;
+    src_buf = g_malloc (DELTA_COPY_CHUNK_SIZE);
+    dest_buf = g_malloc (DELTA_COPY_CHUNK_SIZE);
+
+    for (offset = 0; offset < src_st.st_size; offset += n_src) {
+        if (g_cancellable_is_cancelled (cancellable) ||
+            !pread_full (in_fd, src_buf, DELTA_COPY_CHUNK_SIZE, offset, &n_src) ||
+            !pread_full (old_fd, dest_buf, n_src, offset, &n_dest)) {
+            goto out;
         }
-        primary = f (_("Error while copying \"%B\"."), src);
-        secondary = f (_("Could not remove the already existing file %F."), file);
-        details = error->message;
 
-        /* set show_all to TRUE here, as we don't know how many
-         * files we'll end up processing yet.
-         */
-        response = run_warning (job,
-                                primary,
-                                secondary,
-                                details,
-                                TRUE,
-                                GTK_STOCK_CANCEL, SKIP_ALL, SKIP,
-                                NULL);
+        if (n_src == 0) {
+            break;
+        }
 
-        if (response == 0 || response == GTK_RESPONSE_DELETE_EVENT) {
-            abort_job (job);
-        } else if (response == 1) { /* skip all */
-            job->skip_all_error = TRUE;
-        } else if (response == 2) { /* skip */
-            /* do nothing */
-        } else {
-            g_assert_not_reached ();
+        for (block = 0; block < n_src; block += DELTA_COPY_BLOCK_SIZE) {
+            len = MIN (DELTA_COPY_BLOCK_SIZE, n_src - block);
+            if (block + len <= n_dest && memcmp (src_buf + block, dest_buf + block, len) == 0) {
+                continue;
+            }
+
+            if (!pwrite_full (out_fd, src_buf + block, len, offset + block)) {
+                goto out;
+            }
+            *written += len;
         }
 
-skip2:
-        g_error_free (error);
+        copy_file_progress_callback (offset + n_src, src_st.st_size, pdata);
+    }
 
-        return FALSE;
+    ok = ftruncate (out_fd, offset) == 0;
+
+out:
+    if (in_fd >= 0) {
+        close (in_fd);
+    }
+    if (old_fd >= 0) {
+        close (old_fd);
+    }
+    if (out_fd >= 0 && !close_copy_target (out_fd, dest_path, tmp_path, ok)) {
+        ok = FALSE;
     }
-    marlin_file_changes_queue_file_removed (file);
 
-    return TRUE;
+    if (ok) {
+        /* The data is new, the times and permissions have to be too */
+        g_file_copy_attributes (src, dest,
+                                flags & (G_FILE_COPY_NOFOLLOW_SYMLINKS | G_FILE_COPY_TARGET_DEFAULT_PERMS),
+                                cancellable, NULL);
+    }
+
+    g_free (src_buf);
+    g_free (dest_buf);
+    g_free (src_path);
+    g_free (dest_path);
 
+    return ok;
+#else
+    *written = 0;
+    return FALSE;
+#endif
 }
 
+/* Large local files that could not be copied in the kernel are streamed through two
+ * big aligned buffers: the job thread reads one while a writer thread writes the other.
+ * Both files are hinted as read once, and what was written is pushed out and dropped
+ * from the page cache as the copy goes, so the copy does not evict everything else.
+ */
+#define STREAM_COPY_BUFFER_SIZE (8 * 1024 * 1024)
+#define STREAM_COPY_ALIGNMENT 4096
+
 typedef struct {
-    CopyMoveJob *job;
-    goffset last_size;
-    SourceInfo *source_info;
-    TransferInfo *transfer_info;
-} ProgressData;
+    int out_fd;
+    GAsyncQueue *full;          /* chunks to write */
+    GAsyncQueue *empty;         /* chunks to read into */
+    volatile gint failed;
+    goffset written;            /* end of what was written, in order */
+} StreamCopy;
 
 static void
-copy_file_progress_callback (goffset current_num_bytes,
-                             goffset total_num_bytes,
-                             gpointer user_data)
+stream_copy_drop_written (int fd, off_t offset, gsize len)
 {
-    ProgressData *pdata;
-    goffset new_size;
-
-    pdata = user_data;
-
-    new_size = current_num_bytes - pdata->last_size;
+#ifdef __linux__
+    /* Start writing this chunk out and wait for the previous one, which is clean then */
+    sync_file_range (fd, offset, len, SYNC_FILE_RANGE_WRITE);
+    if (offset >= STREAM_COPY_BUFFER_SIZE) {
+        sync_file_range (fd, offset - STREAM_COPY_BUFFER_SIZE, STREAM_COPY_BUFFER_SIZE,
+                         SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise (fd, offset - STREAM_COPY_BUFFER_SIZE, STREAM_COPY_BUFFER_SIZE, POSIX_FADV_DONTNEED);
+    }
+#endif
+}
 
-    if (new_size > 0) {
-        pdata->transfer_info->num_bytes += new_size;
-        pdata->last_size = current_num_bytes;
-        report_copy_progress (pdata->job,
-                              pdata->source_info,
-                              pdata->transfer_info);
+static gpointer
+stream_copy_writer (gpointer data)
+{
+    StreamCopy *copy = data;
+    StreamChunk *chunk;
+
+    while ((chunk = g_async_queue_pop (copy->full))->len > 0) {
+        if (!g_atomic_int_get (&copy->failed)) {
+            if (pwrite_full (copy->out_fd, chunk->data, chunk->len, chunk->offset)) {
+                stream_copy_drop_written (copy->out_fd, chunk->offset, chunk->len);
+                counter_store (&copy->written, (goffset) (chunk->offset + chunk->len));
+            } else {
+                g_atomic_int_set (&copy->failed, 1);
+            }
+        }
+        stream_chunk_release (chunk);
     }
+
+    return NULL;
 }
 
+/* Returns FALSE, with @dest as it was, when g_file_copy () should be used. A non-zero
+ * @resume_from continues the copy the job left at @dest from there, in place. A replace
+ * is streamed into a temporary file, see open_copy_target (). With @hash the data is
+ * hashed on the way, for verify_copied_file ().
+ */
 static gboolean
-test_dir_is_parent (GFile *child, GFile *root)
+copy_file_streaming (GFile *src,
+                     GFile *dest,
+                     GFileCopyFlags flags,
+                     GCancellable *cancellable,
+                     ProgressData *pdata,
+                     goffset resume_from,
+                     guint64 *hash,
+                     goffset *size)
 {
-    GFile *f = child;
-    GFile *prev = NULL;
+    char *src_path, *dest_path, *tmp_path = NULL;
+    struct stat st, dest_st;
+    int in_fd = -1;
+    StreamCopy copy = { -1, NULL, NULL, 0, 0 };
+    StreamChunk chunks[2], stop = { NULL, 0, 0, 0, NULL }, *chunk;
+    ChunkHasher hasher;
+    gboolean write_chunk;
+    GThread *writer;
+    off_t offset = 0;
+    guint i;
+    gboolean ok = FALSE;
+
+    memset (chunks, 0, sizeof (chunks));
+
+    src_path = g_file_get_path (src);
+    dest_path = g_file_get_path (dest);
+    if (src_path == NULL || dest_path == NULL) {
+        goto out;
+    }
 
-    if (g_file_equal (child, root))
-        return TRUE;
+    in_fd = open (src_path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (in_fd < 0 || fstat (in_fd, &st) != 0 || !S_ISREG (st.st_mode) || st.st_size < STREAM_COPY_MIN_SIZE) {
+        goto out;
+    }
 
-    while ((f = g_file_get_parent (f))) {
-        if (prev) g_object_unref (prev);
+    for (i = 0; i < G_N_ELEMENTS (chunks); i++) {
+        if (posix_memalign ((void **) &chunks[i].data, STREAM_COPY_ALIGNMENT, STREAM_COPY_BUFFER_SIZE) != 0) {
+            goto out;
+        }
+    }
 
-        if (g_file_equal (f, root)) {
-            g_object_unref (f);
-            return TRUE;
+    if (resume_from > 0) {
+        copy.out_fd = open (dest_path, O_WRONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (copy.out_fd >= 0 &&
+            (fstat (copy.out_fd, &dest_st) != 0 || !S_ISREG (dest_st.st_mode) ||
+             dest_st.st_size < resume_from || resume_from > st.st_size)) {
+            /* Not what was left behind, start over */
+            close (copy.out_fd);
+            copy.out_fd = -1;
+            resume_from = 0;
         }
-        prev = f;
     }
-    if (prev) g_object_unref (prev);
 
-    return FALSE;
-}
+    /* Without OVERWRITE an existing dest is left for g_file_copy () to report */
+    if (copy.out_fd < 0) {
+        copy.out_fd = open_copy_target (dest_path, (flags & G_FILE_COPY_OVERWRITE) != 0,
+                                        (flags & G_FILE_COPY_TARGET_DEFAULT_PERMS) ? 0666 : (st.st_mode & 07777),
+                                        &tmp_path);
+    }
+    if (copy.out_fd < 0) {
+        goto out;
+    }
 
-static char *
-query_fs_type (GFile *file,
-               GCancellable *cancellable)
-{
-    GFileInfo *fsinfo;
-    char *ret;
+    /* What was copied before still has to be hashed */
+    offset = hash != NULL ? 0 : resume_from;
+    copy.written = resume_from;
+
+    posix_fadvise (in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    copy.full = g_async_queue_new ();
+    copy.empty = g_async_queue_new ();
+    for (i = 0; i < G_N_ELEMENTS (chunks); i++) {
+        chunks[i].home = copy.empty;
+        g_async_queue_push (copy.empty, &chunks[i]);
+    }
+    writer = g_thread_new ("stream-copy", stream_copy_writer, &copy);
+    if (hash != NULL) {
+        chunk_hasher_start (&hasher);
+    }
+
+    while (offset < st.st_size && !g_cancellable_is_cancelled (cancellable) && !g_atomic_int_get (&copy.failed)) {
+        chunk = g_async_queue_pop (copy.empty);
+        if (!pread_full (in_fd, chunk->data, STREAM_COPY_BUFFER_SIZE, offset, &chunk->len) || chunk->len == 0) {
+            g_async_queue_push (copy.empty, chunk);
+            break;
+        }
+        /* Read once, it is not going to be needed again */
+        posix_fadvise (in_fd, offset, chunk->len, POSIX_FADV_DONTNEED);
+
+        chunk->offset = offset;
+        offset += chunk->len;
+        write_chunk = offset > resume_from;
+        chunk->users = (write_chunk ? 1 : 0) + (hash != NULL ? 1 : 0);
+        if (write_chunk) {
+            g_async_queue_push (copy.full, chunk);
+        }
+        if (hash != NULL) {
+            g_async_queue_push (hasher.queue, chunk);
+        }
+
+        copy_file_progress_callback (offset, st.st_size, pdata);
+        /* A temporary file cannot be found again, that copy starts over if interrupted */
+        if (tmp_path == NULL) {
+            copy_journal_checkpoint (pdata->job->journal, src, copy.out_fd, counter_load (&copy.written));
+        }
+    }
+
+    g_async_queue_push (copy.full, &stop);
+    g_thread_join (writer);
+    if (hash != NULL) {
+        *hash = chunk_hasher_finish (&hasher);
+    }
+    g_async_queue_unref (copy.full);
+    g_async_queue_unref (copy.empty);
 
-    ret = NULL;
+    ok = offset == st.st_size && !copy.failed && !g_cancellable_is_cancelled (cancellable);
 
-    fsinfo = g_file_query_filesystem_info (file,
-                                           G_FILE_ATTRIBUTE_FILESYSTEM_TYPE,
-                                           cancellable,
-                                           NULL);
-    if (fsinfo != NULL) {
-        ret = g_strdup (g_file_info_get_attribute_string (fsinfo, G_FILE_ATTRIBUTE_FILESYSTEM_TYPE));
-        g_object_unref (fsinfo);
+    /* A resumed dest may have been longer */
+    if (ok && ftruncate (copy.out_fd, st.st_size) != 0) {
+        ok = FALSE;
     }
 
-    if (ret == NULL) {
-        /* ensure that we don't attempt to query
-         * the FS type for each file in a given
-         * directory, if it can't be queried. */
-        ret = g_strdup ("");
+    if (!close_copy_target (copy.out_fd, dest_path, tmp_path, ok)) {
+        ok = FALSE;
     }
 
-    return ret;
-}
+    if (ok) {
+        *size = st.st_size;
+        g_file_copy_attributes (src, dest,
+                                flags & (G_FILE_COPY_NOFOLLOW_SYMLINKS | G_FILE_COPY_TARGET_DEFAULT_PERMS),
+                                cancellable, NULL);
+    }
 
-typedef struct {
-    int id;
-    char *new_name;
-    gboolean apply_to_all;
-} ConflictResponseData;
+out:
+    if (in_fd >= 0) {
+        close (in_fd);
+    }
+    for (i = 0; i < G_N_ELEMENTS (chunks); i++) {
+        free (chunks[i].data);
+    }
+    g_free (src_path);
+    g_free (dest_path);
 
-typedef struct {
-    GFile *src;
-    GFile *dest;
-    GFile *dest_dir;
-    GtkWindow *parent;
-    ConflictResponseData *resp_data;
-} ConflictDialogData;
+    return ok;
+}
+
+/* In update mode a conflicting regular file is left alone when its size and
+ * modification time match the source, and optionally its contents too.
+ */
+#define UPDATE_MTIME_WINDOW 2   /* seconds, FAT only stores even ones */
+#define UPDATE_COMPARE_BUFFER_SIZE (256 * 1024)
 
 static gboolean
-do_run_conflict_dialog (gpointer _data)
+file_contents_equal (GFile *a, GFile *b, GCancellable *cancellable)
 {
-    ConflictDialogData *data = _data;
-    GtkWidget *dialog;
-    int response;
+    GFileInputStream *in_a, *in_b;
+    char *buf_a, *buf_b;
+    gsize n_a, n_b;
+    gboolean equal = FALSE;
+
+    in_a = g_file_read (a, cancellable, NULL);
+    in_b = g_file_read (b, cancellable, NULL);
+    if (in_a == NULL || in_b == NULL) {
+        goto out;
+    }
 
-    dialog = marlin_file_conflict_dialog_new (data->parent,
-                                              data->src,
-                                              data->dest,
-                                              data->dest_dir);
-    response = gtk_dialog_run (GTK_DIALOG (dialog));
+    buf_a = g_malloc (UPDATE_COMPARE_BUFFER_SIZE);
+    buf_b = g_malloc (UPDATE_COMPARE_BUFFER_SIZE);
 
-    if (response == MARLIN_FILE_CONFLICT_DIALOG_RESPONSE_TYPE_RENAME) {
-        data->resp_data->new_name =
-            marlin_file_conflict_dialog_get_new_name (MARLIN_FILE_CONFLICT_DIALOG (dialog));
-    } else if (response != GTK_RESPONSE_CANCEL ||
-               response != GTK_RESPONSE_NONE) {
-        data->resp_data->apply_to_all =
-            marlin_file_conflict_dialog_get_apply_to_all
-            (MARLIN_FILE_CONFLICT_DIALOG (dialog));
+    while (g_input_stream_read_all (G_INPUT_STREAM (in_a), buf_a, UPDATE_COMPARE_BUFFER_SIZE,
+                                    &n_a, cancellable, NULL) &&
+           g_input_stream_read_all (G_INPUT_STREAM (in_b), buf_b, UPDATE_COMPARE_BUFFER_SIZE,
+                                    &n_b, cancellable, NULL)) {
+        if (n_a != n_b || memcmp (buf_a, buf_b, n_a) != 0) {
+            break;
+        }
+        if (n_a < UPDATE_COMPARE_BUFFER_SIZE) {
+            equal = TRUE;
+            break;
+        }
     }
 
-    data->resp_data->id = response;
+    g_free (buf_a);
+    g_free (buf_b);
 
-    gtk_widget_destroy (dialog);
+out:
+    g_clear_object (&in_a);
+    g_clear_object (&in_b);
 
-    return FALSE;
+    return equal;
 }
 
-static ConflictResponseData *
-run_conflict_dialog (CommonJob *job,
-                     GFile *src,
-                     GFile *dest,
-                     GFile *dest_dir)
+static gboolean
+file_is_unchanged (CommonJob *job, GFile *src, GFile *dest, goffset *size)
 {
-    ConflictDialogData *data;
-    ConflictResponseData *resp_data;
-
-    g_timer_stop (job->time);
-
-    data = g_slice_new0 (ConflictDialogData);
-    data->parent = job->parent_window;
-    data->src = src;
-    data->dest = dest;
-    data->dest_dir = dest_dir;
+    GFileInfo *src_info, *dest_info;
+    gint64 mtime_diff;
+    gboolean unchanged = FALSE;
+
+    src_info = g_file_query_info (src,
+                                  G_FILE_ATTRIBUTE_STANDARD_TYPE ","
+                                  G_FILE_ATTRIBUTE_STANDARD_SIZE ","
+                                  G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                                  G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                  job->cancellable, NULL);
+    dest_info = g_file_query_info (dest,
+                                   G_FILE_ATTRIBUTE_STANDARD_TYPE ","
+                                   G_FILE_ATTRIBUTE_STANDARD_SIZE ","
+                                   G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                                   G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                   job->cancellable, NULL);
+    if (src_info == NULL || dest_info == NULL ||
+        g_file_info_get_file_type (src_info) != G_FILE_TYPE_REGULAR ||
+        g_file_info_get_file_type (dest_info) != G_FILE_TYPE_REGULAR) {
+        goto out;
+    }
 
-    resp_data = g_slice_new0 (ConflictResponseData);
-    resp_data->new_name = NULL;
-    data->resp_data = resp_data;
+    *size = g_file_info_get_size (src_info);
+    mtime_diff = (gint64) g_file_info_get_attribute_uint64 (src_info, G_FILE_ATTRIBUTE_TIME_MODIFIED) -
+                 (gint64) g_file_info_get_attribute_uint64 (dest_info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
 
-    pf_progress_info_pause (job->progress);
-    g_io_scheduler_job_send_to_mainloop (job->io_job,
-                                         do_run_conflict_dialog,
-                                         data,
-                                         NULL);
+    unchanged = *size == g_file_info_get_size (dest_info) && ABS (mtime_diff) <= UPDATE_MTIME_WINDOW;
+    if (unchanged && job->update_compare_contents) {
+        unchanged = file_contents_equal (src, dest, job->cancellable);
+    }
 
-    pf_progress_info_resume (job->progress);
-    g_slice_free (ConflictDialogData, data);
-    g_timer_continue (job->time);
+out:
+    g_clear_object (&src_info);
+    g_clear_object (&dest_info);
 
-    return resp_data;
+    return unchanged;
 }
 
 static void
-conflict_response_data_free (ConflictResponseData *data)
+report_unchanged_file (CopyMoveJob *copy_job,
+                       SourceInfo *source_info,
+                       TransferInfo *transfer_info,
+                       goffset size)
 {
-    g_free (data->new_name);
-    g_slice_free (ConflictResponseData, data);
-}
-
-static GFile *
-get_target_file_for_display_name (GFile *dir,
-                                  char *name)
-{
-    GFile *dest;
-
-    dest = NULL;
-    dest = g_file_get_child_for_display_name (dir, name, NULL);
-
-    if (dest == NULL) {
-        dest = g_file_get_child (dir, name);
-    }
-
-    return dest;
+    transfer_info->num_files++;
+    transfer_info->num_bytes += size;
+    transfer_info->skipped_bytes += size;
+    report_copy_progress (copy_job, source_info, transfer_info);
 }
 
 /* Debuting files is non-NULL only for toplevel items */
@@ -3886,8 +8058,18 @@ copy_move_file (CopyMoveJob *copy_job,
     gboolean res;
     int unique_name_nr;
     gboolean handled_invalid_filename;
+    CopyMethod method;
+    goffset size;
+    InodeKey link_key;
+    goffset delta_written;
+    gint64 stream_start;
+    goffset resume_from;
+    gboolean dest_is_ours, dest_replace;
+    int done_files;
+    guint64 src_hash;
 
     job = (CommonJob *)copy_job;
+    dest_is_ours = FALSE;
 
     if (should_skip_file (job, src)) {
         *skipped_file = TRUE;
@@ -3903,7 +8085,8 @@ copy_move_file (CopyMoveJob *copy_job,
 
     //amtest
     if (unique_names) {
-        dest = get_unique_target_file (src, dest_dir, same_fs, *dest_fs_type, unique_name_nr++);
+        dest = get_unique_target_file (src, dest_dir, same_fs, *dest_fs_type,
+                                       get_name_index (copy_job, dest_dir, FALSE), unique_name_nr++);
     } else {
         dest = get_target_file (src, dest_dir, *dest_fs_type, same_fs);
     }
@@ -3976,6 +8159,28 @@ copy_move_file (CopyMoveJob *copy_job,
         goto out;
     }
 
+    /* Resuming an interrupted job */
+    resume_from = 0;
+    if (copy_journal_is_done (copy_job->journal, src, &done_files, &size)) {
+        /* A finished folder is skipped with everything in it */
+        if (size < 0) {
+            size = query_file_size (src, job->cancellable);
+        }
+        transfer_info->num_files += done_files - 1;
+        report_unchanged_file (copy_job, source_info, transfer_info, size);
+        g_object_unref (dest);
+        return;
+    } else if (copy_journal_was_started (copy_job->journal, src, dest,
+                                         &resume_from, &dest_replace)) {
+        /* A created dest was left there by the job, a replaced one is
+         * still the original until its temporary file is renamed over it */
+        overwrite = TRUE;
+        dest_is_ours = !dest_replace;
+        if (dest_replace) {
+            remove_copy_target_leftovers (dest);
+            resume_from = 0;
+        }
+    }
 
 retry:
 
@@ -3993,6 +8198,12 @@ retry:
     pdata.source_info = source_info;
     pdata.transfer_info = transfer_info;
 
+    method = COPY_METHOD_USERSPACE;
+    link_key.ino = 0;
+
+    copy_journal_file_started (copy_job->journal, src, dest,
+                               overwrite && !dest_is_ours, TRUE);
+
     if (copy_job->is_move) {
         res = g_file_move (src, dest,
                            flags,
@@ -4001,12 +8212,63 @@ retry:
                            &pdata,
                            &error);
     } else {
-        res = g_file_copy (src, dest,
-                           flags,
-                           job->cancellable,
-                           copy_file_progress_callback,
-                           &pdata,
-                           &error);
+        if (job->links != NULL && hardlink_map_link (job->links, src, dest, &link_key)) {
+            /* Its size was only counted for the first link */
+            method = COPY_METHOD_HARDLINK;
+            size = 0;
+        } else if (resume_from > 0) {
+            /* Streamed on from where the interrupted job got to */
+        } else if (overwrite && copy_job->delta_copy &&
+                   copy_file_delta (src, dest, flags, job->cancellable, &pdata, &delta_written)) {
+            method = COPY_METHOD_DELTA;
+            size = pdata.last_size;
+            copy_job->delta_bytes_written += delta_written;
+        } else if (same_fs || (!overwrite && g_file_is_native (src) && g_file_is_native (dest))) {
+            /* Sparse files are worth copying by hand across filesystems too. Replacing
+             * there is left to the streamed copy and g_file_copy () */
+            method = copy_file_in_kernel (src, dest, flags, job->cancellable, &size);
+        }
+
+        if (method == COPY_METHOD_USERSPACE && g_file_is_native (src) && g_file_is_native (dest)) {
+            stream_start = g_get_monotonic_time ();
+            if (copy_file_streaming (src, dest, flags, job->cancellable, &pdata, resume_from,
+                                     copy_job->verify ? &src_hash : NULL, &size)) {
+                method = COPY_METHOD_STREAMED;
+                copy_job->streamed_bytes += size;
+                copy_job->streamed_usec += g_get_monotonic_time () - stream_start;
+            }
+        }
+        resume_from = 0;
+
+        if (method != COPY_METHOD_USERSPACE) {
+            copy_file_progress_callback (size, size, &pdata);
+            res = TRUE;
+        } else {
+            res = g_file_copy (src, dest,
+                               flags,
+                               job->cancellable,
+                               copy_file_progress_callback,
+                               &pdata,
+                               &error);
+        }
+    }
+
+    /* Moves cannot be checked, the source is gone. A new link is a file checked before */
+    if (res && copy_job->verify && !copy_job->is_move && method != COPY_METHOD_HARDLINK) {
+        if (verify_copied_file (src, dest, method == COPY_METHOD_STREAMED ? &src_hash : NULL,
+                                job->cancellable)) {
+            copy_job->n_verified++;
+        } else {
+            /* Not to be mistaken for a good copy */
+            g_file_delete (dest, NULL, NULL);
+            res = FALSE;
+            if (job_aborted (job)) {
+                error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_CANCELLED, "");
+            } else {
+                error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                             _("The copy does not match the original."));
+            }
+        }
     }
 
     /* NOTE Result is false if file being moved is a folder and the target is on a Samba share even if
@@ -4016,6 +8278,7 @@ retry:
     if (res) {
         transfer_info->num_files ++;
         report_copy_progress (copy_job, source_info, transfer_info);
+        copy_journal_file_done (copy_job->journal, src);
 
         if (debuting_files) {
             /*if (position) {
@@ -4030,6 +8293,10 @@ retry:
             marlin_file_changes_queue_file_moved (src, dest);
         } else {
            marlin_file_changes_queue_file_added (dest);
+           count_copy_method (copy_job, method);
+           if (job->links != NULL && link_key.ino != 0 && method != COPY_METHOD_HARDLINK) {
+               hardlink_map_add (job->links, &link_key, dest);
+           }
         }
 
         // Start UNDO-REDO
@@ -4045,10 +8312,11 @@ retry:
         handled_invalid_filename = TRUE;
 
         g_assert (*dest_fs_type == NULL);
-        *dest_fs_type = query_fs_type (dest_dir, job->cancellable);
+        *dest_fs_type = get_dest_fs_type (copy_job, dest_dir);
 
         if (unique_names) {
-            new_dest = get_unique_target_file (src, dest_dir, same_fs, *dest_fs_type, unique_name_nr);
+            new_dest = get_unique_target_file (src, dest_dir, same_fs, *dest_fs_type,
+                                               get_name_index (copy_job, dest_dir, FALSE), unique_name_nr);
         } else {
             new_dest = get_target_file (src, dest_dir, *dest_fs_type, same_fs);
         }
@@ -4056,6 +8324,7 @@ retry:
         if (!g_file_equal (dest, new_dest)) {
             g_object_unref (dest);
             dest = new_dest;
+            dest_is_ours = FALSE;
 
             g_error_free (error);
             goto retry;
@@ -4071,13 +8340,29 @@ retry:
         ConflictResponseData *response;
 
         g_error_free (error);
+        /* A conflicting dest is not ours until the user chose to replace it */
+        copy_journal_file_abandoned (copy_job->journal, src);
 
         if (unique_names) {
             g_object_unref (dest);
-            dest = get_unique_target_file (src, dest_dir, same_fs, *dest_fs_type, unique_name_nr++);
+            /* Taken, so the next names are looked up in the index */
+            dest = get_unique_target_file (src, dest_dir, same_fs, *dest_fs_type,
+                                           get_name_index (copy_job, dest_dir, TRUE), unique_name_nr++);
+            copy_job->n_name_index_misses++;
+            goto retry;
+        }
+
+        /* The dialog said folders are merged, only what conflicts inside them waits for it */
+        if (conflict_preflight_defers (copy_job, src) && is_dir (dest) && is_dir (src)) {
+            overwrite = TRUE;
             goto retry;
         }
 
+        conflict_preflight_wait (copy_job);
+        if (job_aborted (job)) {
+            goto out;
+        }
+
         is_merge = FALSE;
 
         if (is_dir (dest) && is_dir (src)) {
@@ -4090,6 +8375,16 @@ retry:
             goto retry;
         }
 
+        if (job->update_all ||
+            (copy_job->update_scope != NULL && g_file_has_prefix (dest, copy_job->update_scope))) {
+            if (!is_merge && file_is_unchanged (job, src, dest, &size)) {
+                report_unchanged_file (copy_job, source_info, transfer_info, size);
+                goto out;
+            }
+            overwrite = TRUE;
+            goto retry;
+        }
+
         if (job->skip_all_conflict) {
             goto out;
         }
@@ -4141,6 +8436,22 @@ retry:
             } else {
                 goto retry; /* Overwrite conflicting destination file */
             }
+        } else if (response->id == MARLIN_FILE_CONFLICT_DIALOG_RESPONSE_TYPE_UPDATE) {
+            /* Updating a folder updates everything in it, but nothing else */
+            if (response->apply_to_all) {
+                job->update_all = TRUE;
+            } else if (is_merge) {
+                g_clear_object (&copy_job->update_scope);
+                copy_job->update_scope = g_object_ref (dest);
+            }
+            conflict_response_data_free (response);
+
+            if (!is_merge && file_is_unchanged (job, src, dest, &size)) {
+                report_unchanged_file (copy_job, source_info, transfer_info, size);
+                goto out;
+            }
+            overwrite = TRUE;
+            goto retry;
         } else if (response->id == MARLIN_FILE_CONFLICT_DIALOG_RESPONSE_TYPE_RENAME) {
             g_object_unref (dest);
             dest = get_target_file_for_display_name (dest_dir,
@@ -4232,6 +8543,7 @@ retry:
             /* destination changed, since it was an invalid file name */
             g_assert (*dest_fs_type != NULL);
             handled_invalid_filename = TRUE;
+            dest_is_ours = FALSE;
             goto retry;
         }
 
@@ -4291,8 +8603,8 @@ copy_files (CopyMoveJob *job,
     GFile *dest;
     GFile *source_dir;
     char *dest_fs_type;
-    GFileInfo *inf;
     gboolean readonly_source_fs;
+    gboolean deferred;
 
     dest_fs_type = NULL;
     readonly_source_fs = FALSE;
@@ -4304,51 +8616,53 @@ copy_files (CopyMoveJob *job,
     /* Query the source dir, not the file because if its a symlink we'll follow it */
     source_dir = g_file_get_parent ((GFile *) job->files->data);
     if (source_dir) {
-        inf = g_file_query_filesystem_info (source_dir, "filesystem::readonly", NULL, NULL);
-        if (inf != NULL) {
-            readonly_source_fs = g_file_info_get_attribute_boolean (inf, "filesystem::readonly");
-            g_object_unref (inf);
-        }
+        readonly_source_fs = get_fs_caps (job, source_dir, 1)->readonly;
         g_object_unref (source_dir);
     }
 
     unique_names = (job->destination == NULL);
-    i = 0;
-    for (l = job->files;
-         l != NULL && !job_aborted (common);
-         l = l->next) {
-        src = l->data;
+    /* Conflicting items go last, so the rest is copied while the preflight dialog is open */
+    for (deferred = FALSE; deferred <= TRUE && !job_aborted (common); deferred++) {
+        i = 0;
+        for (l = job->files;
+             l != NULL && !job_aborted (common);
+             l = l->next, i++) {
+            src = l->data;
 
-        if (i < job->n_icon_positions) {
-            point = &job->icon_positions[i];
-        } else {
-            point = NULL;
-        }
+            if (conflict_preflight_defers (job, src) != deferred) {
+                continue;
+            }
+
+            if (i < job->n_icon_positions) {
+                point = &job->icon_positions[i];
+            } else {
+                point = NULL;
+            }
 
 
-        same_fs = FALSE;
-        if (dest_fs_id) {
-            same_fs = has_fs_id (src, dest_fs_id);
-        }
+            same_fs = FALSE;
+            if (dest_fs_id) {
+                same_fs = has_fs_id (src, dest_fs_id);
+            }
 
-        if (job->destination) {
-            dest = g_object_ref (job->destination);
-        } else {
-            dest = g_file_get_parent (src);
+            if (job->destination) {
+                dest = g_object_ref (job->destination);
+            } else {
+                dest = g_file_get_parent (src);
 
+            }
+            if (dest) {
+                skipped_file = FALSE;
+                copy_move_file (job, src, dest,
+                                same_fs, unique_names,
+                                &dest_fs_type,
+                                source_info, transfer_info,
+                                job->debuting_files,
+                                point, FALSE, &skipped_file,
+                                readonly_source_fs);
+                g_object_unref (dest);
+            }
         }
-        if (dest) {
-            skipped_file = FALSE;
-            copy_move_file (job, src, dest,
-                            same_fs, unique_names,
-                            &dest_fs_type,
-                            source_info, transfer_info,
-                            job->debuting_files,
-                            point, FALSE, &skipped_file,
-                            readonly_source_fs);
-            g_object_unref (dest);
-        }
-        i++;
     }
 
     g_free (dest_fs_type);
@@ -4373,6 +8687,21 @@ copy_job_done (gpointer user_data)
     }*/
     g_hash_table_unref (job->debuting_files);
     g_free (job->icon_positions);
+    g_free (job->resume_journal);
+    if (job->name_indexes != NULL) {
+        g_hash_table_unref (job->name_indexes);
+    }
+    if (job->preflight != NULL) {
+        conflict_preflight_free (job->preflight);
+    }
+    if (job->fs_caps != NULL) {
+        fs_caps_cache_free (job->fs_caps);
+    }
+    g_clear_object (&job->update_scope);
+
+    if (job->copy_pool != NULL) {
+        g_thread_pool_free (job->copy_pool, FALSE, TRUE);
+    }
 
     finalize_common ((CommonJob *)job);
 
@@ -4399,6 +8728,11 @@ copy_job (GIOSchedulerJob *io_job,
     dest_fs_id = NULL;
 
     pf_progress_info_start (job->common.progress);
+    common->manifest = scan_manifest_new ();
+    if (gof_preferences_get_preserve_hardlinks (gof_preferences_get_default ())) {
+        common->links = hardlink_map_new ();
+    }
+    job->delta_copy = gof_preferences_get_delta_copy (gof_preferences_get_default ());
     scan_sources (job->files,
                   &source_info,
                   common,
@@ -4425,6 +8759,14 @@ copy_job (GIOSchedulerJob *io_job,
         goto aborted;
     }
 
+    if (job->destination != NULL) {
+        job->journal = copy_journal_open (job);
+        /* Resumed and updating jobs already know what to do with existing files */
+        if (job->resume_journal == NULL && !common->update_all) {
+            conflict_preflight_run (job, dest_fs_id);
+        }
+    }
+
     g_timer_start (job->common.time);
 
     memset (&transfer_info, 0, sizeof (transfer_info));
@@ -4432,9 +8774,37 @@ copy_job (GIOSchedulerJob *io_job,
                 dest_fs_id,
                 &source_info, &transfer_info);
 
+    g_debug ("%s: %d files cloned, %d copied in kernel, %d copied sparse, %d hardlinked, "
+             "%d updated by delta (%" G_GOFFSET_FORMAT " bytes written), %d copied through userspace",
+             G_STRFUNC, job->n_reflinked, job->n_copied_in_kernel, job->n_copied_sparse,
+             job->n_hardlinked, job->n_delta, job->delta_bytes_written, job->n_copied);
+    if (job->verify) {
+        g_debug ("%s: %d files verified", G_STRFUNC, job->n_verified);
+    }
+    if (job->name_indexes != NULL) {
+        g_debug ("%s: duplicate names picked from %d folder indexes, %d taken meanwhile",
+                 G_STRFUNC, job->n_name_index_dirs, job->n_name_index_misses);
+    }
+    if (job->fs_caps != NULL) {
+        g_debug ("%s: capabilities of %u filesystems read with %d calls, %d calls saved",
+                 G_STRFUNC, job->fs_caps->caps->len, job->fs_caps->n_calls, job->fs_caps->n_calls_saved);
+    }
+    if (job->n_streamed > 0) {
+        g_debug ("%s: %d large files streamed, %" G_GOFFSET_FORMAT " bytes at %.1f MiB/s",
+                 G_STRFUNC, job->n_streamed, job->streamed_bytes,
+                 job->streamed_usec > 0 ? (job->streamed_bytes / 1048576.0) / (job->streamed_usec / (double) G_USEC_PER_SEC) : 0.0);
+    }
+
 aborted:
 
+    copy_journal_finish (job);
     g_free (dest_fs_id);
+    scan_manifest_free (common->manifest);
+    common->manifest = NULL;
+    if (common->links != NULL) {
+        hardlink_map_free (common->links);
+        common->links = NULL;
+    }
 
     g_io_scheduler_job_send_to_mainloop_async (io_job,
                                                copy_job_done,
@@ -4445,19 +8815,30 @@ aborted:
 }
 
 static void
-marlin_file_operations_copy (GList *files,
-                             GArray *relative_item_points,
-                             GFile *target_dir,
-                             GtkWindow *parent_window,
-                             MarlinCopyCallback  done_callback,
-                             gpointer done_callback_data)
+start_copy_job (GList *files,
+                GArray *relative_item_points,
+                GFile *target_dir,
+                GtkWindow *parent_window,
+                MarlinCopyFlags flags,
+                const char *resume_journal,
+                MarlinCopyCallback  done_callback,
+                gpointer done_callback_data)
 {
     CopyMoveJob *job;
     job = op_job_new (JOB_COPY, CopyMoveJob, parent_window);
+    job->common.update_all = (flags & MARLIN_COPY_FLAGS_UPDATE) != 0;
+    job->common.update_compare_contents = (flags & MARLIN_COPY_FLAGS_COMPARE_CONTENTS) != 0;
+    job->verify = (flags & MARLIN_COPY_FLAGS_VERIFY) != 0;
+    if (resume_journal != NULL) {
+        job->resume_journal = g_strdup (resume_journal);
+        /* The folders were created by the interrupted job */
+        job->common.merge_all = TRUE;
+    }
     //job->desktop_location = marlin_get_desktop_location ();
     job->done_callback = done_callback;
     job->done_callback_data = done_callback_data;
     job->files = g_list_copy_deep (files, (GCopyFunc) g_object_ref, NULL);
+    start_progress_sampler ((CommonJob *)job, sample_copy_progress);
     job->destination = g_object_ref (target_dir);
     if (relative_item_points != NULL &&
         relative_item_points->len > 0) {
@@ -4480,11 +8861,20 @@ marlin_file_operations_copy (GList *files,
     }
     // End UNDO-REDO
 
-    g_io_scheduler_push_job (copy_job,
-                             job,
-                             NULL, /* destroy notify */
-                             0,
-                             job->common.cancellable);
+    schedule_job (copy_job, job, (CommonJob *)job, target_dir, G_PRIORITY_DEFAULT);
+}
+
+void
+marlin_file_operations_copy (GList *files,
+                             GArray *relative_item_points,
+                             GFile *target_dir,
+                             GtkWindow *parent_window,
+                             MarlinCopyFlags flags,
+                             MarlinCopyCallback  done_callback,
+                             gpointer done_callback_data)
+{
+    start_copy_job (files, relative_item_points, target_dir, parent_window, flags, NULL,
+                    done_callback, done_callback_data);
 }
 
 static void
@@ -4649,7 +9039,7 @@ retry:
         handled_invalid_filename = TRUE;
 
         g_assert (*dest_fs_type == NULL);
-        *dest_fs_type = query_fs_type (dest_dir, job->cancellable);
+        *dest_fs_type = get_dest_fs_type (move_job, dest_dir);
 
         new_dest = get_target_file (src, dest_dir, *dest_fs_type, same_fs);
         if (!g_file_equal (dest, new_dest)) {
@@ -4669,6 +9059,17 @@ retry:
 
         g_error_free (error);
 
+        /* The dialog said folders are merged, only what conflicts inside them waits for it */
+        if (conflict_preflight_defers (move_job, src) && is_dir (dest) && is_dir (src)) {
+            overwrite = TRUE;
+            goto retry;
+        }
+
+        conflict_preflight_wait (move_job);
+        if (job_aborted (job)) {
+            goto out;
+        }
+
         is_merge = FALSE;
         if (is_dir (dest) && is_dir (src)) {
             is_merge = TRUE;
@@ -4684,6 +9085,15 @@ retry:
             goto out;
         }
 
+        if (job->keep_all_newest) {
+            if (pf_file_utils_compare_modification_dates (src, dest) < 1) {
+                goto out;
+            } else {
+                overwrite = TRUE;
+                goto retry;
+            }
+        }
+
         response = run_conflict_dialog (job, src, dest, dest_dir);
 
         if (response->id == GTK_RESPONSE_CANCEL ||
@@ -4789,6 +9199,7 @@ move_files_prepare (CopyMoveJob *job,
     int i;
     GdkPoint *point;
     int total, left;
+    gboolean deferred;
 
     common = &job->common;
 
@@ -4796,32 +9207,45 @@ move_files_prepare (CopyMoveJob *job,
 
     report_move_progress (job, total, left);
 
-    i = 0;
-    for (l = job->files;
-         l != NULL && !job_aborted (common);
-         l = l->next) {
-        src = l->data;
+    /* Conflicting items go last, as in copy_files () */
+    for (deferred = FALSE; deferred <= TRUE && !job_aborted (common); deferred++) {
+        i = 0;
+        for (l = job->files;
+             l != NULL && !job_aborted (common);
+             l = l->next, i++) {
+            src = l->data;
+
+            if (conflict_preflight_defers (job, src) != deferred) {
+                continue;
+            }
+
+            if (i < job->n_icon_positions) {
+                point = &job->icon_positions[i];
+            } else {
+                point = NULL;
+            }
+
 
-        if (i < job->n_icon_positions) {
-            point = &job->icon_positions[i];
-        } else {
-            point = NULL;
-        }
+            same_fs = FALSE;
+            if (dest_fs_id) {
+                same_fs = has_fs_id (src, dest_fs_id);
+            }
 
+            /* Copied anyway, its conflict is left to the copy so it does not hold up the others */
+            if (deferred && !same_fs) {
+                *fallbacks = g_list_prepend (*fallbacks, move_copy_file_callback_new (src, FALSE, point));
+                report_move_progress (job, total, --left);
+                continue;
+            }
 
-        same_fs = FALSE;
-        if (dest_fs_id) {
-            same_fs = has_fs_id (src, dest_fs_id);
+            move_file_prepare (job, src, job->destination,
+                               same_fs, dest_fs_type,
+                               job->debuting_files,
+                               point,
+                               fallbacks,
+                               left);
+            report_move_progress (job, total, --left);
         }
-
-        move_file_prepare (job, src, job->destination,
-                           same_fs, dest_fs_type,
-                           job->debuting_files,
-                           point,
-                           fallbacks,
-                           left);
-        report_move_progress (job, total, --left);
-        i++;
     }
 
     *fallbacks = g_list_reverse (*fallbacks);
@@ -4893,6 +9317,14 @@ move_job_done (gpointer user_data)
     g_object_unref (job->destination);
     g_hash_table_unref (job->debuting_files);
     g_free (job->icon_positions);
+    g_free (job->resume_journal);
+    if (job->preflight != NULL) {
+        conflict_preflight_free (job->preflight);
+    }
+    if (job->fs_caps != NULL) {
+        fs_caps_cache_free (job->fs_caps);
+    }
+    g_clear_object (&job->update_scope);
 
     finalize_common ((CommonJob *)job);
 
@@ -4932,6 +9364,10 @@ move_job (GIOSchedulerJob *io_job,
         goto aborted;
     }
 
+    if (job->resume_journal == NULL) {
+        conflict_preflight_run (job, dest_fs_id);
+    }
+
     /* This moves all files that we can do without copy + delete */
     move_files_prepare (job, dest_fs_id, &dest_fs_type, &fallbacks);
     if (job_aborted (common)) {
@@ -4961,13 +9397,23 @@ move_job (GIOSchedulerJob *io_job,
         goto aborted;
     }
 
+    if (fallbacks != NULL) {
+        job->journal = copy_journal_open (job);
+    }
+
     memset (&transfer_info, 0, sizeof (transfer_info));
     move_files (job,
                 fallbacks,
                 dest_fs_id, &dest_fs_type,
                 &source_info, &transfer_info);
 
+    if (job->fs_caps != NULL) {
+        g_debug ("%s: capabilities of %u filesystems read with %d calls, %d calls saved",
+                 G_STRFUNC, job->fs_caps->caps->len, job->fs_caps->n_calls, job->fs_caps->n_calls_saved);
+    }
+
 aborted:
+    copy_journal_finish (job);
     g_list_free_full (fallbacks, g_free);
 
     g_free (dest_fs_id);
@@ -4986,15 +9432,23 @@ marlin_file_operations_move (GList *files,
                              GArray *relative_item_points,
                              GFile *target_dir,
                              GtkWindow *parent_window,
+                             const char *resume_journal,
                              MarlinCopyCallback  done_callback,
                              gpointer done_callback_data)
 {
     CopyMoveJob *job;
+    char *src_id, *dest_id;
+
     job = op_job_new (JOB_MOVE, CopyMoveJob, parent_window);
     job->is_move = TRUE;
+    if (resume_journal != NULL) {
+        job->resume_journal = g_strdup (resume_journal);
+        job->common.merge_all = TRUE;
+    }
     job->done_callback = done_callback;
     job->done_callback_data = done_callback_data;
     job->files = g_list_copy_deep (files, (GCopyFunc) g_object_ref, NULL);
+    start_progress_sampler ((CommonJob *)job, sample_copy_progress);
     job->destination = g_object_ref (target_dir);
     if (relative_item_points != NULL &&
         relative_item_points->len > 0) {
@@ -5020,11 +9474,186 @@ marlin_file_operations_move (GList *files,
     }
     // End UNDO-REDO
 
-    g_io_scheduler_push_job (move_job,
-                             job,
-                             NULL, /* destroy notify */
-                             0,
-                             job->common.cancellable);
+    /* Moves within a local filesystem are renames, no need to wait for the device */
+    src_id = get_device_id (files->data);
+    dest_id = get_device_id (target_dir);
+    if (g_file_is_native (target_dir) && strcmp (src_id, dest_id) == 0) {
+        g_io_scheduler_push_job (move_job,
+                                 job,
+                                 NULL, /* destroy notify */
+                                 0,
+                                 job->common.cancellable);
+    } else {
+        schedule_job (move_job, job, (CommonJob *)job, target_dir, G_PRIORITY_DEFAULT);
+    }
+    g_free (src_id);
+    g_free (dest_id);
+}
+
+GList *
+marlin_file_operations_get_interrupted_copies (void)
+{
+    GList *journals = NULL;
+    GDir *dir;
+    const char *name;
+    char *dir_path, *path;
+    int fd;
+
+    dir_path = copy_journal_get_dir ();
+    dir = g_dir_open (dir_path, 0, NULL);
+    if (dir == NULL) {
+        g_free (dir_path);
+        return NULL;
+    }
+
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        /* Left over by a compaction that did not finish */
+        if (name[0] == '.') {
+            continue;
+        }
+
+        path = g_build_filename (dir_path, name, NULL);
+        fd = open (path, O_RDONLY | O_CLOEXEC);
+        /* The journals of running jobs are locked */
+        if (fd >= 0 && flock (fd, LOCK_SH | LOCK_NB) == 0) {
+            journals = g_list_prepend (journals, path);
+        } else {
+            g_free (path);
+        }
+        if (fd >= 0) {
+            close (fd);
+        }
+    }
+
+    g_dir_close (dir);
+    g_free (dir_path);
+
+    return journals;
+}
+
+char *
+marlin_file_operations_describe_interrupted_copy (const char *journal)
+{
+    gboolean is_move;
+    GFile *dest;
+    GList *files;
+    char *s;
+    int n_files;
+
+    if (!copy_journal_load_header (journal, &is_move, NULL, &dest, &files)) {
+        return NULL;
+    }
+
+    n_files = g_list_length (files);
+    if (n_files == 1) {
+        s = f (is_move ? _("Moving \"%B\" to \"%B\"") : _("Copying \"%B\" to \"%B\""),
+               (GFile *)files->data, dest);
+    } else {
+        s = f (is_move ? ngettext ("Moving %'d file to \"%B\"",
+                                   "Moving %'d files to \"%B\"",
+                                   n_files)
+                       : ngettext ("Copying %'d file to \"%B\"",
+                                   "Copying %'d files to \"%B\"",
+                                   n_files),
+               n_files, dest);
+    }
+
+    g_object_unref (dest);
+    g_list_free_full (files, g_object_unref);
+
+    return s;
+}
+
+void
+marlin_file_operations_resume_copy (const char *journal,
+                                    GtkWindow *parent_window,
+                                    MarlinCopyCallback done_callback,
+                                    gpointer done_callback_data)
+{
+    gboolean is_move;
+    MarlinCopyFlags flags;
+    GFile *dest;
+    GList *files, *l, *next;
+
+    /* The rest is read by the job */
+    if (!copy_journal_load_header (journal, &is_move, &flags, &dest, &files)) {
+        g_unlink (journal);
+        return;
+    }
+
+    if (is_move) {
+        /* What was moved already is not there anymore */
+        for (l = files; l != NULL; l = next) {
+            next = l->next;
+            if (!g_file_query_exists (l->data, NULL)) {
+                g_object_unref (l->data);
+                files = g_list_delete_link (files, l);
+            }
+        }
+    }
+
+    if (files == NULL) {
+        g_unlink (journal);
+    } else if (is_move) {
+        marlin_file_operations_move (files, NULL, dest, parent_window, journal,
+                                     done_callback, done_callback_data);
+    } else {
+        start_copy_job (files, NULL, dest, parent_window, flags, journal,
+                        done_callback, done_callback_data);
+    }
+
+    g_object_unref (dest);
+    g_list_free_full (files, g_object_unref);
+}
+
+static gboolean
+discard_interrupted_copy_job (GIOSchedulerJob *io_job,
+                              GCancellable *cancellable,
+                              gpointer user_data)
+{
+    const char *journal = user_data;
+    GHashTable *started;
+    GHashTableIter iter;
+    const char *src_uri;
+    CopyJournalEntry *entry;
+    GFile *src, *dest;
+
+    started = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                     (GDestroyNotify) copy_journal_entry_free);
+
+    /* Files the job was writing when it stopped are incomplete. Unless their source
+     * is still there they may have been complete moves whose end was not recorded.
+     * A replaced dest is the user's own until the job renamed over it, so only the
+     * temporary file it was writing goes */
+    copy_journal_load (journal, NULL, started);
+    g_hash_table_iter_init (&iter, started);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &src_uri, (gpointer *) &entry)) {
+        src = g_file_new_for_uri (src_uri);
+        dest = g_file_new_for_uri (entry->dest_uri);
+        if (entry->replace) {
+            remove_copy_target_leftovers (dest);
+        } else if (g_file_query_exists (src, NULL) &&
+                   g_file_query_file_type (dest, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL) == G_FILE_TYPE_REGULAR) {
+            g_file_delete (dest, NULL, NULL);
+        }
+        g_object_unref (src);
+        g_object_unref (dest);
+    }
+
+    g_hash_table_unref (started);
+    g_unlink (journal);
+
+    return FALSE;
+}
+
+void
+marlin_file_operations_discard_interrupted_copy (const char *journal)
+{
+    g_io_scheduler_push_job (discard_interrupted_copy_job,
+                             g_strdup (journal),
+                             g_free,
+                             G_PRIORITY_DEFAULT,
+                             NULL);
 }
 
 static void
@@ -5363,6 +9992,7 @@ marlin_file_operations_duplicate (GList *files,
     job->done_callback = done_callback;
     job->done_callback_data = done_callback_data;
     job->files = g_list_copy_deep (files, (GCopyFunc) g_object_ref, NULL);
+    start_progress_sampler ((CommonJob *)job, sample_copy_progress);
     job->destination = NULL;
     if (relative_item_points != NULL &&
         relative_item_points->len > 0) {
@@ -5383,11 +10013,7 @@ marlin_file_operations_duplicate (GList *files,
     }
     // End UNDO-REDO
 
-    g_io_scheduler_push_job (copy_job,
-                             job,
-                             NULL, /* destroy notify */
-                             0,
-                             job->common.cancellable);
+    schedule_job (copy_job, job, (CommonJob *)job, files->data, G_PRIORITY_DEFAULT);
 }
 
 #if 0  /* TODO: Implement recursive permissions in PropertiesWindow.vala - may use this code */
@@ -5628,6 +10254,7 @@ marlin_file_operations_copy_move_link   (GList                  *files,
                                          relative_item_points,
                                          target_dir,
                                          parent_window,
+                                         MARLIN_COPY_FLAGS_NONE,
                                          (MarlinCopyCallback)done_callback,
                                          done_callback_data);
         }
@@ -5649,6 +10276,7 @@ marlin_file_operations_copy_move_link   (GList                  *files,
                                          relative_item_points,
                                          target_dir,
                                          parent_window,
+                                         NULL,
                                          (MarlinCopyCallback)done_callback,
                                          done_callback_data);
         }
@@ -6085,6 +10713,336 @@ marlin_file_operations_new_file (GtkWidget *parent_view,
 }
 
 
+/* Emptying a local trash only renames its files and info folders into a hidden folder
+ * beside them and recreates them empty, so the trash is empty as soon as the user confirms.
+ * The renamed folders are removed by a low priority background job; whatever it did not
+ * get to is picked up again by marlin_file_operations_resume_trash_expunge ().
+ */
+#define TRASH_EXPUNGE_DIR ".io.elementary.files-expunged"
+#define TRASH_STAGED_PREFIX "staged-"
+
+G_LOCK_DEFINE_STATIC (trash_expunge);
+
+static GList *
+add_trash_roots (GList *roots, GList *dirs)
+{
+    GList *l;
+    GFile *parent;
+    char *path;
+
+    for (l = dirs; l != NULL; l = l->next) {
+        parent = g_file_get_parent (l->data);
+        if (parent == NULL) {
+            continue;
+        }
+
+        path = g_file_get_path (parent);
+        if (path != NULL && g_list_find_custom (roots, path, (GCompareFunc) strcmp) == NULL) {
+            roots = g_list_prepend (roots, path);
+        } else {
+            g_free (path);
+        }
+        g_object_unref (parent);
+    }
+
+    return roots;
+}
+
+/* Must be called from the main thread as it goes through the volume monitor */
+static GList *
+get_trash_roots (GList *dirs)
+{
+    GVolumeMonitor *monitor;
+    GList *mounts, *mount_dirs, *l, *roots;
+
+    if (dirs != NULL) {
+        return add_trash_roots (NULL, dirs);
+    }
+
+    roots = g_list_prepend (NULL, g_build_filename (g_get_user_data_dir (), "Trash", NULL));
+
+    monitor = g_volume_monitor_get ();
+    mounts = g_volume_monitor_get_mounts (monitor);
+    for (l = mounts; l != NULL; l = l->next) {
+        mount_dirs = get_trash_dirs_for_mount (l->data);
+        roots = add_trash_roots (roots, mount_dirs);
+        g_list_free_full (mount_dirs, g_object_unref);
+    }
+    g_list_free_full (mounts, g_object_unref);
+    g_object_unref (monitor);
+
+    return roots;
+}
+
+/* Renames @src into @expunged. A missing @src has nothing to stage. A running expunge
+ * may remove @expunged at any time, so it is created again if the rename misses it.
+ */
+static gboolean
+stage_trash_subdir (const char *src, const char *expunged, const char *dst)
+{
+    struct stat st;
+    int attempt;
+
+    for (attempt = 0; attempt < 3; attempt++) {
+        if (g_mkdir (expunged, 0700) != 0 && errno != EEXIST) {
+            return FALSE;
+        }
+
+        if (rename (src, dst) == 0) {
+            return TRUE;
+        } else if (errno != ENOENT) {
+            return FALSE;
+        } else if (lstat (src, &st) != 0 && errno == ENOENT) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static gboolean
+stage_trash_root (const char *root)
+{
+    const char *subdirs[] = { "info", "files" };
+    char *expunged, *stamp, *name, *src, *dst, *sizes;
+    gboolean ok = TRUE;
+    guint i;
+
+    expunged = g_build_filename (root, TRASH_EXPUNGE_DIR, NULL);
+
+    /* Info goes first: trashing writes the info before moving the file in. Files trashed
+     * here cannot come in between, but another process can still trash a file whose info
+     * stays behind while the file is staged, see clear_orphaned_trash_info () */
+    G_LOCK (home_trash);
+    stamp = g_strdup_printf ("%" G_GINT64_FORMAT, g_get_real_time ());
+    for (i = 0; ok && i < G_N_ELEMENTS (subdirs); i++) {
+        src = g_build_filename (root, subdirs[i], NULL);
+        name = g_strconcat (subdirs[i], "-", stamp, NULL);
+        dst = g_build_filename (expunged, name, NULL);
+
+        if (stage_trash_subdir (src, expunged, dst)) {
+            ok = g_mkdir (src, 0700) == 0 || errno == EEXIST;
+        } else {
+            ok = FALSE;
+        }
+
+        g_free (src);
+        g_free (name);
+        g_free (dst);
+    }
+    home_trash_generation++;
+    G_UNLOCK (home_trash);
+
+    /* The cached folder sizes describe what was just emptied */
+    if (ok) {
+        sizes = g_build_filename (root, "directorysizes", NULL);
+        g_unlink (sizes);
+        g_free (sizes);
+
+        /* When the staging was done, for clear_orphaned_trash_info () */
+        name = g_strdup_printf ("%s/" TRASH_STAGED_PREFIX "%" G_GINT64_FORMAT, expunged, g_get_real_time ());
+        g_mkdir (name, 0700);
+        g_free (name);
+    }
+
+    g_debug ("%s trash %s", ok ? "Staged" : "Could not stage", root);
+
+    g_free (stamp);
+    g_free (expunged);
+
+    return ok;
+}
+
+/* Removes the info of files that went with a staged trash while their info did not.
+ * Only info older than the last staging is looked at, anything newer may belong to a
+ * file that is still being moved into the trash */
+static void
+clear_orphaned_trash_info (const char *root)
+{
+    GDir *dir;
+    const char *name;
+    char *path, *info_path, *file_name, *file_path, *end;
+    struct stat st;
+    gint64 staged = 0, stamp;
+
+    path = g_build_filename (root, TRASH_EXPUNGE_DIR, NULL);
+    dir = g_dir_open (path, 0, NULL);
+    g_free (path);
+    while (dir != NULL && (name = g_dir_read_name (dir)) != NULL) {
+        if (g_str_has_prefix (name, TRASH_STAGED_PREFIX)) {
+            stamp = g_ascii_strtoll (name + strlen (TRASH_STAGED_PREFIX), &end, 10);
+            if (*end == '\0') {
+                staged = MAX (staged, stamp);
+            }
+        }
+    }
+    if (dir != NULL) {
+        g_dir_close (dir);
+    }
+
+    if (staged == 0) {
+        return;
+    }
+
+    path = g_build_filename (root, "info", NULL);
+    dir = g_dir_open (path, 0, NULL);
+    while (dir != NULL && (name = g_dir_read_name (dir)) != NULL) {
+        if (!g_str_has_suffix (name, ".trashinfo")) {
+            continue;
+        }
+
+        info_path = g_build_filename (path, name, NULL);
+        file_name = g_strndup (name, strlen (name) - strlen (".trashinfo"));
+        file_path = g_build_filename (root, "files", file_name, NULL);
+
+        if (lstat (file_path, &st) != 0 && errno == ENOENT &&
+            lstat (info_path, &st) == 0 && (gint64) st.st_mtime <= staged / G_USEC_PER_SEC) {
+            g_debug ("Removing orphaned trash info %s", info_path);
+            g_unlink (info_path);
+        }
+
+        g_free (info_path);
+        g_free (file_name);
+        g_free (file_path);
+    }
+    if (dir != NULL) {
+        g_dir_close (dir);
+    }
+    g_free (path);
+}
+
+static gboolean
+expunge_tree (GFile *file, GCancellable *cancellable)
+{
+    GFileEnumerator *enumerator;
+    GFileInfo *info;
+    GFile *child;
+
+    enumerator = g_file_enumerate_children (file,
+                                            G_FILE_ATTRIBUTE_STANDARD_NAME ","
+                                            G_FILE_ATTRIBUTE_STANDARD_TYPE,
+                                            G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                            cancellable,
+                                            NULL);
+    if (enumerator) {
+        while ((info = g_file_enumerator_next_file (enumerator, cancellable, NULL)) != NULL) {
+            child = g_file_get_child (file, g_file_info_get_name (info));
+            if (g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY) {
+                expunge_tree (child, cancellable);
+            } else {
+                g_file_delete (child, cancellable, NULL);
+            }
+            g_object_unref (child);
+            g_object_unref (info);
+        }
+        g_file_enumerator_close (enumerator, cancellable, NULL);
+        g_object_unref (enumerator);
+    }
+
+    return g_file_delete (file, cancellable, NULL);
+}
+
+static void
+expunge_trash_root (const char *root)
+{
+    char *path;
+    GFile *dir;
+#ifdef __linux__
+    FastDelete del = { 0 };
+
+    del.parent_fd = open (root, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (del.parent_fd >= 0) {
+        gboolean ok = fast_delete_tree_at (&del, del.parent_fd, TRASH_EXPUNGE_DIR);
+        close (del.parent_fd);
+        if (ok) {
+            return;
+        }
+    }
+#endif
+
+    path = g_build_filename (root, TRASH_EXPUNGE_DIR, NULL);
+    dir = g_file_new_for_path (path);
+    expunge_tree (dir, NULL);
+    g_object_unref (dir);
+    g_free (path);
+}
+
+static gboolean
+trash_expunge_job (GIOSchedulerJob *io_job,
+                   GCancellable *cancellable,
+                   gpointer user_data)
+{
+    GList *roots = user_data;
+    GList *l;
+
+    /* Reset by the scheduler once done */
+    set_thread_io_background (TRUE);
+
+    G_LOCK (trash_expunge);
+    for (l = roots; l != NULL; l = l->next) {
+        /* Before the staged folders go, they tell when the staging was done */
+        clear_orphaned_trash_info (l->data);
+        expunge_trash_root (l->data);
+    }
+    G_UNLOCK (trash_expunge);
+
+    g_list_free_full (roots, g_free);
+
+    return FALSE;
+}
+
+/* Takes ownership of @roots */
+static void
+trash_expunge_push (GList *roots)
+{
+    GFile *root;
+
+    /* Behind anything the user started on the same device */
+    root = g_file_new_for_path (roots->data);
+    schedule_job (trash_expunge_job, roots, NULL, root, G_PRIORITY_LOW);
+    g_object_unref (root);
+}
+
+void
+marlin_file_operations_resume_trash_expunge (void)
+{
+    GList *roots, *l, *next;
+    char *path;
+
+    roots = get_trash_roots (NULL);
+    for (l = roots; l != NULL; l = next) {
+        next = l->next;
+        path = g_build_filename (l->data, TRASH_EXPUNGE_DIR, NULL);
+        if (!g_file_test (path, G_FILE_TEST_IS_DIR)) {
+            g_free (l->data);
+            roots = g_list_delete_link (roots, l);
+        }
+        g_free (path);
+    }
+
+    if (roots != NULL) {
+        trash_expunge_push (roots);
+    }
+}
+
+static gboolean
+trash_dir_is_staged (GFile *dir, GList *staged)
+{
+    GFile *parent;
+    char *path;
+    gboolean res = FALSE;
+
+    parent = g_file_get_parent (dir);
+    if (parent != NULL) {
+        path = g_file_get_path (parent);
+        res = path != NULL && g_list_find_custom (staged, path, (GCompareFunc) strcmp) != NULL;
+        g_free (path);
+        g_object_unref (parent);
+    }
+
+    return res;
+}
+
 static void
 delete_trash_file (CommonJob *job,
                    GFile *file,
@@ -6133,6 +11091,7 @@ finalize_empty_trash_job (gpointer user_data)
     job = user_data;
 
     g_list_free_full (job->trash_dirs, g_object_unref);
+    g_list_free_full (job->trash_roots, g_free);
 
     finalize_common ((CommonJob *)job);
     return FALSE;
@@ -6159,18 +11118,33 @@ empty_trash_job (GIOSchedulerJob *io_job,
 {
     EmptyTrashJob *job = user_data;
     CommonJob *common;
-    GList *l;
+    GList *l, *staged;
 
     common = (CommonJob *)job;
     common->io_job = io_job;
 
     pf_progress_info_start (job->common.progress);
     if (confirm_empty_trash (job)) {
+        staged = NULL;
+        for (l = job->trash_roots; l != NULL; l = l->next) {
+            if (stage_trash_root (l->data)) {
+                staged = g_list_prepend (staged, g_strdup (l->data));
+            }
+        }
+
+        /* trash:/// itself has no parent, so it is always gone through to pick up
+         * anything that lives in a trash that could not be staged */
         for (l = job->trash_dirs;
              l != NULL && !job_aborted (common);
              l = l->next) {
 
-            delete_trash_file (common, l->data, FALSE, TRUE);
+            if (!trash_dir_is_staged (l->data, staged)) {
+                delete_trash_file (common, l->data, FALSE, TRUE);
+            }
+        }
+
+        if (staged != NULL) {
+            trash_expunge_push (staged);
         }
 
         g_io_scheduler_job_send_to_mainloop_async (io_job,
@@ -6232,6 +11206,8 @@ marlin_file_operations_empty_trash_dirs (GtkWidget *parent_window, GList *dirs)
     else
         job->trash_dirs = g_list_prepend (job->trash_dirs, g_file_new_for_uri ("trash:"));
 
+    job->trash_roots = get_trash_roots (dirs);
+
     inhibit_power_manager ((CommonJob *)job, _("Emptying Trash"));
 
     g_io_scheduler_push_job (empty_trash_job,
@@ -39,6 +39,16 @@ typedef void (* MarlinMountCallback)     (GVolume    *volume,
                                           GObject    *callback_data_object);
 typedef void (* MarlinUnmountCallback)   (gpointer    callback_data);
 
+typedef enum {
+    MARLIN_COPY_FLAGS_NONE = 0,
+    /* Skip files that already exist at the destination with the same size and modification time */
+    MARLIN_COPY_FLAGS_UPDATE = 1 << 0,
+    /* With MARLIN_COPY_FLAGS_UPDATE, also require the contents to be the same */
+    MARLIN_COPY_FLAGS_COMPARE_CONTENTS = 1 << 1,
+    /* Read every copied file back and check that it matches the original */
+    MARLIN_COPY_FLAGS_VERIFY = 1 << 2
+} MarlinCopyFlags;
+
 
 /* Sidebar uses Marlin.FileOperations to mount volumes but handles unmounting itself */
 void marlin_file_operations_mount_volume  (GtkWindow                      *parent_window,
@@ -70,6 +80,27 @@ GList *marlin_file_operations_get_trash_dirs_for_mount (GMount *mount);
 
 void marlin_file_operations_empty_trash (GtkWidget                 *parent_view);
 
+void marlin_file_operations_resume_trash_expunge (void);
+
+void marlin_file_operations_copy            (GList                  *files,
+                                              GArray                 *relative_item_points,
+                                              GFile                  *target_dir,
+                                              GtkWindow              *parent_window,
+                                              MarlinCopyFlags        flags,
+                                              MarlinCopyCallback     done_callback,
+                                              gpointer               done_callback_data);
+
+GList *marlin_file_operations_get_interrupted_copies (void);
+char *marlin_file_operations_describe_interrupted_copy (const char *journal);
+void marlin_file_operations_resume_copy      (const char             *journal,
+                                              GtkWindow              *parent_window,
+                                              MarlinCopyCallback     done_callback,
+                                              gpointer               done_callback_data);
+void marlin_file_operations_discard_interrupted_copy (const char *journal);
+
+/* The XXH64 hash copies are verified with */
+guint64 marlin_file_operations_hash_data (const void *data, gsize len);
+
 void marlin_file_operations_copy_move_link   (GList                  *files,
                                               GArray                 *relative_item_points,
                                               GFile                  *target_dir,
@@ -0,0 +1,42 @@
+/***
+    Copyright (c) 2018 elementary LLC <https://elementary.io>
+
+    This file is part of Pantheon Files.
+
+    Pantheon Files is free software: you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License version 3, as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranties of
+    MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+    PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with Pantheon Files. If not, see <http://www.gnu.org/licenses/>.
+***/
+
+void add_file_operations_tests () {
+    /* Copies are verified with XXH64, these are its published values */
+    Test.add_func ("/FileOperations/hash_empty", () => {
+        assert (Marlin.FileOperations.hash_data ("".data) == 0xEF46DB3751D8E999);
+    });
+
+    Test.add_func ("/FileOperations/hash_short", () => {
+        assert (Marlin.FileOperations.hash_data ("abc".data) == 0x44BC2CF5AD770999);
+    });
+
+    Test.add_func ("/FileOperations/hash_long", () => {
+        /* Long enough to go through the 32 byte stripes */
+        var data = "The quick brown fox jumps over the lazy dog".data;
+        assert (data.length >= 32);
+        assert (Marlin.FileOperations.hash_data (data) == 0x0B242D361FDA71BC);
+    });
+}
+
+int main (string[] args) {
+    Test.init (ref args);
+
+    add_file_operations_tests ();
+    return Test.run ();
+}
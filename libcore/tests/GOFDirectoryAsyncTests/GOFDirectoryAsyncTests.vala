@@ -36,6 +36,10 @@ void add_gof_directory_async_tests () {
     Test.add_func ("/GOFDirectoryAsync/reload_populated_local", () => {
         run_load_folder_test (reload_populated_local_test);
     });
+    /* lookup */
+    Test.add_func ("/GOFDirectoryAsync/lookup_child_local", () => {
+        run_load_folder_test (lookup_child_local_test);
+    });
 }
 
 delegate Async LoadFolderTest (string path, MainLoop loop);
@@ -181,6 +185,39 @@ Async reload_populated_local_test (string test_dir_path, MainLoop loop) {
     return dir;
 }
 
+Async lookup_child_local_test (string test_dir_path, MainLoop loop) {
+    uint n_files = 5;
+
+    var dir = setup_temp_async (test_dir_path, n_files);
+
+    dir.done_loading.connect (() => {
+        /* Children are found by basename */
+        var child = dir.location.get_child ("0");
+        GOF.File? gof = dir.file_hash_lookup_location (child);
+        assert (gof != null);
+        assert (gof.basename == "0");
+        assert (gof.location.equal (child));
+        assert (dir.file_cache_find_or_insert (child) == gof);
+
+        /* The same basename elsewhere is not a child */
+        var other = GLib.File.new_for_path (test_dir_path + "-other").get_child ("0");
+        assert (dir.file_hash_lookup_location (other) == null);
+        var grandchild = child.get_child ("0");
+        assert (dir.file_hash_lookup_location (grandchild) == null);
+        assert (dir.file_hash_lookup_location (dir.location) == null);
+
+        /* Unknown children are added under their basename */
+        var new_child = dir.location.get_child ("new");
+        var new_gof = dir.file_cache_find_or_insert (new_child);
+        assert (new_gof.basename == "new");
+        assert (dir.file_hash_lookup_location (new_child) == new_gof);
+
+        loop.quit ();
+    });
+
+    return dir;
+}
+
 /*** Helper functions ***/
 Async setup_temp_async (string path, uint n_files, string? extension = null, string? path_to_template = null) {
     assert (extension == null || extension.length > 0 || extension.length < 5);
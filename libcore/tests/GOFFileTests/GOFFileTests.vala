@@ -25,6 +25,7 @@ void add_gof_file_tests () {
     Test.add_func ("/GOFFile/new_non_existent_local", new_non_existent_local_test);
     Test.add_func ("/GOFFile/new_hidden_local", new_hidden_local_test);
     Test.add_func ("/GOFFile/new_symlink_local", new_symlink_local_test);
+    Test.add_func ("/GOFFile/lazy_uri", lazy_uri_test);
 }
 
 void existing_local_folder_test () {
@@ -161,6 +162,19 @@ void new_symlink_local_test () {
     Posix.system ("rm -rf " + parent_path);
 }
 
+void lazy_uri_test () {
+    string parent_path = Path.build_filename ("/", "tmp", "marlin-test" + get_real_time ().to_string ());
+    var parent = GLib.File.new_for_path (parent_path);
+    var location = parent.get_child ("with space#");
+
+    /* The uri is built on first use and escaped like GLib.File's own */
+    var file = new GOF.File (location, parent);
+    assert (file.uri == location.get_uri ());
+    assert (file.uri == "file://" + parent_path + "/with%20space%23");
+
+    file.remove_from_caches ();
+}
+
 int main (string[] args) {
     Test.init (ref args);
 
@@ -22,6 +22,7 @@ void add_icon_info_tests () {
     Test.add_func ("/MarlinIconInfo/goffile_icon_update", goffile_icon_update_test);
     Test.add_func ("/MarlinIconInfo/themed_cache_and_ref", themed_cache_and_ref_test);
     Test.add_func ("/MarlinIconInfo/loadable_cache_and_ref", loadable_cache_and_ref_test);
+    Test.add_func ("/MarlinIconInfo/list_model_deferred_pixbuf", list_model_deferred_pixbuf_test);
 }
 
 void goffile_icon_update_test () {
@@ -129,6 +130,41 @@ void loadable_cache_and_ref_test () {
     loop.run ();
 }
 
+void list_model_deferred_pixbuf_test () {
+    string test_dir_path = Path.build_filename (Config.TESTDATA_DIR, "images");
+    string test_file_path = Path.build_filename (test_dir_path, "testimage.png");
+    GOF.File file = GOF.File.get_by_uri (test_file_path);
+    assert (file != null);
+    file.query_update ();
+    file.pix = null;
+
+    var dir = GOF.Directory.Async.from_gfile (GLib.File.new_for_path (test_dir_path));
+    var model = GLib.Object.@new (FM.ListModel.get_type (), "size", 32, null) as FM.ListModel;
+    model.add_file (file, dir);
+
+    Gtk.TreeIter iter;
+    assert (model.get_first_iter_for_file (file, out iter));
+
+    /* The icon renderer draws from this column, asking for it must not resolve the icon */
+    Value val;
+    model.get_value (iter, FM.ListModel.ColumnID.PIXBUF, out val);
+    assert (val.get_object () == null);
+    assert (file.pix == null);
+
+    /* That is done once the rows of the frame have been asked for */
+    var context = MainContext.default ();
+    while (context.pending ()) {
+        context.iteration (false);
+    }
+
+    assert (file.pix != null);
+    assert (file.pix_size == 32);
+    assert (file.pix_scale == 1);
+
+    model.get_value (iter, FM.ListModel.ColumnID.PIXBUF, out val);
+    assert (val.get_object () == file.pix);
+}
+
 int main (string[] args) {
     Test.init (ref args);
 
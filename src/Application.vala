@@ -75,6 +75,16 @@ public class Marlin.Application : Gtk.Application {
         this.volume_monitor = VolumeMonitor.get ();
         this.volume_monitor.mount_removed.connect (mount_removed_callback);
 
+        /* Finish reclaiming the space of trash emptied in a previous session */
+        Marlin.FileOperations.resume_trash_expunge ();
+
+        /* Offer to resume copies interrupted in a previous session once there is a window */
+        ulong resume_handler = 0;
+        resume_handler = this.window_added.connect ((window) => {
+            disconnect (resume_handler);
+            PF.Progress.InfoManager.get_instance ().offer_resume (window);
+        });
+
 #if HAVE_UNITY
         QuicklistHandler.get_singleton ();
 #endif
@@ -247,6 +257,12 @@ public class Marlin.Application : Gtk.Application {
                                    GOF.Preferences.get_default (), "show-remote-thumbnails", GLib.SettingsBindFlags.DEFAULT);
         Preferences.settings.bind ("confirm-trash",
                                    GOF.Preferences.get_default (), "confirm-trash", GLib.SettingsBindFlags.DEFAULT);
+        Preferences.settings.bind ("preserve-hardlinks",
+                                   GOF.Preferences.get_default (), "preserve-hardlinks", GLib.SettingsBindFlags.DEFAULT);
+        Preferences.settings.bind ("delta-copy",
+                                   GOF.Preferences.get_default (), "delta-copy", GLib.SettingsBindFlags.DEFAULT);
+        Preferences.settings.bind ("background-bandwidth-limit",
+                                   GOF.Preferences.get_default (), "background-bandwidth-limit", GLib.SettingsBindFlags.DEFAULT);
         Preferences.settings.bind ("date-format",
                                    GOF.Preferences.get_default (), "date-format", GLib.SettingsBindFlags.DEFAULT);
         Preferences.gnome_interface_settings.bind ("clock-format",
@@ -45,28 +45,15 @@ namespace Marlin {
             }
         }
 
-        public GOF.File? file {
-            get {
-                return _file;
-            }
-            set {
-                _file = value;
-                if (_file != null) {
-                    _file.update_icon (icon_size, icon_scale);
-                }
-            }
-        }
+        public GOF.File? file {get; set;}
+        /* Bound to the model's pixbuf column, which resolves icons in a batch ahead of the
+         * next redraw. Until then it is the previous pixbuf of the file, if any */
+        public Gdk.Pixbuf? pixbuf {get; set;}
 
         private bool show_emblems = true;
         private Marlin.ZoomLevel _zoom_level = Marlin.ZoomLevel.NORMAL;
-        private GOF.File? _file;
         private Marlin.IconSize icon_size;
         private int icon_scale = 1;
-        private unowned Gdk.Pixbuf? pixbuf {
-            get {
-                return _file != null ? _file.pix : null;
-            }
-        }
 
         private ClipboardManager clipboard;
 
@@ -83,10 +70,7 @@ namespace Marlin {
                 return;
             }
 
-            if (widget.get_scale_factor () != icon_scale) {
-                icon_scale = widget.get_scale_factor ();
-                file.update_icon (icon_size, icon_scale);
-            }
+            icon_scale = widget.get_scale_factor ();
 
             Gdk.Pixbuf? pb = pixbuf;
 
@@ -36,6 +36,8 @@ namespace FM {
         }
 
         const int MAX_TEMPLATES = 32;
+        /* Bytes of decoded icons and thumbnails a view holds before those of off-screen rows are dropped */
+        const size_t PIXBUF_BUDGET = 128 * 1024 * 1024;
 
         const Gtk.TargetEntry [] drag_targets = {
             {"text/plain", Gtk.TargetFlags.SAME_APP, Marlin.TargetType.STRING},
@@ -369,6 +371,12 @@ namespace FM {
 
             scroll_event.connect (on_scroll_event);
 
+            /* The model resolves icons at the scale they are drawn at */
+            notify["scale-factor"].connect (() => {
+                model.set_property ("scale", get_scale_factor ());
+                queue_draw ();
+            });
+
             get_vadjustment ().value_changed.connect_after (schedule_thumbnail_timeout);
 
             (GOF.Preferences.get_default ()).notify["show-hidden-files"].connect (on_show_hidden_files_changed);
@@ -1361,6 +1369,7 @@ namespace FM {
             }
 
             model.set_property ("size", icon_size);
+            model.set_property ("scale", get_scale_factor ());
             change_zoom_level ();
         }
 
@@ -2474,6 +2483,8 @@ namespace FM {
                     sp = start_path;
                     ep = end_path;
 
+                    model.trim_pixbufs (sp, ep, PIXBUF_BUDGET);
+
                     /* To improve performance for large folders we thumbnail files on either side of visible region
                      * as well.  The delay is mainly in redrawing the view and this reduces the number of updates and
                      * redraws necessary when scrolling */
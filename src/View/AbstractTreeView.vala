@@ -44,7 +44,8 @@ namespace FM {
 
             name_column.pack_start (icon_renderer, false);
             name_column.set_attributes (icon_renderer,
-                                        "file", FM.ListModel.ColumnID.FILE_COLUMN);
+                                        "file", FM.ListModel.ColumnID.FILE_COLUMN,
+                                        "pixbuf", FM.ListModel.ColumnID.PIXBUF);
 
             name_column.pack_start (name_renderer, true);
             name_column.set_attributes (name_renderer,
@@ -52,6 +52,7 @@ namespace FM {
             (tree as Gtk.CellLayout).add_attribute (name_renderer, "file", FM.ListModel.ColumnID.FILE_COLUMN);
             (tree as Gtk.CellLayout).add_attribute (name_renderer, "background", FM.ListModel.ColumnID.COLOR);
             (tree as Gtk.CellLayout).add_attribute (icon_renderer, "file", FM.ListModel.ColumnID.FILE_COLUMN);
+            (tree as Gtk.CellLayout).add_attribute (icon_renderer, "pixbuf", FM.ListModel.ColumnID.PIXBUF);
 
             connect_tree_signals ();
             tree.realize.connect ((w) => {
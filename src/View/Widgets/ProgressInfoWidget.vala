@@ -63,11 +63,39 @@ public class Marlin.Progress.InfoWidget : Gtk.Box {
         box.pack_start (this.progress_bar, true, false, 0);
         hbox.pack_start (box, true, true, 0);
 
+        var pause_button = new Gtk.ToggleButton ();
+        pause_button.image = new Gtk.Image.from_icon_name ("media-playback-pause-symbolic", Gtk.IconSize.BUTTON);
+        pause_button.tooltip_text = _("Pause");
+        pause_button.get_style_context ().add_class ("flat");
+        pause_button.toggled.connect (() => {
+            if (pause_button.active) {
+                this.info.pause ();
+                pause_button.tooltip_text = _("Resume");
+            } else {
+                this.info.resume ();
+                pause_button.tooltip_text = _("Pause");
+            }
+        });
+
+        var background_button = new Gtk.ToggleButton ();
+        background_button.image = new Gtk.Image.from_icon_name ("go-bottom-symbolic", Gtk.IconSize.BUTTON);
+        background_button.tooltip_text = _("Run in background");
+        background_button.get_style_context ().add_class ("flat");
+        background_button.active = this.info.get_is_background ();
+        background_button.toggled.connect (() => {
+            this.info.set_background (background_button.active);
+        });
+
+        hbox.pack_start (background_button, false, false, 0);
+        hbox.pack_start (pause_button, false, false, 0);
+
         var button = new Gtk.Button.from_icon_name ("process-stop-symbolic", Gtk.IconSize.BUTTON);
         button.get_style_context ().add_class ("flat");
         button.clicked.connect (() => {
             this.info.cancel ();
             button.sensitive = false;
+            pause_button.sensitive = false;
+            background_button.sensitive = false;
         });
 
         hbox.pack_start (button, false, false, 0);